@@ -0,0 +1,226 @@
+/*
+ * ChangeLog.cpp
+ *
+ * Keeps a history of settings changes in the otherwise unused system log
+ * area of EEPROM. Every record has the old and new value so any run of
+ * changes can be undone again.
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+#include "ChangeLog.h"
+#include "DeviceManager.h"
+#include "PrefHandler.h"
+#include "MemCache.h"
+#include "WearLevel.h"
+#include "Logger.h"
+
+ChangeLog changeLog;
+
+static const char *sourceNames[] = {"device", "console", "esp32", "profile", "rollback"};
+
+ChangeLog::ChangeLog()
+{
+    lastSequence = 0;
+    source = CHANGE_DEVICE;
+}
+
+//Find the newest record. WearLevel remembers roughly where that is so normally only the few records
+//written since its last commit have to be looked at. Without a hint the whole ring gets scanned once.
+FLASHMEM void ChangeLog::setup()
+{
+    ChangeRecord rec;
+    uint32_t hint;
+
+    lastSequence = 0;
+    if (wearLevel.get(WL_CHANGELOG, &hint) && hint > 0 && readRecord(hint, &rec))
+    {
+        lastSequence = hint;
+    }
+    else
+    {
+        for (uint32_t i = 0; i < CHANGELOG_NUM_RECORDS; i++)
+        {
+            uint32_t sequence;
+            if (!memCache->ReadDirect(EE_SYS_LOG + i * sizeof(ChangeRecord), &sequence, 4)) continue;
+            if (sequence == 0xFFFFFFFF) continue;
+            if (recordAddress(sequence) != EE_SYS_LOG + i * sizeof(ChangeRecord)) continue; //garbage
+            if (sequence > lastSequence) lastSequence = sequence;
+        }
+    }
+    while (readRecord(lastSequence + 1, &rec)) lastSequence++;
+    Logger::info("Settings change log has %u entries", lastSequence);
+}
+
+uint32_t ChangeLog::recordAddress(uint32_t sequence)
+{
+    return EE_SYS_LOG + (sequence % CHANGELOG_NUM_RECORDS) * sizeof(ChangeRecord);
+}
+
+//false if that record was never written or has been overwritten by a newer one since
+bool ChangeLog::readRecord(uint32_t sequence, ChangeRecord *rec)
+{
+    if (sequence == 0 || sequence == 0xFFFFFFFF) return false;
+    memCache->Read(recordAddress(sequence), rec, sizeof(ChangeRecord));
+    return rec->sequence == sequence;
+}
+
+uint32_t ChangeLog::getSequence()
+{
+    return lastSequence;
+}
+
+//Callers that change settings on someone's behalf say who around their save calls and put it back to
+//CHANGE_DEVICE afterward
+void ChangeLog::setSource(ChangeSource src)
+{
+    source = src;
+}
+
+//One 32 byte write per changed setting. It lands in a page the cache already has most of the time so
+//a whole config save usually costs one extra page write.
+void ChangeLog::record(uint16_t device, uint32_t hash, const void *oldValue, const void *newValue, uint8_t size, bool wasAbsent)
+{
+    ChangeRecord rec;
+    uint32_t now = 0;
+
+    if (IN_INTERRUPT() || size > sizeof(rec.oldValue)) return;
+    wearLevel.get(WL_RUNTIME, &now);
+    memset(&rec, 0, sizeof(rec));
+    rec.sequence = lastSequence + 1;
+    rec.timeStamp = now;
+    rec.device = device;
+    rec.source = source;
+    rec.size = size | (wasAbsent ? CHANGELOG_OLD_ABSENT : 0);
+    rec.hash = hash;
+    memcpy(rec.oldValue, oldValue, size);
+    memcpy(rec.newValue, newValue, size);
+    if (!memCache->Write(recordAddress(rec.sequence), &rec, sizeof(rec))) return;
+    lastSequence = rec.sequence;
+    wearLevel.set(WL_CHANGELOG, lastSequence);
+}
+
+//The log doesn't know the type of a setting, only its size. Unsigned decimal is right most of the time
+static void formatValue(char *buf, size_t len, const uint8_t *value, uint8_t size)
+{
+    uint32_t val = 0;
+    switch (size)
+    {
+    case 1:
+        val = value[0];
+        break;
+    case 2:
+        val = value[0] + (value[1] << 8);
+        break;
+    case 4:
+        memcpy(&val, value, 4);
+        break;
+    default:
+        snprintf(buf, len, "%02X%02X%02X%02X%02X%02X%02X%02X", value[7], value[6], value[5], value[4], value[3], value[2], value[1], value[0]);
+        return;
+    }
+    snprintf(buf, len, "%u", val);
+}
+
+//Show the newest count changes, newest first
+FLASHMEM void ChangeLog::dump(int count)
+{
+    ChangeRecord rec;
+    char oldText[24], newText[24];
+    int shown = 0;
+
+    Logger::console("Settings changes (%u total, newest first):", lastSequence);
+    for (uint32_t seq = lastSequence; seq > 0 && shown < count; seq--, shown++)
+    {
+        if (!readRecord(seq, &rec)) break; //rolled off the end of the ring
+        uint8_t size = rec.size & ~CHANGELOG_OLD_ABSENT;
+        Device *dev = deviceManager.getDeviceByID(rec.device);
+        formatValue(oldText, sizeof(oldText), rec.oldValue, size);
+        formatValue(newText, sizeof(newText), rec.newValue, size);
+        Logger::console("#%u %u.%us %s %s key %08X: %s%s -> %s", rec.sequence, rec.timeStamp / 10, rec.timeStamp % 10,
+                        dev ? dev->getShortName() : "???", (rec.source <= CHANGE_ROLLBACK) ? sourceNames[rec.source] : "?",
+                        rec.hash, oldText, (rec.size & CHANGELOG_OLD_ABSENT) ? " (default)" : "", newText);
+    }
+}
+
+//Undo every change newer than sequence, newest first, so the settings end up exactly as they were right
+//after that record was written. The rollback is logged too so it can be undone the same way.
+FLASHMEM bool ChangeLog::rollback(uint32_t sequence)
+{
+    ChangeRecord rec;
+    Device *touched[CFG_DEV_MGR_MAX_DEVICES];
+    int numTouched = 0;
+    uint32_t newest = lastSequence;
+
+    if (sequence >= newest)
+    {
+        Logger::console("Nothing newer than change %u to roll back", sequence);
+        return false;
+    }
+    //the rollback writes records of its own into the same ring so it can't undo more than half of it
+    if (newest - sequence > CHANGELOG_NUM_RECORDS / 2)
+    {
+        Logger::console("Can only roll back %i changes at once", CHANGELOG_NUM_RECORDS / 2);
+        return false;
+    }
+    //make sure the whole run is still in the ring before touching anything
+    for (uint32_t seq = newest; seq > sequence; seq--)
+    {
+        if (!readRecord(seq, &rec))
+        {
+            Logger::console("Change %u is no longer in the log", seq);
+            return false;
+        }
+    }
+
+    source = CHANGE_ROLLBACK;
+    memCache->beginTransaction();
+    for (uint32_t seq = newest; seq > sequence; seq--)
+    {
+        readRecord(seq, &rec);
+        Device *dev = deviceManager.getDeviceByID(rec.device);
+        if (!dev || !dev->getPrefHandler())
+        {
+            Logger::warn("Change %u was for device %x which isn't here any longer. Skipping it", seq, rec.device);
+            continue;
+        }
+        if (!dev->getPrefHandler()->restoreValue(rec.hash, rec.oldValue, rec.size & ~CHANGELOG_OLD_ABSENT, rec.size & CHANGELOG_OLD_ABSENT))
+        {
+            Logger::error("Couldn't roll back change %u for %s", seq, dev->getShortName());
+        }
+        bool found = false;
+        for (int i = 0; i < numTouched; i++) if (touched[i] == dev) found = true;
+        if (!found && numTouched < CFG_DEV_MGR_MAX_DEVICES) touched[numTouched++] = dev;
+    }
+    for (int i = 0; i < numTouched; i++) touched[i]->getPrefHandler()->saveChecksum();
+    memCache->commitTransaction();
+    source = CHANGE_DEVICE;
+
+    //get the running values in line with what's stored now
+    for (int i = 0; i < numTouched; i++)
+    {
+        touched[i]->loadConfiguration();
+        touched[i]->getPrefHandler()->forceCacheWrite();
+    }
+    Logger::console("Rolled back %u changes to %i devices. Some settings only take effect after a reboot", newest - sequence, numTouched);
+    return true;
+}
@@ -0,0 +1,83 @@
+/*
+ * ChangeLog.h
+ *
+ * Keeps a history of settings changes in the otherwise unused system log
+ * area of EEPROM. Every record has the old and new value so any run of
+ * changes can be undone again.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+#ifndef CHANGELOG_H_
+#define CHANGELOG_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "eeprom_layout.h"
+
+//Who asked for a change. There are no user accounts so where it came from is as close as it gets
+enum ChangeSource
+{
+    CHANGE_DEVICE, //a device saved its own settings (calibration, migrations and such)
+    CHANGE_CONSOLE,
+    CHANGE_ESP32, //web interface. Comes in through the console but is tagged on the way
+    CHANGE_PROFILE,
+    CHANGE_ROLLBACK
+};
+
+//size has this bit set when the setting wasn't stored before the change, the device was using its default
+#define CHANGELOG_OLD_ABSENT    0x80
+
+//32 bytes so 8 fit in a page and a record never straddles two
+typedef struct
+{
+    uint32_t sequence; //0xFFFFFFFF for a slot that was never written
+    uint32_t timeStamp; //total run time in tenths of a second, same clock the fault log uses
+    uint16_t device;
+    uint8_t source;
+    uint8_t size;
+    uint32_t hash; //of the setting's key name
+    uint8_t oldValue[8];
+    uint8_t newValue[8];
+} ChangeRecord;
+
+class ChangeLog {
+public:
+    ChangeLog();
+    void setup();
+    void record(uint16_t device, uint32_t hash, const void *oldValue, const void *newValue, uint8_t size, bool wasAbsent);
+    void setSource(ChangeSource src);
+    void dump(int count);
+    bool rollback(uint32_t sequence);
+    uint32_t getSequence();
+
+private:
+    uint32_t recordAddress(uint32_t sequence);
+    bool readRecord(uint32_t sequence, ChangeRecord *rec);
+
+    uint32_t lastSequence; //newest record written. 0 when the log is empty
+    uint8_t source;
+};
+
+extern ChangeLog changeLog;
+
+#endif /* CHANGELOG_H_ */
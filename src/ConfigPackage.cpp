@@ -0,0 +1,276 @@
+/*
+ * ConfigPackage.cpp
+ *
+ * Compact binary package of every device's stored settings. Only the
+ * settings that are actually stored go in, the whole thing is CRC checked
+ * and it streams to or from a file or the USB port without building a
+ * document in memory first.
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+#include "ConfigPackage.h"
+#include "DeviceManager.h"
+#include "MemCache.h"
+#include "Logger.h"
+#include "Supervisor.h"
+
+ConfigPackage configPackage;
+
+//Pack the stored settings of the device at idx. 0 if it has nothing stored, -1 if there's no such device
+int ConfigPackage::packDevice(int idx, uint8_t *image, CfgBlockHeader *block)
+{
+    Device *dev = deviceManager.getDeviceByIdx(idx);
+    if (!dev || !dev->getPrefHandler()) return -1;
+    int len = dev->getPrefHandler()->exportSettings(image, &block->schemaVersion);
+    if (len <= 0) return len;
+    block->device = dev->getId();
+    block->length = len;
+    block->enabled = dev->isEnabled() ? 1 : 0;
+    block->reserved = 0;
+    return len;
+}
+
+//Two passes over the devices. The first only adds up the sizes so the header can say how long the
+//package is, the second writes it. Nothing bigger than one device's settings is held at a time.
+FLASHMEM bool ConfigPackage::exportTo(Stream *out, uint32_t *bytes)
+{
+    CfgPackageHeader header;
+    CfgBlockHeader block;
+    uint32_t check;
+
+    uint8_t *image = new uint8_t[EE_DEVICE_SIZE - SETTINGS_START];
+    if (!image) return false;
+
+    header.magic = CFGPKG_MAGIC;
+    header.version = CFGPKG_VERSION;
+    header.numBlocks = 0;
+    header.length = 0;
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    {
+        int len = packDevice(i, image, &block);
+        if (len <= 0) continue;
+        header.numBlocks++;
+        header.length += sizeof(block) + len;
+    }
+    if (header.length > CFGPKG_MAX_LENGTH)
+    {
+        Logger::warn("Package is %u bytes. Only up to %u can be imported back in", header.length, (uint32_t)CFGPKG_MAX_LENGTH);
+    }
+
+    out->write((const uint8_t *)&header, sizeof(header));
+    check = crc.crc32((const uint8_t *)&header, sizeof(header));
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    {
+        int len = packDevice(i, image, &block);
+        if (len <= 0) continue;
+        out->write((const uint8_t *)&block, sizeof(block));
+        out->write(image, len);
+        crc.crc32_upd((const uint8_t *)&block, sizeof(block));
+        check = crc.crc32_upd(image, len);
+    }
+    out->write((const uint8_t *)&check, 4);
+    out->flush();
+    delete[] image;
+
+    *bytes = sizeof(header) + header.length + 4;
+    return true;
+}
+
+//CRC first, then that every block is well formed and is from a schema this firmware can migrate from
+FLASHMEM bool ConfigPackage::checkPackage(const CfgPackageHeader *header, const uint8_t *data)
+{
+    CfgBlockHeader block;
+    uint32_t check;
+    uint32_t pos = 0;
+
+    check = crc.crc32((const uint8_t *)header, sizeof(CfgPackageHeader));
+    if (header->length) check = crc.crc32_upd(data, header->length);
+    if (memcmp(&check, &data[header->length], 4))
+    {
+        Logger::error("Configuration package failed its CRC check. Nothing was changed");
+        return false;
+    }
+    for (int i = 0; i < header->numBlocks; i++)
+    {
+        if (pos + sizeof(block) > header->length) break;
+        memcpy(&block, &data[pos], sizeof(block));
+        pos += sizeof(block);
+        if (pos + block.length > header->length || !PrefHandler::checkPacked(&data[pos], block.length)) break;
+        pos += block.length;
+    }
+    if (pos != header->length)
+    {
+        Logger::error("Configuration package is malformed. Nothing was changed");
+        return false;
+    }
+    return true;
+}
+
+//The staged copy in EEPROM is what makes the whole import stick, not the journal. All of the devices
+//together can be far more than the journal holds anyway, and a power cut part way through just means
+//the whole package gets applied again. So the journal is bypassed and every page is written only once.
+FLASHMEM int ConfigPackage::applyPackage(const CfgPackageHeader *header, const uint8_t *data)
+{
+    CfgBlockHeader block;
+    uint32_t pos = 0;
+    int applied = 0;
+
+    memCache->setJournalBypass(true);
+    for (int i = 0; i < header->numBlocks; i++)
+    {
+        supervisor.pet(); //each import is a long operation but a whole package can outlast the watchdog
+        memcpy(&block, &data[pos], sizeof(block));
+        pos += sizeof(block);
+        Device *dev = deviceManager.getDeviceByID((DeviceId)block.device);
+        if (!dev)
+        {
+            Logger::warn("Package has settings for device %X which this firmware doesn't have. Skipping them", block.device);
+        }
+        else if (block.schemaVersion != 0xFFFF && block.schemaVersion > dev->getSchemaVersion())
+        {
+            //migrateSchema would refuse them and the device would run on a layout it doesn't understand
+            Logger::error("Settings for %s are from newer firmware (schema %i, this one has %i). Skipping them",
+                          dev->getShortName(), block.schemaVersion, dev->getSchemaVersion());
+        }
+        else
+        {
+            //finishing an import at start up happens before devices have their own PrefHandler
+            PrefHandler *prefs = dev->getPrefHandler();
+            PrefHandler *temp = nullptr;
+            if (!prefs) prefs = temp = new PrefHandler((DeviceId)block.device);
+            if (!prefs->importSettings(&data[pos], block.length, block.schemaVersion))
+            {
+                Logger::error("Couldn't store the settings for %s", dev->getShortName());
+            }
+            else
+            {
+                PrefHandler::setDeviceStatus(block.device, block.enabled);
+                applied++;
+            }
+            if (temp) delete temp;
+        }
+        pos += block.length;
+    }
+    memCache->setJournalBypass(false);
+    memCache->FlushAllPages(); //every device has to be in EEPROM before the marker can be cleared
+    return applied;
+}
+
+//own transaction so it can't land before the pages written ahead of it
+FLASHMEM void ConfigPackage::setPending(uint32_t marker)
+{
+    memCache->beginTransaction();
+    memCache->Write(EE_CFG_STAGING, marker);
+    memCache->commitTransaction();
+    memCache->FlushAllPages();
+}
+
+//The package is read in whole and checked before anything changes. Then it's copied to the staging
+//area and marked pending before any device gets its settings. A power cut part way through leaves
+//the marker so finishImport applies the whole package again at the next start up.
+FLASHMEM bool ConfigPackage::importFrom(Stream *in, uint32_t *bytes)
+{
+    CfgPackageHeader header;
+    uint8_t *raw = (uint8_t *)&header;
+
+    *bytes = 0;
+    in->setTimeout(CFGPKG_TIMEOUT);
+    //the console runs the command on the CR. A host that sends CRLF still has the LF on its way
+    do
+    {
+        if (in->readBytes((char *)raw, 1) != 1)
+        {
+            Logger::error("No configuration package received");
+            return false;
+        }
+    } while (raw[0] == '\r' || raw[0] == '\n');
+    if (in->readBytes((char *)raw + 1, sizeof(header) - 1) != sizeof(header) - 1)
+    {
+        Logger::error("No configuration package received");
+        return false;
+    }
+    if (header.magic != CFGPKG_MAGIC || header.version != CFGPKG_VERSION)
+    {
+        Logger::error("Not a configuration package this firmware understands");
+        return false;
+    }
+    if (header.length > CFGPKG_MAX_LENGTH)
+    {
+        Logger::error("Configuration package is %u bytes. At most %u can be imported", header.length, (uint32_t)CFGPKG_MAX_LENGTH);
+        return false;
+    }
+
+    uint8_t *data = new uint8_t[header.length + 4];
+    if (!data) return false;
+    if (in->readBytes((char *)data, header.length + 4) != header.length + 4)
+    {
+        Logger::error("Configuration package was cut short");
+        delete[] data;
+        return false;
+    }
+    if (!checkPackage(&header, data))
+    {
+        delete[] data;
+        return false;
+    }
+
+    memCache->Write(EE_CFG_STAGING + 256, &header, sizeof(header));
+    memCache->Write(EE_CFG_STAGING + 256 + sizeof(header), data, header.length + 4);
+    memCache->FlushAllPages(); //the package has to be all there before the marker says so
+    setPending(CFGPKG_PENDING);
+    int applied = applyPackage(&header, data);
+    setPending(0);
+    delete[] data;
+
+    *bytes = sizeof(header) + header.length + 4;
+    Logger::console("Imported settings for %i devices", applied);
+    return true;
+}
+
+//Called at start up before any device loads its settings. Applies a staged package again if the import
+//didn't get to clear its marker. Devices that already got their settings just get the same ones again.
+FLASHMEM void ConfigPackage::finishImport()
+{
+    CfgPackageHeader header;
+    uint32_t marker;
+
+    memCache->Read(EE_CFG_STAGING, &marker);
+    if (marker != CFGPKG_PENDING) return;
+    memCache->Read(EE_CFG_STAGING + 256, &header, sizeof(header));
+    if (header.magic != CFGPKG_MAGIC || header.version != CFGPKG_VERSION || header.length > CFGPKG_MAX_LENGTH)
+    {
+        Logger::error("Staged configuration package is unreadable. The interrupted import can't be finished");
+        setPending(0);
+        return;
+    }
+    uint8_t *data = new uint8_t[header.length + 4];
+    if (!data) return;
+    memCache->Read(EE_CFG_STAGING + 256 + sizeof(header), data, header.length + 4);
+    if (checkPackage(&header, data))
+    {
+        Logger::warn("Configuration import was interrupted. Finishing it");
+        Logger::info("Imported settings for %i devices", applyPackage(&header, data));
+    }
+    setPending(0);
+    delete[] data;
+}
@@ -0,0 +1,86 @@
+/*
+ * ConfigPackage.h
+ *
+ * Compact binary package of every device's stored settings. Only the
+ * settings that are actually stored go in, the whole thing is CRC checked
+ * and it streams to or from a file or the USB port without building a
+ * document in memory first.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+#ifndef CONFIGPACKAGE_H_
+#define CONFIGPACKAGE_H_
+
+#include <Arduino.h>
+#include <FastCRC.h>
+#include "config.h"
+#include "eeprom_layout.h"
+#include "PrefHandler.h"
+
+#define CFGPKG_MAGIC        0x47434647 //GCFG
+#define CFGPKG_VERSION      1
+#define CFGPKG_TIMEOUT      5000 //milliseconds an import waits for more bytes before giving up
+#define CFGPKG_PENDING      0x444E4550 //"PEND" at EE_CFG_STAGING while a staged import isn't finished
+
+//Start of a package. After it come numBlocks blocks (length bytes all together) then a CRC32 of
+//everything before it, header included
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t numBlocks;
+    uint32_t length;
+} CfgPackageHeader;
+
+//One per device that has stored settings. Followed by length bytes of settings in the same
+//[hash][length][value] form they have in EEPROM
+typedef struct
+{
+    uint16_t device;
+    uint16_t schemaVersion;
+    uint16_t length;
+    uint8_t enabled;
+    uint8_t reserved;
+} CfgBlockHeader;
+
+//largest package there can be, not counting the header and CRC. Imports are buffered whole so nothing is
+//applied before the CRC checks out, then staged in EEPROM so they can be finished after a power cut
+#define CFGPKG_MAX_LENGTH   ((CFG_STAGING_PAGES - 1) * 256 - sizeof(CfgPackageHeader) - 4)
+
+class ConfigPackage {
+public:
+    bool exportTo(Stream *out, uint32_t *bytes);
+    bool importFrom(Stream *in, uint32_t *bytes);
+    void finishImport();
+
+private:
+    int packDevice(int idx, uint8_t *image, CfgBlockHeader *block);
+    bool checkPackage(const CfgPackageHeader *header, const uint8_t *data);
+    int applyPackage(const CfgPackageHeader *header, const uint8_t *data);
+    void setPending(uint32_t marker);
+    FastCRC32 crc;
+};
+
+extern ConfigPackage configPackage;
+
+#endif /* CONFIGPACKAGE_H_ */
@@ -0,0 +1,255 @@
+/*
+ * ControlLane.cpp
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+
+#include "ControlLane.h"
+#include <TeensyTimerTool.h>
+#include "DeviceManager.h"
+#include "SysClock.h"
+#include "Supervisor.h"
+#include "ProfileManager.h"
+#include "devices/io/Throttle.h"
+#include "devices/motorctrl/MotorController.h"
+#include "devices/charger/ChargeController.h"
+
+using namespace TeensyTimerTool;
+
+//TMR1 isn't used by TickHandler so the lane gets its own timer and its own interrupt priority
+PeriodicTimer laneTimer(TMR1);
+
+static void laneTrampoline()
+{
+    controlLane.handleInterrupt();
+}
+
+ControlLane::ControlLane()
+{
+    running = false;
+    accelerator = nullptr;
+    brake = nullptr;
+    motorController = nullptr;
+    charger = nullptr;
+    stagedIdx = 0;
+    stageSeq = 0;
+    memset(staged, 0, sizeof(staged));
+    resetStats();
+}
+
+//Only enabled devices count. DeviceManager's own cached throttle / motor controller aren't cleared when one
+//gets disabled so this goes straight to getDeviceByType.
+FLASHMEM void ControlLane::lookupDevices(Throttle *&accel, Throttle *&brk, MotorController *&motor, ChargeController *&chg)
+{
+    accel = static_cast<Throttle *>(deviceManager.getDeviceByType(DeviceType::DEVICE_THROTTLE));
+    brk = static_cast<Throttle *>(deviceManager.getDeviceByType(DeviceType::DEVICE_BRAKE));
+    motor = static_cast<MotorController *>(deviceManager.getDeviceByType(DeviceType::DEVICE_MOTORCTRL));
+    chg = static_cast<ChargeController *>(deviceManager.getDeviceByType(DeviceType::DEVICE_CHARGER));
+}
+
+/*
+ * Must be called after the devices are all initialized. The device pointers are looked up
+ * here and in refreshDevices because the lookups can log and the interrupt must never do that.
+ * If there's no motor controller and no throttle there's nothing to do so the lane isn't started.
+ */
+FLASHMEM void ControlLane::setup()
+{
+#ifdef CFG_CONTROL_LANE_HZ
+    stop();
+    lookupDevices(accelerator, brake, motorController, charger);
+
+    if (!accelerator && !motorController)
+    {
+        Logger::info("Control lane not started - no throttle or motor controller");
+        return;
+    }
+
+    resetStats();
+    running = true;
+    laneTimer.begin(laneTrampoline, getInterval());
+    NVIC_SET_PRIORITY(IRQ_QTIMER1, CFG_CONTROL_LANE_PRIORITY);
+    supervisor.watch(this, SUPERVISOR_ID_CONTROL_LANE, getInterval());
+    Logger::info("Control lane running at %iHz", CFG_CONTROL_LANE_HZ);
+#endif
+}
+
+/*
+ * Call whenever a device is enabled or disabled while running, after its setup or disableDevice. Device
+ * objects never go away so the lane using one for a few more cycles is harmless. The lane's interrupt is
+ * masked while the pointers change so a cycle never runs with a mix of old and new devices.
+ */
+FLASHMEM void ControlLane::refreshDevices()
+{
+    Throttle *newAccel, *newBrake;
+    MotorController *newMotor;
+    ChargeController *newCharger;
+
+    if (!running) return;
+    lookupDevices(newAccel, newBrake, newMotor, newCharger); //can log so not with the interrupt masked
+
+    NVIC_DISABLE_IRQ(IRQ_QTIMER1);
+    accelerator = newAccel;
+    brake = newBrake;
+    motorController = newMotor;
+    charger = newCharger;
+    NVIC_ENABLE_IRQ(IRQ_QTIMER1);
+
+    if (!accelerator && !motorController)
+    {
+        stop();
+        Logger::info("Control lane stopped - no throttle or motor controller left");
+    }
+}
+
+void ControlLane::stop()
+{
+    laneTimer.stop();
+    running = false;
+    supervisor.unwatch(this);
+}
+
+bool ControlLane::isRunning()
+{
+    return running;
+}
+
+uint32_t ControlLane::getInterval()
+{
+#ifdef CFG_CONTROL_LANE_HZ
+    return 1000000ul / CFG_CONTROL_LANE_HZ;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * The actual control cycle. Runs in interrupt context so nothing in here is allowed to
+ * block, log or touch EEPROM. Faults raised from in here get deferred by the fault handler.
+ */
+void ControlLane::handleInterrupt()
+{
+    uint32_t startCycles = ARM_DWT_CYCCNT;
+    uint32_t interval = getInterval();
+
+    //jitter is how far off the actual period was from the nominal one
+    if (cycleCount > 0)
+    {
+        uint32_t period = (startCycles - lastStartCycles) / (F_CPU_ACTUAL / 1000000);
+        uint32_t jitter = (period > interval) ? (period - interval) : (interval - period);
+        if (jitter > maxJitter) maxJitter = jitter;
+        addToHistogram(jitterHist, jitter);
+    }
+    lastStartCycles = startCycles;
+    cycleCount++;
+
+    profileManager.applyStaged(); //a pending profile switch goes live before anything samples its settings
+
+    if (accelerator) accelerator->sample(interval);
+    if (brake) brake->sample(interval);
+    if (motorController)
+    {
+        motorController->arbitrateThrottle(accelerator, brake, charger);
+        motorController->slewTorque(interval);
+
+        //stage into the buffer nobody is reading then flip. A reader that started on the old one
+        //still has valid (if one cycle old) data.
+        uint8_t next = stagedIdx ^ 1;
+        stageSeq++;
+        portMEMORY_BARRIER();
+        staged[next].throttle = motorController->getThrottle();
+        staged[next].torque = motorController->getSlewedTorque();
+        staged[next].sequence = cycleCount;
+        staged[next].timestamp = sysClock->micros();
+        portMEMORY_BARRIER();
+        stagedIdx = next;
+        portMEMORY_BARRIER();
+        stageSeq++;
+    }
+
+    uint32_t execTime = (ARM_DWT_CYCCNT - startCycles) / (F_CPU_ACTUAL / 1000000);
+    if (execTime > maxExecTime) maxExecTime = execTime;
+    if (execTime > CFG_CONTROL_LANE_BUDGET) overruns++;
+    addToHistogram(execHist, execTime);
+    supervisor.checkIn(this);
+}
+
+//Get the most recently staged command. Safe to call from the main loop at any time.
+void ControlLane::getCommand(ControlCommand *cmd)
+{
+    uint32_t seq;
+    //the lane can't be interrupted by us but it can interrupt us. stageSeq is odd while it's staging and
+    //goes up again when it's done, so if it's odd or moved while we were copying then copy again.
+    //The lane runs at most every millisecond so this can't loop for long.
+    do
+    {
+        seq = stageSeq;
+        portMEMORY_BARRIER();
+        *cmd = staged[stagedIdx];
+        portMEMORY_BARRIER();
+    } while ((seq & 1) || seq != stageSeq);
+}
+
+void ControlLane::addToHistogram(uint32_t *hist, uint32_t micros)
+{
+    int bucket = 0;
+    while (micros > 0 && bucket < (CONTROL_LANE_HIST_BUCKETS - 1))
+    {
+        micros >>= 1;
+        bucket++;
+    }
+    hist[bucket]++;
+}
+
+void ControlLane::resetStats()
+{
+    cycleCount = 0;
+    overruns = 0;
+    maxExecTime = 0;
+    maxJitter = 0;
+    lastStartCycles = 0;
+    for (int i = 0; i < CONTROL_LANE_HIST_BUCKETS; i++)
+    {
+        execHist[i] = 0;
+        jitterHist[i] = 0;
+    }
+}
+
+FLASHMEM void ControlLane::dumpStats()
+{
+    if (!running)
+    {
+        Logger::console("Control lane is not running");
+        return;
+    }
+    Logger::console("Control lane: %u cycles at %uus, %u overruns (budget %uus)", cycleCount, getInterval(), overruns, CFG_CONTROL_LANE_BUDGET);
+    Logger::console("Max execution time: %uus  Max jitter: %uus", maxExecTime, maxJitter);
+    Logger::console("   Bucket        Exec     Jitter");
+    for (int i = 0; i < CONTROL_LANE_HIST_BUCKETS - 1; i++)
+    {
+        Logger::console("  <%5uus  %10u %10u", 1ul << i, execHist[i], jitterHist[i]);
+    }
+    Logger::console(" >=%5uus  %10u %10u", 1ul << (CONTROL_LANE_HIST_BUCKETS - 2), execHist[CONTROL_LANE_HIST_BUCKETS - 1], jitterHist[CONTROL_LANE_HIST_BUCKETS - 1]);
+}
+
+ControlLane controlLane;
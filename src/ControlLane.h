@@ -0,0 +1,94 @@
+/*
+ * ControlLane.h
+ *
+ * The control lane is a small, fixed rate, high priority interrupt that does the
+ * latency sensitive part of driving: sample the pedals, map them, arbitrate between
+ * accelerator and brake and slew the torque request. The result is staged so the
+ * motor controller drivers can pick up a consistent command whenever they transmit.
+ * Everything else (telemetry, housekeeping, EEPROM) stays on the main loop.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef CONTROLLANE_H_
+#define CONTROLLANE_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+class Throttle;
+class MotorController;
+class ChargeController;
+
+//log2 buckets in microseconds. Bucket 0 is under 1us, bucket 1 is 1us, bucket 2 is 2-3us, 3 is 4-7us and so on.
+//The last bucket catches everything bigger.
+#define CONTROL_LANE_HIST_BUCKETS   12
+
+//what the control lane produces every cycle. Motor controller drivers should read it with getCommand()
+struct ControlCommand {
+    int16_t throttle; //-1000 to 1000 after accelerator / brake arbitration
+    float torque; //slewed torque request in Nm
+    uint32_t sequence; //incremented every cycle so a reader can tell if it is looking at stale data
+    uint32_t timestamp; //sysClock micros when this was staged
+};
+
+class ControlLane {
+public:
+    ControlLane();
+    void setup();
+    void refreshDevices();
+    void stop();
+    bool isRunning();
+    uint32_t getInterval();
+    void handleInterrupt(); //public so the timer callback can get here
+    void getCommand(ControlCommand *cmd);
+    void dumpStats();
+    void resetStats();
+
+private:
+    void addToHistogram(uint32_t *hist, uint32_t micros);
+    void lookupDevices(Throttle *&accel, Throttle *&brk, MotorController *&motor, ChargeController *&chg);
+
+    volatile bool running;
+    Throttle *accelerator;
+    Throttle *brake;
+    MotorController *motorController;
+    ChargeController *charger;
+
+    ControlCommand staged[2]; //double buffered so readers never see a half written command
+    volatile uint8_t stagedIdx; //which of the above is the current one
+    volatile uint32_t stageSeq; //odd while the lane is staging. getCommand retries if it changed under it
+
+    uint32_t lastStartCycles;
+    uint32_t cycleCount;
+    uint32_t overruns;
+    uint32_t maxExecTime;
+    uint32_t maxJitter;
+    uint32_t execHist[CONTROL_LANE_HIST_BUCKETS];
+    uint32_t jitterHist[CONTROL_LANE_HIST_BUCKETS];
+};
+
+extern ControlLane controlLane;
+
+#endif /* CONTROLLANE_H_ */
+
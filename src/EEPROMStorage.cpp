@@ -0,0 +1,406 @@
+/*
+ * EEPROMStorage.cpp
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "EEPROMStorage.h"
+#include "SysClock.h"
+#include "Logger.h"
+#ifdef __IMXRT1062__
+#include "i2c_driver_wire.h"
+#include "imx_rt1060_i2c_driver.h"
+
+static I2CEEPROM i2cEEPROM;
+EEPROMStorage *eepromStorage = &i2cEEPROM;
+#else
+//host builds have no chip. Whoever runs the code has to install a FileEEPROM first
+EEPROMStorage *eepromStorage = nullptr;
+#endif
+
+bool EEPROMStorage::readPages(uint32_t firstPage, uint8_t * const *buffers, uint16_t numPages)
+{
+    for (uint16_t i = 0; i < numPages; i++)
+    {
+        if (!read((firstPage + i) * EEPROM_PAGE_SIZE, buffers[i], EEPROM_PAGE_SIZE)) return false;
+    }
+    return true;
+}
+
+void EEPROMStorage::setBulkMode(bool bulk)
+{
+}
+
+#ifdef __IMXRT1062__
+
+//Wire calls this right before it starts a transfer of its own
+static void eepromBusHandoff()
+{
+    i2cEEPROM.takeResult();
+}
+
+I2CEEPROM::I2CEEPROM()
+{
+    writeAddress = 0;
+    writeStart = 0;
+    normalClock = 0;
+    state = State::IDLE;
+    resultTaken = false;
+    resultFailed = false;
+    resultError = I2CError::ok;
+}
+
+//Our transfer is over and someone else is about to use the bus. Keep how ours went
+void I2CEEPROM::takeResult()
+{
+    if (state == State::IDLE || resultTaken) return;
+    resultFailed = Master.has_error();
+    resultError = Master.error();
+    resultTaken = true;
+}
+
+void I2CEEPROM::startTransfer()
+{
+    resultTaken = false;
+    Wire.onBusHandoff(eepromBusHandoff);
+}
+
+//Result of our own last transfer, not of whatever used the bus after it. Only valid once Master is finished
+bool I2CEEPROM::transferFailed()
+{
+    if (resultTaken) return resultFailed;
+    return Master.has_error();
+}
+
+//10100 is the chip ID then the two upper bits of the address
+uint8_t I2CEEPROM::chipID(uint32_t address)
+{
+    return 0b01010000 + ((address >> 16) & 0x03);
+}
+
+bool I2CEEPROM::read(uint32_t address, uint8_t *data, uint16_t len)
+{
+    uint16_t pages = (len + EEPROM_PAGE_SIZE - 1) / EEPROM_PAGE_SIZE;
+    uint8_t buffer[2];
+    uint8_t i2c_id = chipID(address);
+
+    if (len == 0) return true;
+    buffer[0] = ((address & 0xFF00) >> 8);
+    buffer[1] = (address & 0x00FF);
+    Wire.beginTransmission(i2c_id);
+    Wire.write(buffer, 2);
+    if (Wire.endTransmission(false) != 0) return false; //do NOT generate stop
+
+    //the driver only reads 256 bytes at a time. Reads after the first are current address reads so the chip
+    //just carries on from where it stopped
+    for (uint16_t i = 0; i < pages; i++)
+    {
+        uint16_t chunk = (i == pages - 1) ? (len - i * EEPROM_PAGE_SIZE) : EEPROM_PAGE_SIZE;
+        Master.read_async(i2c_id, data + (i * EEPROM_PAGE_SIZE), chunk, (i == pages - 1)); //stop only after the last one
+        while (!Master.finished()) ;
+        if (Master.has_error() || Master.get_bytes_transferred() != chunk) return false;
+    }
+    return true;
+}
+
+//Same as read but each page can go somewhere different. The address only goes out once.
+bool I2CEEPROM::readPages(uint32_t firstPage, uint8_t * const *buffers, uint16_t numPages)
+{
+    uint32_t address = firstPage * EEPROM_PAGE_SIZE;
+    uint8_t buffer[2];
+    uint8_t i2c_id = chipID(address);
+
+    buffer[0] = ((address & 0xFF00) >> 8);
+    buffer[1] = 0;
+    Wire.beginTransmission(i2c_id);
+    Wire.write(buffer, 2);
+    if (Wire.endTransmission(false) != 0) return false;
+
+    for (uint16_t i = 0; i < numPages; i++)
+    {
+        Master.read_async(i2c_id, buffers[i], EEPROM_PAGE_SIZE, (i == numPages - 1));
+        while (!Master.finished()) ;
+        if (Master.has_error() || Master.get_bytes_transferred() != EEPROM_PAGE_SIZE) return false;
+    }
+    return true;
+}
+
+bool I2CEEPROM::startWrite(uint32_t address, const uint8_t *data, uint16_t len)
+{
+    if (state != State::IDLE) return false;
+    if (!Master.finished()) return false; //someone else is using the bus. Try again shortly
+    //the chip takes a start address anywhere in the page and writes from there as long as we don't run off the end
+    txBuffer[0] = ((address & 0xFF00) >> 8);
+    txBuffer[1] = (address & 0x00FF);
+    memcpy(&txBuffer[2], data, len);
+    writeAddress = address;
+    state = State::SENDING;
+    startTransfer();
+    Master.write_async(chipID(address), txBuffer, len + 2, true);
+    return true;
+}
+
+StorageWrite I2CEEPROM::serviceWrite()
+{
+    if (state == State::IDLE) return StorageWrite::DONE;
+    if (!Master.finished()) return StorageWrite::BUSY; //bus is still busy with whatever we last asked of it
+
+    if (state == State::SENDING)
+    {
+        if (transferFailed())
+        {
+            Logger::error("EEPROM write of page %x failed (error %i)", writeAddress & 0xFFFF00,
+                          (int)(resultTaken ? resultError : Master.error()));
+            state = State::IDLE;
+            return StorageWrite::FAILED;
+        }
+        state = State::POLLING;
+        writeStart = sysClock->micros();
+        pollChip();
+        return StorageWrite::BUSY;
+    }
+
+    //POLLING - the last poll is done. An ACK means the chip finished its write
+    if (!transferFailed())
+    {
+        state = State::IDLE;
+        return StorageWrite::DONE;
+    }
+    if ((sysClock->micros() - writeStart) > EEPROM_WRITE_TIMEOUT)
+    {
+        Logger::error("EEPROM never finished writing page %x", writeAddress & 0xFFFF00);
+        state = State::IDLE;
+        return StorageWrite::FAILED;
+    }
+    pollChip();
+    return StorageWrite::BUSY;
+}
+
+//zero length write. The chip either ACKs its address (done writing) or it doesn't (still busy)
+void I2CEEPROM::pollChip()
+{
+    startTransfer();
+    Master.write_async(chipID(writeAddress), nullptr, 0, true);
+}
+
+void I2CEEPROM::setBulkMode(bool bulk)
+{
+    if (bulk)
+    {
+        normalClock = Wire.getClock();
+        Wire.setClock(EEPROM_BULK_CLOCK);
+    }
+    else if (normalClock) Wire.setClock(normalClock);
+    else return;
+    Wire.begin();
+}
+#endif
+
+FileEEPROM::FileEEPROM(const char *path)
+{
+    this->path = path;
+    file = nullptr;
+    image = nullptr;
+    wear = nullptr;
+    writeTime = 5000;
+    endurance = 1000000;
+    powerBudget = 0;
+    powerCut = false;
+    lostPower = false;
+    writing = false;
+    writeStart = 0;
+    wornBytes = 0;
+    bytesWritten = 0;
+    busClock = 0;
+    bulk = false;
+}
+
+FileEEPROM::~FileEEPROM()
+{
+    if (file) fclose(file);
+    free(image);
+    free(wear);
+}
+
+bool FileEEPROM::begin()
+{
+    if (!image) image = (uint8_t *)malloc(EEPROM_SIZE);
+    if (!wear) wear = (uint32_t *)calloc(EEPROM_SIZE, sizeof(uint32_t));
+    if (!image || !wear) return false;
+    memset(image, 0xFF, EEPROM_SIZE); //a blank chip reads all FF
+
+    if (file) fclose(file);
+    file = fopen(path, "r+b");
+    if (file)
+    {
+        fread(image, 1, EEPROM_SIZE, file); //a short file just means the rest is still blank
+    }
+    else
+    {
+        file = fopen(path, "w+b");
+        if (!file) return false;
+    }
+    fseek(file, 0, SEEK_SET);
+    fwrite(image, 1, EEPROM_SIZE, file);
+    fflush(file);
+    return true;
+}
+
+//The real chip doesn't answer at all while it's writing
+bool FileEEPROM::read(uint32_t address, uint8_t *data, uint16_t len)
+{
+    if (!image || lostPower) return false;
+    if (serviceWrite() == StorageWrite::BUSY) return false;
+    if (address + len > EEPROM_SIZE) return false;
+    memcpy(data, &image[address], len);
+    busTime(4 + len); //chip ID, two address bytes, chip ID again then the data
+    return true;
+}
+
+//One transfer for the lot, the same as the real chip. Each page is its own read request after the first
+bool FileEEPROM::readPages(uint32_t firstPage, uint8_t * const *buffers, uint16_t numPages)
+{
+    if (!image || lostPower) return false;
+    if (serviceWrite() == StorageWrite::BUSY) return false;
+    if ((firstPage + numPages) * EEPROM_PAGE_SIZE > EEPROM_SIZE) return false;
+    for (uint16_t i = 0; i < numPages; i++)
+    {
+        memcpy(buffers[i], &image[(firstPage + i) * EEPROM_PAGE_SIZE], EEPROM_PAGE_SIZE);
+    }
+    busTime(3 + numPages * (1 + EEPROM_PAGE_SIZE));
+    return true;
+}
+
+void FileEEPROM::setBulkMode(bool bulk)
+{
+    this->bulk = bulk;
+}
+
+void FileEEPROM::setBusClock(uint32_t hz)
+{
+    busClock = hz;
+}
+
+//9 clocks a byte counting the ACK, plus the start, repeated start and stop
+void FileEEPROM::busTime(uint32_t bytes)
+{
+    if (!busClock) return;
+    uint64_t clocks = (uint64_t)bytes * 9 + 3;
+    sysClock->delayMicroseconds((uint32_t)(clocks * 1000000ull / (bulk ? EEPROM_BULK_CLOCK : busClock)));
+}
+
+//Like the chip, anything that runs off the end of the page wraps around to the start of the same page
+bool FileEEPROM::startWrite(uint32_t address, const uint8_t *data, uint16_t len)
+{
+    uint32_t pageStart = address & ~(uint32_t)(EEPROM_PAGE_SIZE - 1);
+    uint32_t offset = address - pageStart;
+
+    if (!image || writing || address >= EEPROM_SIZE) return false;
+    if (lostPower) return true; //the write "happens" as far as the caller can tell. Nothing is stored
+
+    for (uint16_t i = 0; i < len; i++)
+    {
+        if (powerCut && powerBudget-- == 0)
+        {
+            lostPower = true;
+            break;
+        }
+        uint32_t a = pageStart + ((offset + i) % EEPROM_PAGE_SIZE);
+        if (wear[a] >= endurance) continue; //worn out cells stop taking new values
+        wear[a]++;
+        if (wear[a] == endurance) wornBytes++;
+        image[a] = data[i];
+        bytesWritten++;
+    }
+
+    if (file)
+    {
+        fseek(file, pageStart, SEEK_SET);
+        fwrite(&image[pageStart], 1, EEPROM_PAGE_SIZE, file);
+        fflush(file);
+    }
+    busTime(3 + len); //chip ID and two address bytes then the data
+    writing = true;
+    writeStart = sysClock->micros();
+    return true;
+}
+
+StorageWrite FileEEPROM::serviceWrite()
+{
+    if (!writing) return StorageWrite::DONE;
+    if ((sysClock->micros() - writeStart) < writeTime) return StorageWrite::BUSY;
+    writing = false;
+    return StorageWrite::DONE;
+}
+
+void FileEEPROM::setWriteTime(uint32_t micros)
+{
+    writeTime = micros;
+}
+
+void FileEEPROM::setEndurance(uint32_t cycles)
+{
+    endurance = cycles;
+}
+
+void FileEEPROM::cutPowerAfter(uint32_t bytes)
+{
+    powerCut = true;
+    powerBudget = bytes;
+    lostPower = false;
+}
+
+void FileEEPROM::restorePower()
+{
+    powerCut = false;
+    lostPower = false;
+}
+
+bool FileEEPROM::powerLost()
+{
+    return lostPower;
+}
+
+uint32_t FileEEPROM::getWrites(uint32_t address)
+{
+    if (!wear || address >= EEPROM_SIZE) return 0;
+    return wear[address];
+}
+
+uint32_t FileEEPROM::getWornBytes()
+{
+    return wornBytes;
+}
+
+uint32_t FileEEPROM::getBytesWritten()
+{
+    return bytesWritten;
+}
+
+void setEEPROMStorage(EEPROMStorage *storage)
+{
+#ifdef __IMXRT1062__
+    if (!storage) storage = &i2cEEPROM;
+#endif
+    eepromStorage = storage;
+}
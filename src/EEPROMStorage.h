@@ -0,0 +1,157 @@
+/*
+ * EEPROMStorage.h
+ *
+ * Where MemCache gets its bytes from. On the hardware that's the 256k I2C
+ * EEPROM. Off target it can be a file that acts like the chip does - writes
+ * wrap at page boundaries, take time to finish and wear out - so the settings,
+ * fault and odometer code can be benchmarked and tested on a PC.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef EEPROM_STORAGE_H_
+#define EEPROM_STORAGE_H_
+
+#include <Arduino.h>
+#include <stdio.h>
+#include "i2c_driver.h"
+
+#define EEPROM_PAGE_SIZE            256
+#define EEPROM_SIZE                 262144
+
+//datasheet says a page write takes at most 10ms and the chip NAKs everything until it's done. We poll for
+//the ACK instead of waiting but if it still isn't answering after this long something is very wrong.
+#define EEPROM_WRITE_TIMEOUT        25000
+
+//bus speed used for bulk reads (the prefetch at start up). The EEPROM is good for fast mode plus (1MHz).
+//The PCA I/O expander on the same bus is only rated for 400kHz but it ignores traffic that isn't addressed
+//to it. The bus goes back to its normal speed afterward.
+#define EEPROM_BULK_CLOCK           1000000
+
+enum class StorageWrite
+{
+    BUSY, //still going
+    DONE, //data is safely stored
+    FAILED
+};
+
+class EEPROMStorage {
+public:
+    virtual ~EEPROMStorage() {}
+    //Blocking read. Must not cross a 64k boundary (the chip's address counter wraps there)
+    virtual bool read(uint32_t address, uint8_t *data, uint16_t len) = 0;
+    //Read numPages whole pages starting at firstPage, each into its own buffer
+    virtual bool readPages(uint32_t firstPage, uint8_t * const *buffers, uint16_t numPages);
+    //Start writing. Must stay within one page. False if the write couldn't be started right now
+    virtual bool startWrite(uint32_t address, const uint8_t *data, uint16_t len) = 0;
+    //Keep the write started above moving along. Reports BUSY until it's over one way or the other
+    virtual StorageWrite serviceWrite() = 0;
+    //Go as fast as possible for a while. Only used while nothing else should be using the bus
+    virtual void setBulkMode(bool bulk);
+};
+
+//The real chip. Writes go out in the background with the async I2C driver then the chip's address is
+//polled until it ACKs, which it does once its internal write is done.
+class I2CEEPROM : public EEPROMStorage {
+public:
+    I2CEEPROM();
+    bool read(uint32_t address, uint8_t *data, uint16_t len);
+    bool readPages(uint32_t firstPage, uint8_t * const *buffers, uint16_t numPages);
+    bool startWrite(uint32_t address, const uint8_t *data, uint16_t len);
+    StorageWrite serviceWrite();
+    void setBulkMode(bool bulk);
+    void takeResult();
+
+private:
+    enum class State
+    {
+        IDLE, //nothing on the bus
+        SENDING, //page data is being clocked out to the chip
+        POLLING //chip is doing its internal write. Poll its address until it ACKs again
+    };
+    uint8_t txBuffer[EEPROM_PAGE_SIZE + 2]; //two address bytes then the data
+    uint32_t writeAddress;
+    uint32_t writeStart; //sysClock micros when the chip started its internal write
+    uint32_t normalClock; //bus speed to go back to after bulk mode
+    State state;
+    //Master only remembers how its latest transfer went and Wire (the PCA I/O expander) shares it. If Wire
+    //gets the bus between our transfer and the next service call the result is saved here first.
+    volatile bool resultTaken;
+    volatile bool resultFailed;
+    volatile I2CError resultError;
+    uint8_t chipID(uint32_t address);
+    void startTransfer();
+    bool transferFailed();
+    void pollChip();
+};
+
+//A file standing in for the chip. The whole image is kept in RAM and every write is pushed straight to the
+//file so a run that dies leaves behind exactly what the chip would hold. Timing comes from sysClock so it
+//works with the simulated clock too. Reads are instant unless a bus clock is set, then they take as long
+//as clocking the bytes over I2C would and bulk mode speeds that up like it does on the real bus.
+class FileEEPROM : public EEPROMStorage {
+public:
+    FileEEPROM(const char *path);
+    ~FileEEPROM();
+    bool begin(); //opens the file, creating a blank (all 0xFF) one if needed
+    bool read(uint32_t address, uint8_t *data, uint16_t len);
+    bool readPages(uint32_t firstPage, uint8_t * const *buffers, uint16_t numPages);
+    bool startWrite(uint32_t address, const uint8_t *data, uint16_t len);
+    StorageWrite serviceWrite();
+    void setBulkMode(bool bulk);
+
+    void setBusClock(uint32_t hz); //normal I2C speed transfers are timed at. 0 (the default) doesn't time them
+    void setWriteTime(uint32_t micros); //how long the chip is busy after each page write. Default is 5ms
+    void setEndurance(uint32_t cycles); //writes a byte takes before it stops changing. Default 1 million
+    void cutPowerAfter(uint32_t bytes); //stop storing anything after this many more bytes. 0 cuts before the next one
+    void restorePower(); //no more power cut and storing works again
+    bool powerLost();
+    uint32_t getWrites(uint32_t address); //times the byte at address has been written
+    uint32_t getWornBytes(); //bytes past their endurance
+    uint32_t getBytesWritten();
+
+private:
+    const char *path;
+    FILE *file;
+    uint8_t *image;
+    uint32_t *wear; //write count for every byte
+    uint32_t writeTime;
+    uint32_t endurance;
+    uint32_t powerBudget; //bytes left before the power cut, if one is set
+    bool powerCut;
+    bool lostPower;
+    bool writing;
+    uint32_t writeStart;
+    uint32_t wornBytes;
+    uint32_t bytesWritten;
+    uint32_t busClock;
+    bool bulk;
+    void busTime(uint32_t bytes);
+};
+
+extern EEPROMStorage *eepromStorage;
+
+//Install a different storage backend. Passing nullptr goes back to the I2C EEPROM.
+void setEEPROMStorage(EEPROMStorage *storage);
+
+#endif /* EEPROM_STORAGE_H_ */
@@ -26,9 +26,12 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "FaultHandler.h"
 #include "eeprom_layout.h"
+#include "WearLevel.h"
+#include "Scrubber.h"
 
 FaultHandler::FaultHandler()
 {
+    deferHead = deferTail = 0;
 }
 
 void FaultHandler::setup()
@@ -43,17 +46,23 @@ void FaultHandler::setup()
 }
 
 
-//Every tick update the global time and save it to EEPROM (delayed saving)
+//Every tick update the global time. It goes into wear leveled storage which takes care of when to
+//actually write it. Writing it in place here used to make this the most written page in the EEPROM.
 void FaultHandler::handleTick()
 {
-    globalTime = baseTime + (millis() / 100);
-    memCache->Write(EE_FAULT_LOG + EEFAULT_RUNTIME, globalTime);
+    globalTime = baseTime + (sysClock->millis() / 100);
+    wearLevel.set(WL_RUNTIME, globalTime);
 }
 
 uint16_t FaultHandler::raiseFault(uint16_t device, uint16_t code)
 {
     bool incPtr = false;
-    globalTime = baseTime + (millis() / 100);
+    if (IN_INTERRUPT())
+    {
+        deferFault(device, code, true);
+        return faultWritePointer;
+    }
+    globalTime = baseTime + (sysClock->millis() / 100);
 
     //first try to see if this fault is already registered as ongoing. If so don't update the time but set ongoing status if necessary
     bool found = false;
@@ -64,9 +73,7 @@ uint16_t FaultHandler::raiseFault(uint16_t device, uint16_t code)
             found = true;
             //faultList[j].timeStamp = globalTime;
             //Logger::error("Fault still ongoing");
-            faultList[j].ongoing = true;
-            //update the info in EEPROM
-            memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START + (sizeof(FAULT) * j), &faultList[j], sizeof(FAULT));
+            //it's already marked ongoing so there's nothing new to save. Don't rewrite the record every time it repeats
             break; //quit searching
         }
     }
@@ -87,12 +94,15 @@ uint16_t FaultHandler::raiseFault(uint16_t device, uint16_t code)
 
     if (incPtr)
     {
-        //Cause the memory caching system to immediately write the page but only if incPtr is set (only if this is a new fault)
-        memCache->InvalidateAddress(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT)* faultWritePointer);
+        uint16_t written = faultWritePointer;
         faultWritePointer = (faultWritePointer + 1) % CFG_FAULT_HISTORY_SIZE;
         memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR , faultWritePointer);
-        //Cause the page to be immediately fully aged so that it is written very soon.
+        sealLog(); //before the invalidate below so the CRC gets calculated from pages still in cache
+        //Cause the memory caching system to immediately write the page but only if incPtr is set (only if this is a new fault)
+        memCache->InvalidateAddress(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT)* written);
+        //Cause the pages to be immediately fully aged so that they are written very soon.
         memCache->AgeFullyAddress(EE_FAULT_LOG + EEFAULT_WRITEPTR);
+        memCache->AgeFullyAddress(EE_FAULT_LOG + EEFAULT_CRC);
         //Also announce fault on the console
         Logger::error(FAULTSYS, "Fault %x raised by device %x at uptime %i", code, device, globalTime);
     }
@@ -102,6 +112,11 @@ uint16_t FaultHandler::raiseFault(uint16_t device, uint16_t code)
 
 void FaultHandler::cancelOngoingFault(uint16_t device, uint16_t code)
 {
+    if (IN_INTERRUPT())
+    {
+        deferFault(device, code, false);
+        return;
+    }
     for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++)
     {
         if (faultList[i].ongoing && (faultList[i].device == device) && (faultList[i].faultCode == code) )
@@ -111,6 +126,31 @@ void FaultHandler::cancelOngoingFault(uint16_t device, uint16_t code)
     }
 }
 
+//Only ever called from interrupt context. If the queue is full the request is lost but a fault that's
+//still happening will just get raised again next time around.
+bool FaultHandler::deferFault(uint16_t device, uint16_t code, bool raise)
+{
+    uint8_t next = (deferHead + 1) % FAULT_DEFER_SIZE;
+    if (next == deferTail) return false;
+    deferred[deferHead].device = device;
+    deferred[deferHead].code = code;
+    deferred[deferHead].raise = raise;
+    deferHead = next;
+    return true;
+}
+
+//Handle any faults that were raised or cancelled from interrupt context. Called from loop()
+void FaultHandler::processDeferred()
+{
+    while (deferTail != deferHead)
+    {
+        DeferredFault f = deferred[deferTail];
+        deferTail = (deferTail + 1) % FAULT_DEFER_SIZE;
+        if (f.raise) raiseFault(f.device, f.code);
+        else cancelOngoingFault(f.device, f.code);
+    }
+}
+
 void FaultHandler::cancelDeviceFaults(uint16_t device)
 {
     for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++)
@@ -169,6 +209,8 @@ void FaultHandler::loadFromEEPROM()
         memCache->Read(EE_FAULT_LOG + EEFAULT_READPTR, &faultReadPointer);
         memCache->Read(EE_FAULT_LOG + EEFAULT_WRITEPTR, &faultWritePointer);
         memCache->Read(EE_FAULT_LOG + EEFAULT_RUNTIME, &globalTime);
+        uint32_t wearTime;
+        if (wearLevel.get(WL_RUNTIME, &wearTime)) globalTime = wearTime; //old builds only saved it in the fault log
         baseTime = globalTime;
         Logger::debug("Loaded basetime: %i", baseTime);
         for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++)
@@ -183,7 +225,7 @@ void FaultHandler::loadFromEEPROM()
         memCache->Write(EE_FAULT_LOG, validByte);
         memCache->Write(EE_FAULT_LOG + EEFAULT_READPTR, (uint16_t)0);
         memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR, (uint16_t)0);
-        globalTime = baseTime = millis() / 100;
+        globalTime = baseTime = sysClock->millis() / 100;
         memCache->Write(EE_FAULT_LOG + EEFAULT_RUNTIME, globalTime);
 
         FAULT tempFault;
@@ -209,6 +251,7 @@ void FaultHandler::saveToEEPROM()
     {
         memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * i, &faultList[i], sizeof(FAULT));
     }
+    sealLog();
 }
 
 void FaultHandler::writeFaultToEEPROM(int faultnum)
@@ -216,9 +259,16 @@ void FaultHandler::writeFaultToEEPROM(int faultnum)
     if (faultnum > 0 && faultnum < CFG_FAULT_HISTORY_SIZE)
     {
         memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * faultnum, &faultList[faultnum], sizeof(FAULT));
+        sealLog();
     }
 }
 
+//Refresh the CRC the scrubber checks the log against. Needed after every change to the log
+void FaultHandler::sealLog()
+{
+    Scrubber::seal(EE_FAULT_LOG, 0, EEFAULT_CRC, EEFAULT_CRC);
+}
+
 FAULT *FaultHandler::getNextFault()
 {
     uint16_t j;
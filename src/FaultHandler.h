@@ -42,6 +42,9 @@ extern MemCache *memCache;
 //this should likely be the same as the heartbeat to make sure they use the same timer
 #define CFG_TICK_INTERVAL_FAULTHANDLER                 2000000
 
+//how many fault raise/cancel requests from interrupt context can wait to be processed
+#define FAULT_DEFER_SIZE        16
+
 //structure to use for storing and retrieving faults.
 //Stores the info a fault record will contain.
 typedef struct {
@@ -52,6 +55,9 @@ typedef struct {
     uint8_t ongoing : 1; //whether fault still seems to be happening currently 1 = still going on
 } FAULT; //should be 9 bytes because the bottom two are bit fields in a single byte
 
+//CRC of the whole fault log (header and every record) goes right after the last record
+#define EEFAULT_CRC     (EEFAULT_FAULTS_START + sizeof(FAULT) * CFG_FAULT_HISTORY_SIZE)
+
 
 class FaultHandler : public TickObserver {
 public:
@@ -66,6 +72,7 @@ public:
     uint16_t getUnAckFaultCount();
     void handleTick();
     void setup();
+    void processDeferred();
 
     uint16_t setFaultACK(uint16_t fault); //acknowledge the fault # - returns fault # if successful (0xFFFF otherwise)
     uint16_t setAckForDevice(uint16_t device);
@@ -76,6 +83,17 @@ private:
     void loadFromEEPROM();
     void saveToEEPROM();
     void writeFaultToEEPROM(int faultnum);
+    void sealLog();
+    bool deferFault(uint16_t device, uint16_t code, bool raise);
+
+    //raising a fault writes to EEPROM and logs so it can't be done from an interrupt. Those get queued here instead.
+    struct DeferredFault {
+        uint16_t device;
+        uint16_t code;
+        bool raise; //true = raise, false = cancel ongoing
+    };
+    DeferredFault deferred[FAULT_DEFER_SIZE];
+    volatile uint8_t deferHead, deferTail;
 
     uint16_t  faultWritePointer; //fault # we're up to for writing. Location in EEPROM is start + (fault_ptr * sizeof(FAULT))
     uint16_t  faultReadPointer;  //fault # we're at when reading.
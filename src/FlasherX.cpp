@@ -47,12 +47,10 @@
 #include <string.h>		// strlen(), etc.
 #include "FlashTxx.h"		// TLC/T3x/T4x/TMM flash primitives
 #include "FlasherX.h"
-#include <Watchdog_t4.h>
+#include "Supervisor.h"
 #include "config.h"
 #include <Logger.h>
 
-extern WDT_T4<WDT3> wdt;
-
 const int ledPin = 13;		// LED
 Stream *serialptr = &Serial2;	// Serial (USB) or Serial1, Serial2, etc. (UART)
 
@@ -124,7 +122,7 @@ void update_firmware( FsFile *file, uint32_t buffer_addr, uint32_t buffer_size )
           serialptr->write((char)0x97); //signal we want to receive a line
           read_ascii_line_serial( line, sizeof(line) );
         }
-        wdt.feed();
+        supervisor.pet();
 
         linecount++;
         if (linecount == 200)
@@ -218,7 +216,7 @@ void update_firmware( FsFile *file, uint32_t buffer_addr, uint32_t buffer_size )
         SD.sdfs.remove(filename);
     }
   
-    wdt.feed();
+    supervisor.pet();
 
     Logger::info("About to write new firmware image");
     Logger::flushFile(); //force the write as we're about to go bye bye
@@ -84,6 +84,14 @@ controlling the inverter then you aren't going unless it's working. So, this mig
 #include "FlasherX.h"
 #include "devices/misc/SystemDevice.h"
 #include "CrashHandler.h"
+#include "ControlLane.h"
+#include "LoopProfiler.h"
+#include "WearLevel.h"
+#include "Scrubber.h"
+#include "ProfileManager.h"
+#include "ChangeLog.h"
+#include "ConfigPackage.h"
+#include "Supervisor.h"
 #include "localconfig.h"
 
 // Use Teensy SDIO - SDIO is four bit and direct in hardware - it should be plenty fast
@@ -357,7 +365,7 @@ FLASHMEM void setup() {
         //note: the given hex addresses are hardcoded here and correspond to the default 
         //1.2MB program / 1.5MB SPIFFS partitioning
         //also note, wdt probably can't be active when all these flashing routines are running
-        //unless wdt.feed() is added to those routines.
+        //unless supervisor.pet() is added to those routines.
         flashESP32("esp32_bootloader.bin", 0x1000);
         flashESP32("esp32_otadata.bin", 0xE000);
         flashESP32("esp32_partitions.bin", 0x8000);
@@ -374,6 +382,10 @@ FLASHMEM void setup() {
 	memCache = new MemCache();
 	Logger::info("add MemCache (id: %X, %X)", MEMCACHE, memCache);
 	memCache->setup();
+    wearLevel.setup(); //has to find its newest record before the fault handler or any device wants a value
+    changeLog.setup(); //needs its sequence hint from wearLevel and has to be ready before devices save anything
+    configPackage.finishImport(); //an import cut short by a power loss has to be done before devices load anything
+    PrefHandler::prefetchDevices(); //bulk read every enabled device's settings before they all go looking for them
 
     //need to turn this on somewhere. Moved it down pretty low in the power on setup so that things like 
     //firmware updates don't require special handling with the watchdog (at least not power on fw updates)
@@ -419,6 +431,11 @@ FLASHMEM void setup() {
     //    Logger::warn("Enabled devices were not loaded because last boot crashed.");
    // }
 
+    //devices have to be up before the control lane can find the throttle and motor controller
+    controlLane.setup();
+    scrubber.setup(); //devices have claimed their table slots by now so it knows which blocks to check
+    profileManager.setup();
+
     serialConsole = new SerialConsole(memCache, heartbeat);
     serialConsole->setup();
 	serialConsole->printMenu();
@@ -446,28 +463,40 @@ FLASHMEM void setup() {
     //    *(volatile uint32_t *)0x30000000 = 0; 
 
     Logger::flushFile();
+    supervisor.setup(); //last thing so setup time doesn't count against anyone
+    loopProfiler.reset(); //don't count all of the above as one huge loop iteration
 }
 
 //there really isn't much in the loop here. Most everything is done via interrupts and timer ticks. If you have
 //timer queuing on then those tasks will be dispatched here. Otherwise the loop just cycles very rapidly while
 //all the real work is done via interrupt.
 void loop() {
+    loopProfiler.beginLoop();
 #ifdef CFG_TIMER_USE_QUEUING
 	tickHandler.process();
 #endif
-    
+    loopProfiler.mark(LP_TICKS);
+    tickHandler.runContinuations(); //resume anything that was waiting on time instead of calling delay()
+    faultHandler.processDeferred(); //faults raised from the control lane interrupt get stored here
+    loopProfiler.mark(LP_DEFERRED);
+
     //This needs to be called to handle sdCard writing though.
     Logger::loop();
+    loopProfiler.mark(LP_LOGGER);
     
     //ESP32 would be our BT device now. Does it need a loop function?
     //if (btDevice) btDevice->loop();
 
     canEvents(); //get messages on all three CAN buses and dispatch them
+    loopProfiler.mark(LP_CAN);
 
     //Reads SerialUSB1 (if statusCSV isn't active) 
     canHandlerBus0.loop();
+    loopProfiler.mark(LP_SERIALCAN);
     
-    wdt.feed(); //must feed the watchdog every so often or it'll get angry
+    supervisor.loopCheck(); //feeds the watchdog but only if everything that registered is still alive
+    loopProfiler.mark(LP_WDT);
+    loopProfiler.endLoop();
 
     //obviously only for hardware testing. Disable for normal builds.
     /*
@@ -39,6 +39,7 @@ your terminal program. Be cautious about enabling it.
 #include "DeviceManager.h"
 #include "devices/misc/SystemDevice.h"
 #include "devices/esp32/ESP32Driver.h"
+#include "Supervisor.h"
 
 extern bool sdCardWorking;
 FsFile logFile;
@@ -58,6 +59,7 @@ DMAMEM RingBuf<FsFile, RING_BUF_CAPACITY> rb;
 
 uint32_t Logger::lastLogTime = 0;
 ESP32Driver* Logger::esp32 = nullptr;
+volatile uint32_t Logger::droppedInterruptMsgs = 0;
 
 void Logger::initializeFile()
 {
@@ -110,13 +112,16 @@ void Logger::flushFile()
     size_t n = rb.bytesUsed();
     int ret = 0;
     int writeBytes = min(n, 512u);
+    supervisor.beginLongOperation(); //an SD card can sit on a write for well over the loop stall timeout
     ret = rb.writeOut(writeBytes);
     if (writeBytes != ret) {
         Serial.printf("Writeout failed. Want to write %u bytes but wrote %u\n", writeBytes, ret);
         logFile.close();
+        supervisor.endLongOperation();
         return;
     }
     else logFile.flush(); //make sure it is updated on disk
+    supervisor.endLongOperation();
 }
 
 //if there is a sector to write or 1 second has gone by then save the data
@@ -124,6 +129,12 @@ void Logger::loop()
 {
     esp32 = static_cast<ESP32Driver *>(deviceManager.getDeviceByID(0x0800));
     static uint32_t lastWriteTime = 0;
+    if (droppedInterruptMsgs)
+    {
+        uint32_t dropped = droppedInterruptMsgs;
+        droppedInterruptMsgs = 0;
+        warn("%u log messages from interrupt context were dropped", dropped);
+    }
     if (!sdCardWorking) return;
     size_t n = rb.bytesUsed();
     //Serial.println(n);
@@ -332,6 +343,15 @@ boolean Logger::isDebug() {
  *
  */
 void Logger::log(DeviceId deviceId, LogLevel level, const char *format, va_list args) {
+#ifdef CFG_TIMER_USE_QUEUING
+    //With tick queuing on the only thing running in interrupt context is the control lane and it
+    //can't afford to wait on the USB or ESP32 serial buffers. Count it and report from loop() instead.
+    if (IN_INTERRUPT())
+    {
+        droppedInterruptMsgs++;
+        return;
+    }
+#endif
     lastLogTime = millis();
     uint32_t thisTime = micros();
     String outputString;// = String(lastLogTime) + " - ";
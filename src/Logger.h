@@ -60,6 +60,7 @@ public:
 private:
     static uint32_t lastLogTime;
     static ESP32Driver* esp32;
+    static volatile uint32_t droppedInterruptMsgs;
 
     static void log(DeviceId, LogLevel, const char *format, va_list);
     static String logMessage(const char *format, va_list args);
@@ -0,0 +1,135 @@
+/*
+ * LoopProfiler.cpp
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+
+#include "LoopProfiler.h"
+#include "DeviceManager.h"
+
+static const char *stageNames[LP_NUM_STAGES] = {"yield/serial", "ticks", "deferred", "logger", "CAN", "serialCAN", "watchdog"};
+
+LoopProfiler::LoopProfiler()
+{
+    reset();
+}
+
+FLASHMEM void LoopProfiler::reset()
+{
+    for (int i = 0; i < LP_NUM_STAGES; i++)
+    {
+        current[i] = 0;
+        total[i] = 0;
+        worst[i] = 0;
+    }
+    worstCycles = 0;
+    worstTime = 0;
+    minCycles = 0xFFFFFFFF;
+    windowStart = lastMark = iterStart = ARM_DWT_CYCCNT;
+    windowIterations = 0;
+    iterations = 0;
+    cpuLoad = 0.0f;
+    loopFrequency = 0;
+    worstMicros = 0;
+}
+
+void LoopProfiler::beginLoop()
+{
+    //whatever happened since the end of the last iteration was outside of loop()
+    uint32_t now = ARM_DWT_CYCCNT;
+    current[LP_YIELD] = now - lastMark;
+    iterStart = lastMark;
+    lastMark = now;
+}
+
+void LoopProfiler::mark(LoopStage stage)
+{
+    uint32_t now = ARM_DWT_CYCCNT;
+    current[stage] = now - lastMark;
+    lastMark = now;
+}
+
+void LoopProfiler::endLoop()
+{
+    uint32_t now = lastMark;
+    uint32_t iterCycles = now - iterStart;
+
+    for (int i = 0; i < LP_NUM_STAGES; i++) total[i] += current[i];
+    iterations++;
+    windowIterations++;
+
+    if (iterCycles < minCycles) minCycles = iterCycles;
+    if (iterCycles > worstCycles)
+    {
+        worstCycles = iterCycles;
+        worstTime = millis();
+        worstMicros = worstCycles / (F_CPU_ACTUAL / 1000000);
+        memcpy(worst, current, sizeof(worst));
+    }
+
+    if ((now - windowStart) >= F_CPU_ACTUAL) endWindow(now); //once a second
+}
+
+//Work out loop frequency and load for the last window. Load is estimated by how many more
+//iterations we could have done if every one of them was as fast as the fastest one ever seen.
+void LoopProfiler::endWindow(uint32_t now)
+{
+    uint32_t windowCycles = now - windowStart;
+    uint64_t idleCycles = (uint64_t)windowIterations * minCycles;
+    if (idleCycles > windowCycles) idleCycles = windowCycles;
+    cpuLoad = 100.0f * (1.0f - ((float)idleCycles / (float)windowCycles));
+    loopFrequency = (uint32_t)(((uint64_t)windowIterations * F_CPU_ACTUAL) / windowCycles);
+    windowStart = now;
+    windowIterations = 0;
+}
+
+FLASHMEM void LoopProfiler::setupStatusEntries(Device *owner)
+{
+    StatusEntry stat;
+    //        name              var         type             prevVal  obj
+    stat = {"SYS_CPULoad", &cpuLoad, CFG_ENTRY_VAR_TYPE::FLOAT, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"SYS_LoopFreq", &loopFrequency, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"SYS_LoopWorst", &worstMicros, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+}
+
+FLASHMEM void LoopProfiler::dumpStats()
+{
+    uint32_t cyclesPerMicro = F_CPU_ACTUAL / 1000000;
+    uint64_t grandTotal = 0;
+    for (int i = 0; i < LP_NUM_STAGES; i++) grandTotal += total[i];
+    if (grandTotal == 0) grandTotal = 1;
+
+    Logger::console("Main loop: %u iterations/sec, CPU load %f%%, fastest iteration %uus", loopFrequency, cpuLoad, minCycles / cyclesPerMicro);
+    Logger::console("Worst iteration: %uus at %ums", worstMicros, worstTime);
+    Logger::console("   Stage           Share    Worst");
+    for (int i = 0; i < LP_NUM_STAGES; i++)
+    {
+        Logger::console("   %-12s  %6.2f%%  %6uus", stageNames[i], (float)(total[i] * 100.0 / grandTotal), worst[i] / cyclesPerMicro);
+    }
+}
+
+LoopProfiler loopProfiler;
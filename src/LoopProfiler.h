@@ -0,0 +1,87 @@
+/*
+ * LoopProfiler.h
+ *
+ * Keeps track of where the main loop spends its time. Each stage of loop() is timed
+ * with the cycle counter, which is cheap enough to leave on all the time.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+
+#ifndef LOOPPROFILER_H_
+#define LOOPPROFILER_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+class Device;
+
+//the stages of loop() that get timed. LP_YIELD is the time spent outside of loop() between
+//iterations which is where the Teensy core runs yield() and the serialEvent handlers
+enum LoopStage
+{
+    LP_YIELD,
+    LP_TICKS,
+    LP_DEFERRED,
+    LP_LOGGER,
+    LP_CAN,
+    LP_SERIALCAN,
+    LP_WDT,
+    LP_NUM_STAGES
+};
+
+class LoopProfiler {
+public:
+    LoopProfiler();
+    void beginLoop();
+    void mark(LoopStage stage);
+    void endLoop();
+    void setupStatusEntries(Device *owner);
+    void dumpStats();
+    void reset();
+
+private:
+    void endWindow(uint32_t now);
+
+    uint32_t lastMark; //cycle count at the last mark
+    uint32_t iterStart; //cycle count at the start of this iteration
+    uint32_t current[LP_NUM_STAGES]; //cycles used by each stage this iteration
+    uint64_t total[LP_NUM_STAGES]; //cycles used by each stage since reset
+    uint32_t worst[LP_NUM_STAGES]; //stage breakdown of the slowest iteration
+    uint32_t worstCycles;
+    uint32_t worstTime; //millis when the worst iteration happened
+    uint32_t minCycles; //fastest iteration ever seen. Used as the "nothing to do" baseline for CPU load
+    uint32_t windowStart;
+    uint32_t windowIterations;
+    uint64_t iterations;
+
+    //these are what get published as status entries
+    float cpuLoad; //percent
+    uint32_t loopFrequency; //iterations per second
+    uint32_t worstMicros;
+};
+
+extern LoopProfiler loopProfiler;
+
+#endif /* LOOPPROFILER_H_ */
+
@@ -30,90 +30,127 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "MemCache.h"
-#include <Watchdog_t4.h>
-
-extern WDT_T4<WDT3> wdt;
+#include "Supervisor.h"
+#include "DeviceManager.h"
+#include <FastCRC.h>
 
 MemCache::MemCache()
 {
-    agingTimer = 0;
+    clockHand = 0;
+    wbHead = 0;
+    wbTail = 0;
+    wbCount = 0;
+    wbBusy = false;
+    txnDepth = 0;
+    txnCount = 0;
+    txnSplit = false;
+    journalBypass = false;
+    journalHomeLeft = 0;
+    journalFailed = false;
+    eraseActive = false;
+    eraseReboot = false;
+    erasePage = 0;
+    eraseReported = 0;
+    changeCount = 0;
+    memset(&stats, 0, sizeof(stats));
+    memset(pageWrites, 0, sizeof(pageWrites));
+    resetStats();
 }
 
 FLASHMEM void MemCache::setup() {
     tickHandler.detach(this);
     for (int c = 0; c < NUM_CACHED_PAGES; c++) {
         pages[c].address = 0xFFFFFF; //maximum number. This is way over what our chip will actually support so it signals unused
-        pages[c].age = 0;
+        pages[c].referenced = false;
         pages[c].dirty = false;
+        pages[c].inTransaction = false;
     }
+    for (int p = 0; p < EEPROM_NUM_PAGES; p++) pageIndex[p] = 0xFF;
+    clockHand = 0;
     //WriteTimer = 0;
 
+    eraseResume(); //a factory reset that got cut off has to finish before anything else makes sense
+    journalRecover(); //finish off anything a power loss interrupted before anyone reads settings
+
     tickHandler.attach(this, CFG_TICK_INTERVAL_MEM_CACHE);
 }
 
 
-//Handle aging of dirty pages and flushing of aged out dirty pages
+//Queue up dirty pages that have been dirty for long enough. Queueing is just a copy, the actual
+//writing happens in the background so there's no harm in queueing as many as there is room for.
 void MemCache::handleTick()
 {
     int c;
-    
-    agingTimer++;
-    if (agingTimer == AGING_PERIOD)
+    uint32_t now = sysClock->millis();
+
+    //Project EEPROM life from the page that's taking the most abuse. Assumes the system is on all the
+    //time so it is the worst case. Capped at 999 years, which is also what you get before any writes.
+    float years = 999.0f;
+    if (stats.worstPageWrites > 0)
     {
-        agingTimer = 0;
-        cache_age();
+        float writesPerSecond = stats.worstPageWrites / (now / 1000.0f);
+        years = (EEPROM_ENDURANCE / writesPerSecond) / (3600.0f * 24.0f * 365.0f);
+        if (years > 999.0f) years = 999.0f;
     }
-    
+    stats.lifetimeYears = years;
+
     for (c = 0; c < NUM_CACHED_PAGES; c++) {
-        if ((pages[c].age == MAX_AGE) && (pages[c].dirty)) {
+        if (queueFull()) return; //the rest will get their turn on a later tick
+        if (pages[c].dirty && ((now - pages[c].dirtyTime) >= WRITEBACK_DELAY)) {
             FlushPage(c);
-            return;
         }
     }
 }
 
-//this function flushes the first dirty page it finds. It should try to wait until enough time has elapsed since
-//a previous page has been written. Remember that page writes take about 7ms.
+//Continuation callback. Keeps the write back engine moving while it has anything to do
+void MemCache::resume()
+{
+    stepWriteBack();
+    if (eraseActive) serviceErase();
+    if (isWriting() || eraseActive) tickHandler.resumeAfter(this, WRITEBACK_POLL_INTERVAL);
+}
+
+//this function queues the first dirty page it finds. If the write back queue is full it'll wait for a slot.
+//Used when we need a clean page right now so it can't just give up.
 FLASHMEM void MemCache::FlushSinglePage()
 {
     int c;
     for (c = 0; c<NUM_CACHED_PAGES; c++) {
-        if (pages[c].dirty) {
+        if (pages[c].dirty && !pages[c].inTransaction) {
+            waitForSlot();
             cache_writepage(c);
             Logger::avalanche("Writing page at cache index %i", c);
-            pages[c].dirty = false;
-            pages[c].age = 0; //freshly flushed!
-            delay(10); //naughty! But, for testing we'll allow it. TODO: switch to non-blocking wait
             return;
         }
     }
 }
 
-//Flush every dirty page. It will block for 10ms per page so maybe things will be blocked for a long, long time
-//DO NOT USE THIS FUNCTION UNLESS YOU CAN ACCEPT THAT!
+//Flush every dirty page and wait until the EEPROM has them all. Pages in an open transaction stay put. With a full cache that is over a second
+//so things will be blocked for a long, long time. DO NOT USE THIS FUNCTION UNLESS YOU CAN ACCEPT THAT!
+//Use it when you must know everything is in EEPROM, like right before powering down.
 FLASHMEM void MemCache::FlushAllPages()
 {
     int c;
     for (c = 0; c < NUM_CACHED_PAGES; c++) {
-        if (pages[c].dirty) { //found a dirty page so flush it
+        if (pages[c].dirty && !pages[c].inTransaction) { //found a dirty page so flush it
+            waitForSlot();
             cache_writepage(c);
             Logger::avalanche("Writing page at cache index %i", c);
-            pages[c].dirty = false;
-            pages[c].age = 0;
-            delay(10); //10ms is longest it would take to write a page according to datasheet
-            wdt.feed();
+            supervisor.pet();
         }
     }
+    waitForWrite();
 }
 
 //Flush a given page by the page ID. This is NOT by address so act accordingly. Likely no external code should ever use this
+//Doesn't block. If the write back queue is full the page is made due instead so the next tick picks it up.
 FLASHMEM void MemCache::FlushPage(uint8_t page) {
     if (pages[page].dirty) {
-        cache_writepage(page);
-        Logger::avalanche("Writing page at cache index %i", page);
-        pages[page].dirty = false;
-        pages[page].age = 0; //freshly flushed!
-        delay(10); //can't write to eeprom again for around 8ms so delay here so it isnt possible. Bad solution though!
+        if (cache_writepage(page))
+        {
+            Logger::avalanche("Writing page at cache index %i", page);
+        }
+        else AgeFullyPage(page);
     }
 }
 
@@ -131,13 +168,14 @@ FLASHMEM void MemCache::FlushAddress(uint32_t address) {
 FLASHMEM void MemCache::InvalidatePage(uint8_t page)
 {
     if (page > NUM_CACHED_PAGES - 1) return; //invalid page, buddy!
+    if (pages[page].inTransaction) return; //dropping it would lose part of the transaction
     if (pages[page].dirty) {
+        waitForSlot(); //the copy in the queue is all that's needed so this only waits if the queue is full
         cache_writepage(page);
-        delay(10);
     }
     pages[page].dirty = false;
-    pages[page].address = 0xFFFFFF;
-    pages[page].age = 0;
+    pages[page].referenced = false;
+    cache_setaddress(page, 0xFFFFFF);
 }
 
 //Mark a given page unused given an address within that page. Will write the page out if it was dirty.
@@ -157,15 +195,16 @@ FLASHMEM void MemCache::InvalidateAll()
     uint8_t c;
     for (c=0; c<NUM_CACHED_PAGES; c++) {
         InvalidatePage(c);
-        wdt.feed();
+        supervisor.pet();
     }
+    waitForWrite(); //callers expect the next read to come from EEPROM so it had better be there
 }
 
-//Cause a given page to be fully aged which will cause it to be written at the next opportunity
+//Cause a given page to be due for writing which will cause it to be written at the next opportunity
 FLASHMEM void MemCache::AgeFullyPage(uint8_t page)
 {
     if (page < NUM_CACHED_PAGES) { //if we did indeed have that page in cache
-        pages[page].age = MAX_AGE;
+        pages[page].dirtyTime = sysClock->millis() - WRITEBACK_DELAY;
     }
 }
 
@@ -178,9 +217,184 @@ FLASHMEM void MemCache::AgeFullyAddress(uint32_t address)
     page_addr = address >> 8; //kick it down to the page we're talking about
     thisCache = cache_hit(page_addr);
 
-    if (thisCache != 0xFF) { //if we did indeed have that page in cache
-        pages[thisCache].age = MAX_AGE;
+    if (thisCache != 0xFF) AgeFullyPage(thisCache); //if we did indeed have that page in cache
+}
+
+//Group writes so they land in EEPROM all together or not at all. Pages changed from here on aren't written
+//until the matching commitTransaction. Keep it to a handful of pages, the journal only holds JOURNAL_MAX_PAGES.
+FLASHMEM void MemCache::beginTransaction()
+{
+    if (journalBypass) return;
+    txnDepth++;
+}
+
+//For a caller that keeps its own copy of everything it's about to write and can redo all of it after a power
+//cut (a staged config import). Transactions opened meanwhile don't journal anything so every page is written
+//once instead of twice. Only switch it on with no transaction open.
+FLASHMEM void MemCache::setJournalBypass(boolean bypass)
+{
+    if (bypass && txnDepth > 0)
+    {
+        Logger::error("Can't bypass the journal with a transaction open");
+        return;
+    }
+    journalBypass = bypass;
+}
+
+//Throw away everything changed since the matching beginTransaction. The pages are dropped from the cache so the
+//next read gets what EEPROM (or the write back queue) holds. That includes pages changed by an enclosing
+//transaction. A transaction that already had to be split has its first part committed and that stays.
+FLASHMEM void MemCache::abortTransaction()
+{
+    uint8_t c, i;
+
+    if (journalBypass) Logger::error("Transaction aborted while the journal is bypassed. Its changes stay");
+    if (txnDepth == 0) return;
+    txnDepth--;
+    if (txnSplit) Logger::error("Aborted transaction was too big for the journal. Part of it is already saved");
+    for (i = 0; i < txnCount; i++)
+    {
+        c = txnPages[i];
+        pages[c].inTransaction = false;
+        if (pages[c].dirty && stats.dirtyPages > 0) stats.dirtyPages--;
+        pages[c].dirty = false;
+        pages[c].referenced = false;
+        cache_setaddress(c, 0xFFFFFF);
     }
+    Logger::debug("Aborted %i page transaction", txnCount);
+    txnCount = 0;
+    txnSplit = false;
+    changeCount++;
+}
+
+//The changed pages are written to the journal first, then the journal header, then the pages go to their
+//real home and last of all the header is cleared. The queue writes strictly in order so a power loss at any
+//point leaves either the old pages, the new pages or a complete journal for journalRecover to replay.
+//The header clear isn't queued here. finishWrite queues it once every home page has actually been written.
+FLASHMEM void MemCache::commitTransaction()
+{
+    JournalHeader header;
+    FastCRC32 crc;
+    uint8_t headerPage[256];
+    uint8_t c, i;
+
+    if (txnDepth == 0) return;
+    if (--txnDepth > 0) return; //not the outermost commit
+    if (txnCount == 0) return;
+
+    //the last commit's journal is still needed until its home pages are in. Don't write over it before that.
+    if (journalHomeLeft > 0) waitForWrite();
+    journalFailed = false;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.numPages = txnCount;
+    for (i = 0; i < txnCount; i++) header.homePages[i] = pages[txnPages[i]].address;
+    header.crc = crc.crc32((uint8_t *)&header, offsetof(JournalHeader, crc));
+    for (i = 0; i < txnCount; i++) header.crc = crc.crc32_upd(pages[txnPages[i]].data, 256);
+    memset(headerPage, 0xFF, 256);
+    memcpy(headerPage, &header, sizeof(header));
+    memcpy(journalClear, headerPage, 256);
+    memset(journalClear, 0, sizeof(header.magic));
+
+    for (i = 0; i < txnCount; i++)
+    {
+        waitForSlot();
+        cache_queue((EE_JOURNAL >> 8) + 1 + i, pages[txnPages[i]].data, 0, 256);
+    }
+    waitForSlot();
+    cache_queue(EE_JOURNAL >> 8, headerPage, 0, sizeof(header));
+
+    //hold the count up while queueing. Otherwise the first page could land before the last one is queued
+    journalHomeLeft++;
+    for (i = 0; i < txnCount; i++)
+    {
+        c = txnPages[i];
+        pages[c].inTransaction = false;
+        if (!pages[c].dirty) continue;
+        waitForSlot();
+        if (cache_writepage(c)) journalHome();
+    }
+    journalHomeDone();
+    Logger::debug("Committed %i page transaction", txnCount);
+    txnCount = 0;
+    txnSplit = false;
+}
+
+//Called at start up. A journal with a valid header means a commit got cut off somewhere after the journal
+//was complete, so copy its pages to where they belong. Any that already made it just get the same data again.
+FLASHMEM void MemCache::journalRecover()
+{
+    JournalHeader header;
+    FastCRC32 crc;
+    uint8_t image[256];
+    uint32_t check;
+    boolean valid = true;
+    uint8_t i;
+
+    if (!ReadDirect(EE_JOURNAL, &header, sizeof(header))) return;
+    if (header.magic != JOURNAL_MAGIC) return;
+
+    if (header.numPages == 0 || header.numPages > JOURNAL_MAX_PAGES) valid = false;
+    else
+    {
+        check = crc.crc32((uint8_t *)&header, offsetof(JournalHeader, crc));
+        for (i = 0; i < header.numPages && valid; i++)
+        {
+            if (header.homePages[i] >= EEPROM_NUM_PAGES) valid = false;
+            else if (!ReadDirect(EE_JOURNAL + 256 * (i + 1), image, 256)) valid = false;
+            else check = crc.crc32_upd(image, 256);
+        }
+        if (check != header.crc) valid = false;
+    }
+
+    ReadDirect(EE_JOURNAL, journalClear, 256);
+    memset(journalClear, 0, sizeof(header.magic));
+
+    if (valid)
+    {
+        Logger::warn("Replaying %i page EEPROM journal left over from an interrupted save", header.numPages);
+        //nothing is cached yet this early so the images can go straight to the queue. Same rules as a commit,
+        //the header is only cleared once all of them are written
+        journalHomeLeft++;
+        for (i = 0; i < header.numPages; i++)
+        {
+            ReadDirect(EE_JOURNAL + 256 * (i + 1), image, 256);
+            waitForSlot();
+            if (cache_queue(header.homePages[i], image, 0, 256)) journalHome();
+        }
+        journalHomeDone();
+        waitForWrite();
+        journalFailed = false;
+        return;
+    }
+
+    //a header that doesn't check out was cut off while it was being written. Nothing went home yet so just drop it
+    Logger::warn("Discarding incomplete EEPROM journal");
+    waitForSlot();
+    cache_queue(EE_JOURNAL >> 8, journalClear, 0, sizeof(header.magic));
+    waitForWrite();
+}
+
+//The entry that was just queued is a home page covered by the journal
+void MemCache::journalHome()
+{
+    wbQueue[(wbHead + WRITEBACK_QUEUE_SIZE - 1) % WRITEBACK_QUEUE_SIZE].journaled = true;
+    journalHomeLeft++;
+}
+
+//One home page is over with. Once the last one is in the journal can go. If one of them didn't make it then
+//the chip may hold a torn set so the journal stays for the next start up to put right.
+void MemCache::journalHomeDone()
+{
+    if (journalHomeLeft == 0 || --journalHomeLeft > 0) return;
+    if (journalFailed)
+    {
+        Logger::error("EEPROM journal kept after a failed write. It will be replayed at the next start up");
+        return;
+    }
+    waitForSlot();
+    cache_queue(EE_JOURNAL >> 8, journalClear, 0, sizeof(uint32_t));
 }
 
 //Basically, print out the entire memcache table to the serial console
@@ -192,7 +406,8 @@ FLASHMEM void MemCache::dumpCacheDiagnostics()
     for (c = 0; c < NUM_CACHED_PAGES; c++)
     {    
         if (pages[c].address >= 0xFFFFFF) continue;
-        Logger::console("%i: [%x] Age: %i Dirty: %i", c, pages[c].address << 8, pages[c].age, pages[c].dirty);
+        Logger::console("%i: [%x] Ref: %i Dirty: %i (%i-%i)", c, pages[c].address << 8, pages[c].referenced, pages[c].dirty,
+            pages[c].dirtyLow, pages[c].dirtyHigh);
         for (int i = 0; i < 16; i++)
         {
             Logger::console("        %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x", 
@@ -206,6 +421,87 @@ FLASHMEM void MemCache::dumpCacheDiagnostics()
     }
 }
 
+FLASHMEM void MemCache::setupStatusEntries(Device *owner)
+{
+    StatusEntry stat;
+    //        name              var         type             prevVal  obj
+    stat = {"MEM_Hits", &stats.hits, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_Misses", &stats.misses, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_Evictions", &stats.evictions, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_DirtyPages", &stats.dirtyPages, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_DirtyPeak", &stats.dirtyHighWater, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_BytesWritten", &stats.bytesWritten, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_BytesSaved", &stats.bytesSaved, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_BlockingUs", &stats.blockingMicros, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_WorstPageWrites", &stats.worstPageWrites, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"MEM_LifetimeYears", &stats.lifetimeYears, CFG_ENTRY_VAR_TYPE::FLOAT, 0, owner};
+    deviceManager.addStatusEntry(stat);
+}
+
+FLASHMEM void MemCache::dumpStats(bool withTrace)
+{
+    uint32_t lookups = stats.hits + stats.misses;
+    Logger::console("MemCache: %u pages cached, %u lookups, %u hits, %u misses (%u from write back queue), hit rate %f%%",
+        NUM_CACHED_PAGES, lookups, stats.hits, stats.misses, stats.queueHits,
+        lookups ? (100.0f * stats.hits / lookups) : 0.0f);
+    Logger::console("Evictions: %u  Dirty pages: %u (peak %u)  Write back queue: %u of %u",
+        stats.evictions, stats.dirtyPages, stats.dirtyHighWater, wbCount, WRITEBACK_QUEUE_SIZE);
+    Logger::console("EEPROM: %u pages / %u bytes written (%u bytes saved by partial writes), %u failed writes",
+        stats.pagesWritten, stats.bytesWritten, stats.bytesSaved, stats.writeFailures);
+    Logger::console("Blocked on I2C: %uus total, %uus longest", stats.blockingMicros, stats.maxBlockingMicros);
+    Logger::console("Prefetched: %u pages in %uus", stats.prefetchedPages, stats.prefetchMicros);
+    if (eraseActive) Logger::console("EEPROM erase in progress: %i%% done", eraseProgress());
+    Logger::console("Most written page: %x (%u writes since boot). Projected EEPROM life %f years",
+        stats.worstPage << 8, stats.worstPageWrites, stats.lifetimeYears);
+
+    if (!withTrace) return;
+#ifdef MEMCACHE_TRACE_SIZE
+    static const char *opNames[] = {"READ", "WRITE", "EVICT", "WRBACK"};
+    uint32_t count = (traceCount < MEMCACHE_TRACE_SIZE) ? traceCount : MEMCACHE_TRACE_SIZE;
+    Logger::console("Last %u cache accesses, oldest first:", count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        MemCacheTrace *t = &trace[(traceHead + MEMCACHE_TRACE_SIZE - count + i) % MEMCACHE_TRACE_SIZE];
+        Logger::console("%10u %-6s %x %s", t->timestamp, opNames[t->op], t->page << 8,
+            (t->op == MCT_EVICT) ? "" : (t->hit ? (t->op == MCT_WRITEBACK ? "ok" : "hit") : (t->op == MCT_WRITEBACK ? "FAILED" : "miss")));
+    }
+#else
+    Logger::console("Access tracing is not compiled in (MEMCACHE_TRACE_SIZE)");
+#endif
+}
+
+//The counters as they stand. lifetimeYears is refreshed every tick
+FLASHMEM const MemCacheStats *MemCache::getStats()
+{
+    return &stats;
+}
+
+//Clears the counters. dirtyPages is a live count not a counter so it is left alone
+FLASHMEM void MemCache::resetStats()
+{
+    MemCacheStats old = stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.dirtyPages = old.dirtyPages;
+    stats.dirtyHighWater = old.dirtyPages;
+    //wear accounting isn't a statistic. It stays for as long as we're powered up
+    stats.worstPage = old.worstPage;
+    stats.worstPageWrites = old.worstPageWrites;
+    stats.lifetimeYears = old.lifetimeYears;
+#ifdef MEMCACHE_TRACE_SIZE
+    traceHead = 0;
+    traceCount = 0;
+#endif
+}
+
 //Write data into the memory cache. Takes the place of direct EEPROM writes
 //There are lots of versions of this
 FLASHMEM boolean MemCache::Write(uint32_t address, uint8_t valu)
@@ -213,16 +509,18 @@ FLASHMEM boolean MemCache::Write(uint32_t address, uint8_t valu)
     uint32_t addr;
     uint8_t c;
 
+    if (eraseActive) return false; //it would just be erased, or worse, land after the erase
+
     addr = address >> 8; //kick it down to the page we're talking about
-    c = cache_hit(addr);
-    if (c == 0xFF) 	{
-        c = cache_findpage(); //try to free up a page
-        if (c != 0xFF) c = cache_readpage(addr); //and populate it with the existing data
-    }
+    c = cache_lookup(addr, true);
     if (c != 0xFF) {
-        pages[c].data[(uint16_t)(address & 0x00FF)] = valu;
-        pages[c].dirty = true;
-        pages[c].address = addr; //set this in case we actually are setting up a new cache page
+        uint8_t offset = (uint8_t)(address & 0x00FF);
+        if (pages[c].data[offset] != valu) //writing the same value again shouldn't cost an EEPROM write
+        {
+            cache_jointxn(c);
+            pages[c].data[offset] = valu;
+            cache_markdirty(c, offset, offset);
+        }
         return true;
     }
     return false;
@@ -259,20 +557,27 @@ FLASHMEM boolean MemCache::Write(uint32_t address, double valu)
 FLASHMEM FLASHMEM boolean MemCache::Write(uint32_t address, const void* data, uint16_t len)
 {
     uint32_t addr;
-    uint8_t c;
+    uint32_t lastAddr = 0xFFFFFFFF;
+    uint8_t c = 0xFF;
     uint16_t count;
 
+    if (eraseActive) return false;
+
     for (count = 0; count < len; count++) {
         addr = (address+count) >> 8; //kick it down to the page we're talking about
-        c = cache_hit(addr);
-        if (c == 0xFF) {
-            c = cache_findpage(); //try to find a page that either isn't loaded or isn't dirty
-            if (c != 0xFF) c = cache_readpage(addr); //and populate it with the existing data
+        if (addr != lastAddr) { //only look the page up again when the data crosses into a new one
+            c = cache_lookup(addr, true);
+            lastAddr = addr;
         }
         if (c != 0xFF) { //could we find a suitable cache page to write to?
-            pages[c].data[(uint16_t)((address+count) & 0x00FF)] = *(uint8_t *)( ((uint8_t *)data) + count);
-            pages[c].dirty = true;
-            pages[c].address = addr; //set this in case we actually are setting up a new cache page
+            uint8_t offset = (uint8_t)((address+count) & 0x00FF);
+            uint8_t valu = *(uint8_t *)( ((uint8_t *)data) + count);
+            if (pages[c].data[offset] != valu)
+            {
+                cache_jointxn(c);
+                pages[c].data[offset] = valu;
+                cache_markdirty(c, offset, offset);
+            }
         }
         else break;
     }
@@ -287,15 +592,11 @@ FLASHMEM boolean MemCache::Read(uint32_t address, uint8_t* valu)
     uint8_t c;
 
     addr = address >> 8; //kick it down to the page we're talking about
-    c = cache_hit(addr);
-
-    if (c == 0xFF) { //page isn't cached. Search the cache, potentially dump a page and bring this one in
-        c = cache_readpage(addr);
-    }
+    c = cache_lookup(addr, false);
 
     if (c != 0xFF) {
         *valu = pages[c].data[(uint16_t)(address & 0x00FF)];
-        if (!pages[c].dirty) pages[c].age = 0; //reset age since we just used it
+        pages[c].referenced = true;
         return true; //all ok!
     }
     else {
@@ -331,181 +632,638 @@ FLASHMEM boolean MemCache::Read(uint32_t address, double* valu)
     return result;
 }
 
+//Copies a page's worth at a time so pulling in a whole settings block is a handful of memcpy calls
 FLASHMEM boolean MemCache::Read(uint32_t address, void* data, uint16_t len)
 {
-    uint32_t addr;
+    uint16_t count = 0;
+    uint16_t chunk;
     uint8_t c;
-    uint16_t count;
 
-    for (count = 0; count < len; count++) {
-        addr = (address + count) >> 8;
-        c = cache_hit(addr);
-        if (c == 0xFF) { //page isn't cached. Search the cache, potentially dump a page and bring this one in
-            c = cache_readpage(addr);
+    if (len == 0) return false; //nothing was read
+    while (count < len) {
+        c = cache_lookup((address + count) >> 8, false);
+        if (c == 0xFF) return false; //bust out if we run into trouble
+        chunk = 256 - ((address + count) & 0xFF);
+        if (chunk > len - count) chunk = len - count;
+        memcpy((uint8_t *)data + count, &pages[c].data[(address + count) & 0xFF], chunk);
+        pages[c].referenced = true;
+        count += chunk;
+    }
+    return true;
+}
+
+/*
+ * Read straight from EEPROM without bringing the page into the cache. For scanning through a lot of
+ * EEPROM where only a few bytes of each page are wanted. Still returns what a normal Read would if the
+ * page happens to be cached or waiting to be written. Can't cross a page boundary.
+ */
+FLASHMEM boolean MemCache::ReadDirect(uint32_t address, void* data, uint16_t len)
+{
+    uint32_t page = address >> 8;
+
+    if (len == 0 || ((address + len - 1) >> 8) != page) return false;
+
+    uint8_t c = cache_hit(page);
+    if (c != 0xFF)
+    {
+        memcpy(data, &pages[c].data[address & 0xFF], len);
+        return true;
+    }
+    WriteBackEntry *entry = cache_findqueued(page);
+    if (entry)
+    {
+        memcpy(data, &entry->data[address & 0xFF], len);
+        return true;
+    }
+
+    waitForChip();
+    uint32_t startTime = sysClock->micros();
+    boolean result = eepromStorage->read(address, (uint8_t *)data, len);
+    addBlocking(startTime);
+    return result;
+}
+
+/*
+ * Bulk load a range of EEPROM into the cache ahead of time. Meant for start up where every device loading its
+ * settings would otherwise fault pages in one at a time with a full address setup for each. Runs of pages that
+ * aren't cached yet are read back to back with the storage in bulk mode (fast mode plus on the I2C bus).
+ * Pages that are already cached are left alone. Returns how many pages were loaded.
+ */
+FLASHMEM uint16_t MemCache::Prefetch(uint32_t address, uint32_t len)
+{
+    uint8_t slots[EEPROM_PREFETCH_RUN];
+    uint8_t *buffers[EEPROM_PREFETCH_RUN];
+    uint32_t page = address >> 8;
+    uint32_t lastPage;
+    uint32_t runStart;
+    uint16_t loaded = 0;
+    uint16_t n;
+    uint8_t c;
+
+    if (len == 0) return 0;
+    lastPage = (address + len - 1) >> 8;
+    if (lastPage >= EEPROM_NUM_PAGES) lastPage = EEPROM_NUM_PAGES - 1;
+
+    uint32_t startTime = sysClock->micros();
+    waitForChip(); //no changing bus speed in the middle of a write back
+    eepromStorage->setBulkMode(true);
+
+    while (page <= lastPage)
+    {
+        //set aside cache pages for a run of EEPROM pages that have to come from the chip
+        runStart = page;
+        n = 0;
+        while (page <= lastPage && n < EEPROM_PREFETCH_RUN)
+        {
+            if (cache_hit(page) != 0xFF || cache_findqueued(page)) break;
+            if (n > 0 && (page & 0xFF) == 0) break; //the chip's address counter wraps at every 64k so a run can't cross that
+            c = cache_findpage();
+            if (c == 0xFF) break;
+            cache_setaddress(c, page); //claim it now or the next cache_findpage would hand it right back
+            pages[c].referenced = true;
+            buffers[n] = pages[c].data;
+            slots[n++] = c;
+            page++;
         }
-        if (c != 0xFF) {
-            *(uint8_t *)( ((uint8_t *)data) + count) = pages[c].data[(uint16_t)((address + count) & 0x00FF)];
-            if (!pages[c].dirty) pages[c].age = 0; //reset age since we just used it
+
+        if (n > 0)
+        {
+            if (eepromStorage->readPages(runStart, buffers, n)) loaded += n;
+            else
+            {
+                Logger::warn("EEPROM prefetch of %x failed", runStart << 8);
+                for (c = 0; c < n; c++) cache_setaddress(slots[c], 0xFFFFFF);
+            }
+        }
+        else
+        {
+            //already cached, waiting in the write back queue (cache_readpage copies it from there) or no room at all
+            if (cache_hit(page) == 0xFF && cache_findqueued(page)) cache_readpage(page);
+            page++;
         }
-        else break; //bust the for loop if we run into trouble
     }
 
-    if (c != 0xFF) return true; //all ok!
-    return false;
+    eepromStorage->setBulkMode(false);
+    stats.prefetchedPages += loaded;
+    stats.prefetchMicros += sysClock->micros() - startTime;
+    return loaded;
 }
 
-FLASHMEM boolean MemCache::isWriting()
+//Read a page from the chip even if it is cached. For checking what's really stored. Fails rather than waiting
+//if the chip is busy, and if the chip's copy is out of date because the page is dirty or still queued.
+FLASHMEM boolean MemCache::ReadRaw(uint32_t page, uint8_t *data)
 {
-    //if (WriteTimer) return true;
-    return false;
+    if (wbBusy || eraseActive) return false;
+    uint8_t c = cache_hit(page);
+    if (c != 0xFF && pages[c].dirty) return false;
+    if (cache_findqueued(page)) return false;
+    uint32_t startTime = sysClock->micros();
+    boolean result = eepromStorage->read(page << 8, data, 256);
+    addBlocking(startTime);
+    return result;
 }
 
-FLASHMEM uint8_t MemCache::cache_hit(uint32_t address)
+//Anything that reads EEPROM across several steps can compare this before and after to know if it raced a write
+uint32_t MemCache::getChangeCount()
 {
-    uint8_t c;
-    for (c = 0; c < NUM_CACHED_PAGES; c++) {
-        if (pages[c].address == address) {
-            return c;
+    return changeCount;
+}
+
+//True while anything is queued or still being written
+boolean MemCache::isWriting()
+{
+    return (wbCount > 0);
+}
+
+//Block until every queued page is safely in EEPROM
+void MemCache::waitForWrite()
+{
+    if (!isWriting()) return;
+    uint32_t startTime = sysClock->micros();
+    while (isWriting())
+    {
+        stepWriteBack();
+        if (isWriting()) sysClock->delayMicroseconds(WRITEBACK_WAIT_STEP);
+    }
+    addBlocking(startTime);
+}
+
+//Block until the chip itself is free to talk to. Queued pages are left for later.
+void MemCache::waitForChip()
+{
+    if (!wbBusy) return;
+    uint32_t startTime = sysClock->micros();
+    while (wbBusy)
+    {
+        serviceWriteBack();
+        if (wbBusy) sysClock->delayMicroseconds(WRITEBACK_WAIT_STEP);
+    }
+    addBlocking(startTime);
+}
+
+//Block until there's at least one free slot in the write back queue
+void MemCache::waitForSlot()
+{
+    if (!queueFull()) return;
+    uint32_t startTime = sysClock->micros();
+    while (queueFull())
+    {
+        stepWriteBack();
+        if (queueFull()) sysClock->delayMicroseconds(WRITEBACK_WAIT_STEP);
+    }
+    addBlocking(startTime);
+}
+
+boolean MemCache::queueFull()
+{
+    return (wbCount >= WRITEBACK_QUEUE_SIZE);
+}
+
+/*
+ * The write back engine. Pages go out one at a time. For each one the page is clocked out with write_async
+ * and once the bus is done the chip goes off to do its internal write. During that time it won't ACK its
+ * own address so we keep sending it an empty write until it does. That is usually a good bit faster than
+ * the 10ms worst case in the datasheet and, more importantly, nobody sits in delay() waiting for it.
+ * None of this ever blocks. It is driven from resume() and from the wait functions above.
+ */
+void MemCache::serviceWriteBack()
+{
+    if (!wbBusy) return;
+    StorageWrite result = eepromStorage->serviceWrite();
+    if (result == StorageWrite::BUSY) return;
+    finishWrite(result == StorageWrite::DONE);
+}
+
+//Advance the current write and start the next one if the engine is free
+void MemCache::stepWriteBack()
+{
+    serviceWriteBack();
+    if (!wbBusy) startNextWrite();
+}
+
+void MemCache::startNextWrite()
+{
+    if (wbBusy || wbCount == 0) return;
+    WriteBackEntry *entry = &wbQueue[wbTail];
+    uint32_t addr = (entry->address << 8) + entry->offset;
+    //storage may not be able to take it yet (somebody else is on the bus). Try again shortly
+    if (eepromStorage->startWrite(addr, &entry->data[entry->offset], entry->length)) wbBusy = true;
+}
+
+void MemCache::finishWrite(boolean success)
+{
+    WriteBackEntry *entry = &wbQueue[wbTail];
+    boolean journaled = entry->journaled;
+
+    if (success)
+    {
+        uint32_t page = wbQueue[wbTail].address;
+        stats.pagesWritten++;
+        stats.bytesWritten += wbQueue[wbTail].length;
+        stats.bytesSaved += 256 - wbQueue[wbTail].length;
+        if (page < EEPROM_NUM_PAGES && pageWrites[page] < 0xFFFF)
+        {
+            pageWrites[page]++;
+            if (pageWrites[page] > stats.worstPageWrites)
+            {
+                stats.worstPageWrites = pageWrites[page];
+                stats.worstPage = page;
+            }
         }
     }
-    return 0xFF;
+    else
+    {
+        stats.writeFailures++;
+        //a page the journal covers stays at the front of the queue and goes again
+        if (journaled && entry->retries < JOURNAL_HOME_RETRIES)
+        {
+            entry->retries++;
+            addTrace(entry->address, MCT_WRITEBACK, false);
+            wbBusy = false;
+            return;
+        }
+        if (journaled) journalFailed = true;
+        //put the data back in play if the page is still cached. If it isn't then it's lost and the log
+        //message above is all anyone gets.
+        uint8_t c = cache_hit(entry->address);
+        if (c != 0xFF) cache_markdirty(c, entry->offset, entry->offset + entry->length - 1);
+    }
+    addTrace(entry->address, MCT_WRITEBACK, success);
+    wbTail = (wbTail + 1) % WRITEBACK_QUEUE_SIZE;
+    wbCount--;
+    wbBusy = false;
+
+    if (journaled) journalHomeDone();
 }
 
-FLASHMEM void MemCache::cache_age()
+//Newest write back queue entry for the given EEPROM page or nullptr. Newest wins since the same page
+//can be queued more than once.
+WriteBackEntry *MemCache::cache_findqueued(uint32_t address)
 {
-    uint8_t c;
-    for (c = 0; c < NUM_CACHED_PAGES; c++) {
-        if (pages[c].age < MAX_AGE) {
-            pages[c].age++;
+    for (int q = 0; q < wbCount; q++)
+    {
+        WriteBackEntry *entry = &wbQueue[(wbHead + WRITEBACK_QUEUE_SIZE - 1 - q) % WRITEBACK_QUEUE_SIZE];
+        if (entry->address == address) return entry;
+    }
+    return nullptr;
+}
+
+//Which cache page holds the given EEPROM page? Straight lookup in the page index.
+uint8_t MemCache::cache_hit(uint32_t address)
+{
+    if (address >= EEPROM_NUM_PAGES) return 0xFF;
+    return pageIndex[address];
+}
+
+//cache_hit plus bringing the page in if it wasn't there. All the Read and Write functions come through
+//here so this is where the hit / miss counting and tracing happens.
+uint8_t MemCache::cache_lookup(uint32_t address, boolean forWrite)
+{
+    uint8_t c = cache_hit(address);
+    boolean hit = (c != 0xFF);
+    if (hit) stats.hits++;
+    else
+    {
+        stats.misses++;
+        c = cache_readpage(address);
+    }
+    addTrace(address, forWrite ? MCT_WRITE : MCT_READ, hit);
+    return c;
+}
+
+void MemCache::addTrace(uint32_t page, uint8_t op, boolean hit)
+{
+#ifdef MEMCACHE_TRACE_SIZE
+    MemCacheTrace *t = &trace[traceHead];
+    t->timestamp = sysClock->millis();
+    t->page = (uint16_t)page;
+    t->op = op;
+    t->hit = hit;
+    traceHead = (traceHead + 1) % MEMCACHE_TRACE_SIZE;
+    traceCount++;
+#endif
+}
+
+void MemCache::addBlocking(uint32_t startTime)
+{
+    uint32_t elapsed = sysClock->micros() - startTime;
+    stats.blockingMicros += elapsed;
+    if (elapsed > stats.maxBlockingMicros) stats.maxBlockingMicros = elapsed;
+}
+
+//Every change to which EEPROM page a cache page holds has to come through here to keep the index right
+void MemCache::cache_setaddress(uint8_t page, uint32_t addr)
+{
+    if (pages[page].address < EEPROM_NUM_PAGES) pageIndex[pages[page].address] = 0xFF;
+    pages[page].address = addr;
+    if (addr < EEPROM_NUM_PAGES) pageIndex[addr] = page;
+}
+
+//low and high are the first and last byte within the page that changed
+void MemCache::cache_markdirty(uint8_t page, uint8_t low, uint8_t high)
+{
+    if (txnDepth > 0 && !pages[page].inTransaction)
+    {
+        if (txnCount == JOURNAL_MAX_PAGES) //more than the journal holds. Commit what we have and start over
+        {
+            Logger::warn("Transaction is too big for the EEPROM journal. Splitting it");
+            uint8_t depth = txnDepth;
+            txnDepth = 1;
+            commitTransaction();
+            txnDepth = depth;
+            txnSplit = true;
         }
+        pages[page].inTransaction = true;
+        txnPages[txnCount++] = page;
+    }
+    if (!pages[page].dirty)
+    {
+        pages[page].dirtyTime = sysClock->millis(); //the clock starts on the first write only
+        pages[page].dirtyLow = low;
+        pages[page].dirtyHigh = high;
+        stats.dirtyPages++;
+        if (stats.dirtyPages > stats.dirtyHighWater) stats.dirtyHighWater = stats.dirtyPages;
     }
+    else
+    {
+        if (low < pages[page].dirtyLow) pages[page].dirtyLow = low;
+        if (high > pages[page].dirtyHigh) pages[page].dirtyHigh = high;
+    }
+    pages[page].dirty = true;
+    pages[page].referenced = true;
+    changeCount++;
 }
 
-//try to find an empty page or one that can be removed from cache
+//A page is about to be changed. If that pulls it into the open transaction then whatever it already had waiting
+//goes out first, on its own. Otherwise an abort would throw those older changes away along with the transaction's.
+void MemCache::cache_jointxn(uint8_t page)
+{
+    if (txnDepth == 0 || pages[page].inTransaction || !pages[page].dirty) return;
+    waitForSlot();
+    cache_writepage(page);
+}
+
+/*
+ * Find a cache page to use. Empty pages are taken first. Otherwise this is the clock algorithm - sweep
+ * around the cache from where we left off last time. Pages that were used since the hand last passed get
+ * a second chance (their referenced flag is cleared) and the first clean page that wasn't used is evicted.
+ * Dirty pages can't just be thrown away so they're skipped. Two trips around is enough to clear every
+ * referenced flag so if that doesn't find anything then every page is dirty and one has to be flushed.
+ */
 FLASHMEM uint8_t MemCache::cache_findpage()
 {
     uint8_t c;
-    uint8_t old_c, old_v;
-    for (c = 0; c<NUM_CACHED_PAGES; c++) {
-        if (pages[c].address == 0xFFFFFF) { //found an empty cache page so populate it and return its number
-            pages[c].age = 0;
-            pages[c].dirty = false;
-            return c;
-        }
-    }
-    //if we got here then there are no free pages so scan to find the oldest one which isn't dirty
-    old_c = 0xFF;
-    old_v = 0;
-    for (c = 0; c<NUM_CACHED_PAGES; c++) {
-        if (!pages[c].dirty && pages[c].age >= old_v) {
-            old_c = c;
-            old_v = pages[c].age;
+    for (int i = 0; i < 2 * NUM_CACHED_PAGES; i++)
+    {
+        c = clockHand;
+        clockHand = (clockHand + 1) % NUM_CACHED_PAGES;
+        if (pages[c].address == 0xFFFFFF) break; //found an empty cache page so use it
+        if (pages[c].dirty) continue;
+        if (pages[c].referenced)
+        {
+            pages[c].referenced = false;
+            continue;
         }
+        break;
     }
-    if (old_c == 0xFF) { //no pages were not dirty - try to free one up
-        FlushSinglePage(); //try to free up a page
-        //now try to find the free page (if one was freed)
-        old_v = 0;
-        for (c=0; c<NUM_CACHED_PAGES; c++) {
-            if (!pages[c].dirty && pages[c].age >= old_v) {
-                old_c = c;
-                old_v = pages[c].age;
-            }
+
+    if (pages[c].dirty) { //went all the way around without finding a clean page - try to free one up
+        FlushSinglePage(); //queues the first dirty page it finds which also marks it clean
+        for (c = 0; c < NUM_CACHED_PAGES; c++) {
+            if (!pages[c].dirty) break;
         }
-        if (old_c == 0xFF) return 0xFF; //if nothing worked then give up
+        if (c == NUM_CACHED_PAGES) return 0xFF; //if nothing worked then give up
     }
 
     //If we got to this point then we have a page to use
-    pages[old_c].age = 0;
-    pages[old_c].dirty = false;
-    pages[old_c].address = 0xFFFFFF; //mark it unused
+    if (pages[c].address != 0xFFFFFF)
+    {
+        stats.evictions++;
+        addTrace(pages[c].address, MCT_EVICT, false);
+    }
+    pages[c].referenced = false;
+    pages[c].dirty = false;
+    cache_setaddress(c, 0xFFFFFF); //mark it unused
 
-    return old_c;
+    return c;
 }
 
 FLASHMEM uint8_t MemCache::cache_readpage(uint32_t addr)
 {
-    uint16_t c,d,e;
-    uint32_t address = addr << 8;
-    uint8_t buffer[3];
-    uint8_t i2c_id;
+    uint8_t c;
     c = cache_findpage();
     Logger::avalanche("ReadPage");
     if (c != 0xFF) {
-        buffer[0] = ((address & 0xFF00) >> 8);
-        //buffer[1] = (address & 0x00FF);
-        buffer[1] = 0; //the pages are 256 bytes so the start of a page is always 00 for the LSB
-        i2c_id = 0b01010000 + ((address >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
-        Wire.beginTransmission(i2c_id);
-        Wire.write(buffer, 2);
-        Wire.endTransmission(false); //do NOT generate stop
-        //delayMicroseconds(50); //give TWI some time to send and chip some time to get page
-        Wire.requestFrom(i2c_id, 256); //this will generate stop though.
-        for (e = 0; e < 256; e++)
+        //if the page is still waiting in the write back queue then that copy is newer than what's in EEPROM
+        WriteBackEntry *entry = cache_findqueued(addr);
+        if (entry)
         {
-            if(Wire.available())
-            {
-                d = Wire.read(); // receive a byte as character
-                pages[c].data[e] = d;
-            }
+            memcpy(pages[c].data, entry->data, 256);
+            stats.queueHits++;
+            cache_setaddress(c, addr);
+            pages[c].referenced = true;
+            pages[c].dirty = false;
+            return c;
         }
-        pages[c].address = addr;
-        pages[c].age = 0;
+        waitForChip(); //chip won't answer while it's still writing
+        uint32_t startTime = sysClock->micros();
+        eepromStorage->read(addr << 8, pages[c].data, 256);
+        addBlocking(startTime);
+        cache_setaddress(c, addr);
+        pages[c].referenced = true;
         pages[c].dirty = false;
     }
     return c;
 }
 
-FLASHMEM boolean MemCache::cache_writepage(uint8_t page)
+//Copy a page into the write back queue and mark it clean. Returns false if the queue is full or the page
+//belongs to an open transaction. The whole page is copied but only the span that changed will be written.
+//The actual write happens in the background.
+boolean MemCache::cache_writepage(uint8_t page)
 {
-    uint16_t d;
-    uint32_t addr;
-    uint8_t buffer[258];
-    uint8_t i2c_id;
-    addr = pages[page].address << 8;
-    buffer[0] = ((addr & 0xFF00) >> 8);
-    //buffer[1] = (addr & 0x00FF);
-    buffer[1] = 0; //pages are 256 bytes so LSB is always 0 for the start of a page
-    i2c_id = 0b01010000 + ((addr >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
-    for (d = 0; d < 256; d++) {
-        buffer[d + 2] = pages[page].data[d];
-    }
-    Wire.beginTransmission(i2c_id);
-    Wire.write(buffer, 258);
-    Wire.endTransmission(true);
+    boolean queued;
+    if (pages[page].inTransaction) return false;
+    if (pages[page].dirty)
+        queued = cache_queue(pages[page].address, pages[page].data, pages[page].dirtyLow, pages[page].dirtyHigh - pages[page].dirtyLow + 1);
+    else //not really needed but make it a full page write rather than nothing
+        queued = cache_queue(pages[page].address, pages[page].data, 0, 256);
+    if (!queued) return false;
+
+    if (pages[page].dirty && stats.dirtyPages > 0) stats.dirtyPages--;
+    pages[page].dirty = false; //freshly flushed!
     return true;
 }
 
-//Nuke it from orbit. It's the only way to be sure.
-//erases the entire EEPROM back to 0xFF across all addresses. You will lose everything.
-//There is no erase command on our EEPROM chip so you must manually write FF's to every addss
+//Put a write of length bytes from offset within EEPROM page addr onto the write back queue. data is the
+//whole page as it should end up. Pages are written in the order they're queued.
+boolean MemCache::cache_queue(uint32_t addr, const uint8_t *data, uint8_t offset, uint16_t length)
+{
+    if (queueFull()) return false;
+    WriteBackEntry *entry = &wbQueue[wbHead];
+    memcpy(entry->data, data, 256);
+    entry->address = addr;
+    entry->offset = offset;
+    entry->length = length;
+    entry->journaled = false;
+    entry->retries = 0;
+    wbHead = (wbHead + 1) % WRITEBACK_QUEUE_SIZE;
+    wbCount++;
 
+    startNextWrite();
+    tickHandler.resumeAfter(this, WRITEBACK_POLL_INTERVAL);
+    return true;
+}
+
+//Nuke it from orbit. It's the only way to be sure.
+//Erases the entire EEPROM back to 0xFF across all addresses. You will lose everything.
+//There is no erase command on our EEPROM chip so every page has to be written with FF's. This only starts
+//the job. It runs through the write back queue in the background, skips pages that are already blank, and
+//reboots the system once everything is gone. A marker in the last page tracks progress so if the power goes
+//out part way through the erase is finished at the next start up.
 FLASHMEM void MemCache::nukeFromOrbit()
 {
-    uint16_t d;
-    uint32_t addr;
-    uint8_t buffer[258];
-    uint8_t i2c_id;
+    if (eraseActive) return;
+
+    //everything cached is about to be wiped out so there's no point writing any of it
+    for (int c = 0; c < NUM_CACHED_PAGES; c++)
+    {
+        pages[c].dirty = false;
+        pages[c].inTransaction = false;
+        pages[c].referenced = false;
+        cache_setaddress(c, 0xFFFFFF);
+    }
+    stats.dirtyPages = 0;
+    txnDepth = 0;
+    txnCount = 0;
+    txnSplit = false;
+
+    eraseActive = true;
+    eraseReboot = true;
+    erasePage = 0;
+    eraseReported = 0;
+    eraseSaveMarker();
+    tickHandler.resumeAfter(this, WRITEBACK_POLL_INTERVAL);
+}
+
+//Percent done or -1 if there's no erase running
+int MemCache::eraseProgress()
+{
+    if (!eraseActive) return -1;
+    if (erasePage >= EEPROM_NUM_PAGES) return 100;
+    return (erasePage * 100) / EEPROM_NUM_PAGES;
+}
+
+//Start up. If the marker is there then an erase was interrupted. Finish it now, before anyone reads settings
+//out of a half erased EEPROM. The watchdog isn't running yet so this can block.
+FLASHMEM void MemCache::eraseResume()
+{
+    EraseMarker marker;
+
+    if (!ReadDirect(EE_ERASE_MARKER, &marker, sizeof(marker))) return;
+    if (marker.magic != ERASE_MAGIC || marker.check != (uint16_t)~marker.nextPage) return;
+    if (marker.nextPage > EEPROM_NUM_PAGES) return;
+
+    Logger::warn("EEPROM erase was interrupted. Finishing it from page %i", marker.nextPage);
+    eraseActive = true;
+    eraseReboot = false;
+    erasePage = marker.nextPage;
+    eraseReported = eraseProgress();
+    while (eraseActive)
+    {
+        stepWriteBack();
+        serviceErase();
+        supervisor.pet();
+        if (wbBusy) sysClock->delayMicroseconds(WRITEBACK_WAIT_STEP);
+    }
+}
 
-    for (d = 0; d < 256; d++) buffer[d+2] = 0xFF;
+//One step of the erase. Checks a short run of pages and queues a write of FF's over whatever part of each
+//isn't blank.
+void MemCache::serviceErase()
+{
+    uint8_t buffer[256];
+    uint8_t runData[ERASE_READ_RUN][256];
+    uint8_t *buffers[ERASE_READ_RUN];
+    uint16_t low, high;
+    uint16_t n, room;
 
-    for (int page = 0; page < 1024; page++)
+    if (wbBusy) return; //chip doesn't answer reads while it's writing
+    if (queueFull()) return;
+
+    if (erasePage > EEPROM_NUM_PAGES) //marker is gone too. Wait for the queue to empty out and we're done
     {
-        addr = page * 256;
-        buffer[0] = ((addr & 0xFF00) >> 8);
-        buffer[1] = 0; //pages are 256 bytes so LSB is always 0 for the start of a page
-        i2c_id = 0b01010000 + ((addr >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
-        Wire.beginTransmission(i2c_id);
-        Wire.write(buffer, 258);
-        Wire.endTransmission(true);
-        delay(11);
-        wdt.feed();
-    }
-    //system should be forceably rebooted here to ensure nothing tries to write to eeprom
-    //or access anything.
-    //TODO: this is rather violent. In most cases there should be a soft shutdown where we try to signal everyone
-    //that the ship is about to sink.
-    REBOOT;
+        if (isWriting()) return;
+        eraseActive = false;
+        Logger::console("EEPROM erase is complete");
+        if (eraseReboot) REBOOT;
+        return;
+    }
+
+    if (erasePage == EEPROM_NUM_PAGES) //every other page is blank so the marker can go now
+    {
+        memset(buffer, 0xFF, 256);
+        cache_queue(EE_ERASE_MARKER >> 8, buffer, 0, 256);
+        erasePage++;
+        return;
+    }
+
+    //every page in the run might need a write so it's no longer than the queue has room for, less one
+    //for the marker. It stops at the marker's page, at a marker save and where the chip's address counter wraps
+    room = WRITEBACK_QUEUE_SIZE - wbCount;
+    if (room > 1) room--;
+    for (n = 0; n < ERASE_READ_RUN && n < room; n++)
+    {
+        uint16_t page = erasePage + n;
+        if (page >= EEPROM_NUM_PAGES || page == (EE_ERASE_MARKER >> 8)) break;
+        if (n > 0 && ((page & 0xFF) == 0 || (page % ERASE_MARKER_INTERVAL) == 0)) break;
+        buffers[n] = runData[n];
+    }
+
+    if (n > 0)
+    {
+        //reading is most of the job so it goes at the bulk speed, but only for the reads themselves. The erase runs
+        //in the background and the PCA I/O expander on the same bus can't take the bulk speed for long.
+        eepromStorage->setBulkMode(true);
+        boolean readOK = eepromStorage->readPages(erasePage, buffers, n);
+        eepromStorage->setBulkMode(false);
+        if (!readOK) return; //try again next time around
+        for (uint16_t p = 0; p < n; p++)
+        {
+            for (low = 0; low < 256 && runData[p][low] == 0xFF; low++) ;
+            if (low < 256)
+            {
+                for (high = 255; runData[p][high] == 0xFF; high--) ;
+                memset(buffer, 0xFF, 256);
+                cache_queue(erasePage + p, buffer, low, high - low + 1);
+            }
+        }
+        erasePage += n;
+    }
+    else erasePage++; //the marker's own page. It goes last
+
+    //the queue writes in order so the marker can't claim pages whose erase hasn't landed yet
+    if ((erasePage % ERASE_MARKER_INTERVAL) == 0 && !queueFull()) eraseSaveMarker();
+
+    uint8_t percent = eraseProgress();
+    if (percent >= eraseReported + 10)
+    {
+        eraseReported = percent;
+        Logger::console("EEPROM erase %i%% done", percent);
+    }
+}
+
+void MemCache::eraseSaveMarker()
+{
+    EraseMarker marker;
+    uint8_t buffer[256];
+
+    marker.magic = ERASE_MAGIC;
+    marker.nextPage = erasePage;
+    marker.check = ~erasePage;
+    memset(buffer, 0xFF, 256);
+    memcpy(buffer, &marker, sizeof(marker));
+    waitForSlot();
+    cache_queue(EE_ERASE_MARKER >> 8, buffer, 0, sizeof(marker));
 }
 
 
@@ -31,8 +31,9 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <Arduino.h>
 #include "config.h"
+#include "eeprom_layout.h"
 #include "TickHandler.h"
-#include "i2c_driver_wire.h"
+#include "EEPROMStorage.h"
 
 //Total # of allowable pages to cache. Limits RAM usage
 //note that a page is 256 bytes so 4 pages is a kilobyte. Don't go nuts here
@@ -40,23 +41,52 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //number of cached pages here.
 #define NUM_CACHED_PAGES   128
 
-//maximum allowable age of a cache
-#define MAX_AGE  128
-
-/* # of system ticks per aging cycle. There are 128 aging levels total so
-// multiply 128 by this aging period and multiple that by system tick duration
-// to determine how long it will take for a page to age out fully and get written
-// if dirty. For instance, 128 levels * 500 aging period * 10ms (100Hz tick) = 640 seconds
-// EEPROM handles about 1 million write cycles. So, a flush time of 100 seconds means that
-// continuous writing would last 100M seconds which is 3.17 years
-// Another way to look at it is that 128 aging levels * 40ms tick is 5.12 seconds to flush for
-// each aging period below. Adjust acccordingly.
+//size of the EEPROM in 256 byte pages. The page index has one entry for every one of these
+#define EEPROM_NUM_PAGES   1024
+
+/* How long (in milliseconds) a page may stay dirty before it gets written out. Every write to the page
+// during that window is folded into a single EEPROM write. EEPROM handles about 1 million write cycles.
+// So, a flush time of 100 seconds means that continuous writing would last 100M seconds which is 3.17 years.
+// Adjust accordingly.
 */
-#define AGING_PERIOD       60
+#define WRITEBACK_DELAY    307200
 
 #define CFG_TICK_INTERVAL_MEM_CACHE                 40000
 
-//Current parameters as of 26th of August 2021 = 128 * 40ms * 60 = 307.2 seconds to flush = about 10 years EEPROM life
+//Dirty pages are copied here to be written out in the background. Because each entry is a full copy the
+//cache page is free to be changed or reused the moment it's queued.
+#define WRITEBACK_QUEUE_SIZE        8
+
+//how often (in microseconds) the write back engine checks on the bus and the chip while it has work to do
+#define WRITEBACK_POLL_INTERVAL     500
+
+//and how long (in microseconds) the blocking waits sit between polls. Goes through sysClock so a simulated
+//clock moves forward while something waits on the storage
+#define WRITEBACK_WAIT_STEP         20
+
+//most pages read back to back in one go by Prefetch. Every page in a run has to be set aside in the cache first
+#define EEPROM_PREFETCH_RUN         16
+
+//rated write cycles per page. Used to project how long the chip will last at the current write rate
+#define EEPROM_ENDURANCE            1000000
+
+//Keep a ring of the last this many cache accesses for MEMSTATS=2. Each one is 8 bytes.
+//Comment out to save the RAM and the few cycles per access it costs.
+#define MEMCACHE_TRACE_SIZE         256
+
+//A transaction can change at most this many pages. One journal page is the header
+#define JOURNAL_MAX_PAGES           (JOURNAL_NUM_PAGES - 1)
+#define JOURNAL_MAGIC               0x4A524E4C //"JRNL"
+//a home page write from a commit that fails is tried this many more times before giving up on it
+#define JOURNAL_HOME_RETRIES        3
+
+//a full erase saves how far it got every this many pages
+#define ERASE_MARKER_INTERVAL       32
+//pages blank checked per read at the bulk clock. Keeps the bus fast for about 10ms at a time
+#define ERASE_READ_RUN              4
+#define ERASE_MAGIC                 0x454B554E //"NUKE"
+
+//Current parameters as of 26th of August 2021 = 307.2 seconds to flush = about 10 years EEPROM life
 //Note that this is 10 years STRAIGHT. As in, you never turned it off for 10 years and every chance it got it wrote the page.
 //This should be plenty of EEPROM life.
 
@@ -64,14 +94,85 @@ typedef struct
 {
     uint8_t data[256];
     uint32_t address; //address of start of page
-    uint8_t age; //
+    uint32_t dirtyTime; //millis when the page went from clean to dirty
+    boolean referenced; //set on every access. The clock hand clears it on the way past
     boolean dirty;
+    uint8_t dirtyLow; //first and last byte (inclusive) that changed since the page was last clean.
+    uint8_t dirtyHigh; //only this span gets written out
+    boolean inTransaction; //changed inside an open transaction. Only commitTransaction may write it
 } PageCache;
 
-class MemCache: public TickObserver {
+typedef struct
+{
+    uint8_t data[256]; //the whole page as it was when queued so reads can be served from here
+    uint32_t address; //page number, same as PageCache address
+    uint8_t offset; //first byte of the page that actually needs writing
+    uint16_t length; //and how many bytes from there
+    boolean journaled; //home page of a committed transaction. The journal stays until every one of these is in
+    uint8_t retries; //failed attempts so far. Only journaled pages get another try
+} WriteBackEntry;
+
+//Start of the journal. Written only after every page image is in the journal so a valid header means the
+//images are complete. The magic is zeroed once all the pages have made it home.
+typedef struct
+{
+    uint32_t magic;
+    uint16_t numPages;
+    uint16_t homePages[JOURNAL_MAX_PAGES]; //EEPROM page number each journal page belongs at
+    uint32_t crc; //CRC32 of everything above plus all of the page images
+} JournalHeader;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t nextPage; //every page below this one is already blank
+    uint16_t check; //~nextPage so a half written marker doesn't count
+} EraseMarker;
+
+typedef struct
+{
+    uint32_t hits; //page lookups that were already cached
+    uint32_t misses; //page lookups that had to go to EEPROM (or the write back queue)
+    uint32_t queueHits; //misses that were served from a page still waiting in the write back queue
+    uint32_t evictions; //clean pages thrown out to make room
+    uint32_t dirtyPages; //how many pages are dirty right now
+    uint32_t dirtyHighWater; //most that have ever been dirty at once
+    uint32_t pagesWritten; //page writes that the EEPROM acknowledged
+    uint32_t bytesWritten;
+    uint32_t bytesSaved; //bytes that didn't have to be written because only the changed span of a page went out
+    uint32_t writeFailures;
+    uint32_t blockingMicros; //total time spent waiting on the I2C bus or the chip
+    uint32_t maxBlockingMicros; //longest single wait
+    uint32_t prefetchedPages; //pages bulk loaded by Prefetch
+    uint32_t prefetchMicros; //and how long that took, bus speed changes included
+    uint32_t worstPage; //EEPROM page that has been written the most since boot
+    uint32_t worstPageWrites;
+    float lifetimeYears; //projected EEPROM life if the worst page keeps getting written at its current rate
+} MemCacheStats;
+
+enum MemCacheTraceOp
+{
+    MCT_READ,
+    MCT_WRITE,
+    MCT_EVICT,
+    MCT_WRITEBACK
+};
+
+typedef struct
+{
+    uint32_t timestamp; //sysClock millis
+    uint16_t page; //EEPROM page number. Multiply by 256 for the address
+    uint8_t op; //MemCacheTraceOp
+    uint8_t hit; //for reads and writes, whether it was cached. For write backs, whether it worked
+} MemCacheTrace;
+
+class Device;
+
+class MemCache: public TickObserver, public Continuation {
 public:
     void setup();
     void handleTick();
+    void resume();
     void FlushSinglePage();
     void FlushAllPages();
     void FlushPage(uint8_t page);
@@ -82,7 +183,18 @@ public:
     void AgeFullyPage(uint8_t page);
     void AgeFullyAddress(uint32_t address);
     void nukeFromOrbit();
+    int eraseProgress();
     void dumpCacheDiagnostics();
+    boolean isWriting();
+    void waitForWrite();
+    void setupStatusEntries(Device *owner);
+    void dumpStats(bool withTrace);
+    void resetStats();
+    const MemCacheStats *getStats();
+    void beginTransaction();
+    void commitTransaction();
+    void abortTransaction();
+    void setJournalBypass(boolean bypass);
 
     boolean Write(uint32_t address, uint8_t valu);
     boolean Write(uint32_t address, uint16_t valu);
@@ -98,18 +210,67 @@ public:
     boolean Read(uint32_t address, float* valu);
     boolean Read(uint32_t address, double* valu);
     boolean Read(uint32_t address, void* data, uint16_t len);
+    boolean ReadDirect(uint32_t address, void* data, uint16_t len);
+    boolean ReadRaw(uint32_t page, uint8_t *data);
+    uint32_t getChangeCount();
+    uint16_t Prefetch(uint32_t address, uint32_t len);
 
     MemCache();
 
 private:
     PageCache pages[NUM_CACHED_PAGES];
-    boolean isWriting();
+    WriteBackEntry wbQueue[WRITEBACK_QUEUE_SIZE];
+    void serviceWriteBack();
+    void stepWriteBack();
+    void startNextWrite();
+    void finishWrite(boolean success);
+    void waitForChip();
+    void waitForSlot();
+    boolean queueFull();
     uint8_t cache_hit(uint32_t address);
-    void cache_age();
+    WriteBackEntry *cache_findqueued(uint32_t address);
+    uint8_t cache_lookup(uint32_t address, boolean forWrite);
+    void addTrace(uint32_t page, uint8_t op, boolean hit);
+    void addBlocking(uint32_t startTime);
+    void cache_setaddress(uint8_t page, uint32_t addr);
+    void cache_markdirty(uint8_t page, uint8_t low, uint8_t high);
+    void cache_jointxn(uint8_t page);
     uint8_t cache_findpage();
     uint8_t cache_readpage(uint32_t addr);
     boolean cache_writepage(uint8_t page);
-    uint8_t agingTimer;
+    boolean cache_queue(uint32_t addr, const uint8_t *data, uint8_t offset, uint16_t length);
+    void journalRecover();
+    void journalHome();
+    void journalHomeDone();
+    void eraseResume();
+    void serviceErase();
+    void eraseSaveMarker();
+    uint8_t pageIndex[EEPROM_NUM_PAGES]; //EEPROM page number -> cache page or 0xFF if it isn't cached
+    uint8_t clockHand; //where the replacement sweep picks up next time
+    uint8_t wbHead; //next free queue slot
+    uint8_t wbTail; //entry currently being written (if the state isn't IDLE)
+    uint8_t wbCount;
+    boolean wbBusy; //the entry at wbTail has been handed to the storage and isn't done yet
+    uint8_t txnDepth; //begin/commit pairs can nest. Only the outermost commit writes anything
+    uint8_t txnCount; //pages in the open transaction
+    uint8_t txnPages[JOURNAL_MAX_PAGES]; //cache page of each of them
+    boolean txnSplit; //it outgrew the journal and part of it was committed early
+    boolean journalBypass; //transactions are no-ops. The caller can redo its writes without the journal
+    uint8_t journalHomeLeft; //home pages of the last commit still on their way to EEPROM
+    boolean journalFailed; //one of them never made it so the journal has to stay
+    uint8_t journalClear[256]; //journal header page as it is once the magic is zeroed
+    boolean eraseActive; //nukeFromOrbit is running in the background
+    boolean eraseReboot; //reboot when it's done. Not when finishing an interrupted erase at start up
+    uint16_t erasePage; //next page to check. EEPROM_NUM_PAGES means only the marker is left
+    uint8_t eraseReported; //last progress percentage that was logged
+    uint32_t changeCount; //bumped every time a cached page is changed
+    MemCacheStats stats;
+    uint16_t pageWrites[EEPROM_NUM_PAGES]; //write count for every EEPROM page since boot
+#ifdef MEMCACHE_TRACE_SIZE
+    MemCacheTrace trace[MEMCACHE_TRACE_SIZE];
+    uint16_t traceHead;
+    uint32_t traceCount;
+#endif
 };
 
 #endif /* MEM_CACHE_H_ */
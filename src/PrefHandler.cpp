@@ -28,11 +28,37 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "PrefHandler.h"
+#include "Scrubber.h"
+#include "ChangeLog.h"
+#include "DeviceManager.h"
+#include "Supervisor.h"
+
+uint64_t PrefHandler::unsealedBlocks = 0;
+uint64_t PrefHandler::staleIndexes = 0;
+uint32_t PrefHandler::lkgDirty[CFG_DEV_MGR_MAX_DEVICES];
+PrefMigration PrefHandler::migrations[CFG_PREF_MAX_MIGRATIONS];
+uint8_t PrefHandler::numMigrations = 0;
 
 PrefHandler::PrefHandler() {
     lkg_address = EE_MAIN_OFFSET; //default to normal mode
     base_address = 0;
-    semKeyLookup = false;
+    position = 0;
+    memset(snaps, 0, sizeof(snaps));
+    liveSnap = 0;
+    snapValid = false;
+    snapPending = false;
+    keyIndex = nullptr;
+    blockImage = nullptr;
+    writerShared = false;
+    indexSize = 0;
+    indexCount = 0;
+    defaults = nullptr;
+    defaultsSize = 0;
+    defaultsCount = 0;
+    nextFree = SETTINGS_START;
+    wastedBytes = 0;
+    freeBytes = 0;
+    fragmentation = 0;
 }
 
 bool PrefHandler::isEnabled()
@@ -121,16 +147,63 @@ FLASHMEM void PrefHandler::initDevTable()
     //write out magic entry
     id = 0xDEAD;
     memCache->Write(EE_DEVICE_TABLE, id);
+    sealTable();
     memCache->FlushAllPages();
 }
 
+//Pull the device table and the settings block of every enabled device into the cache in one go before
+//the devices start up. Otherwise each device faults in its pages one at a time as it loads its config.
+FLASHMEM void PrefHandler::prefetchDevices()
+{
+    uint16_t id;
+    uint16_t pagesLoaded;
+    uint32_t startTime = micros();
+
+    pagesLoaded = memCache->Prefetch(EE_DEVICE_TABLE, 2 * CFG_DEV_MGR_MAX_DEVICES);
+    memCache->Read(EE_DEVICE_TABLE, &id);
+    if (id != 0xDEAD) return; //no valid table. The first PrefHandler will sort that out
+
+    for (int x = 1; x < CFG_DEV_MGR_MAX_DEVICES; x++) {
+        memCache->Read(EE_DEVICE_TABLE + (2 * x), &id);
+        if (!(id & 0x8000)) continue;
+        pagesLoaded += memCache->Prefetch(EE_DEVICES_BASE + (EE_DEVICE_SIZE * x) + EE_MAIN_OFFSET, EE_DEVICE_SIZE);
+    }
+    Logger::info("Prefetched %i EEPROM pages of device settings in %uus", pagesLoaded, micros() - startTime);
+}
+
+//Where in the device table a device lives. -1 if it has no spot yet
+int PrefHandler::findPosition(uint16_t device)
+{
+    uint16_t id;
+    for (int x = 1; x < CFG_DEV_MGR_MAX_DEVICES; x++) {
+        memCache->Read(EE_DEVICE_TABLE + (2 * x), &id);
+        if ((id & 0x7FFF) == (device & 0x7FFF)) return x;
+    }
+    return -1;
+}
+
 //Given a device ID we must search the 64 entry table found in EEPROM to see if the device
 //has a spot in EEPROM. If it does not then add it
 FLASHMEM PrefHandler::PrefHandler(DeviceId id_in) {
     uint16_t id;
 
     enabled = false;
-    semKeyLookup = false;
+    memset(snaps, 0, sizeof(snaps));
+    liveSnap = 0;
+    snapValid = false;
+    snapPending = false;
+    keyIndex = nullptr;
+    blockImage = nullptr;
+    writerShared = false;
+    indexSize = 0;
+    indexCount = 0;
+    defaults = nullptr;
+    defaultsSize = 0;
+    defaultsCount = 0;
+    nextFree = SETTINGS_START;
+    wastedBytes = 0;
+    freeBytes = 0;
+    fragmentation = 0;
 
     checkTableValidity();
 
@@ -162,6 +235,7 @@ FLASHMEM PrefHandler::PrefHandler(DeviceId id_in) {
             //immediately store our ID into the proper place
             memCache->Write(EE_DEVICE_ID + base_address + lkg_address, deviceID);
             Logger::info("Device ID: %X was placed into device table at entry: %i", (int)id, x);
+            sealTable();
             memCache->FlushAllPages();
             return;
         }
@@ -170,6 +244,7 @@ FLASHMEM PrefHandler::PrefHandler(DeviceId id_in) {
     //we found no matches and could not allocate a space. This is bad. Error out here
     base_address = 0xF0F0;
     lkg_address = EE_MAIN_OFFSET;
+    position = 0;
     Logger::error("PrefManager - Device Table Full!!!");
 }
 
@@ -190,6 +265,7 @@ FLASHMEM bool PrefHandler::setDeviceStatus(uint16_t device, bool enabled)
             }
             Logger::avalanche("ID to write: %X", device);
             memCache->Write(EE_DEVICE_TABLE + (2 * x), device);
+            sealTable();
             return true;
         }
     }
@@ -197,11 +273,64 @@ FLASHMEM bool PrefHandler::setDeviceStatus(uint16_t device, bool enabled)
 }
 
 PrefHandler::~PrefHandler() {
+    releaseIndex();
+    if (defaults) delete[] defaults;
+}
+
+//The scrubber leaves a block alone while it's marked unsealed since its CRC is expected to be stale
+bool PrefHandler::isSealed(int pos)
+{
+    if (pos < 1 || pos >= CFG_DEV_MGR_MAX_DEVICES) return true;
+    return !(unsealedBlocks & (1ull << pos));
+}
+
+//Store a new CRC for the settings in a device block. The 8 bit checksum covers the CRC bytes too so it gets
+//adjusted by the difference. That keeps a valid checksum valid without resumming the whole block.
+FLASHMEM void PrefHandler::sealPosition(int pos)
+{
+    uint32_t base = EE_DEVICES_BASE + (EE_DEVICE_SIZE * pos) + EE_MAIN_OFFSET;
+    uint8_t before[5], after[5];
+    uint8_t csum;
+
+    if (pos < 1 || pos >= CFG_DEV_MGR_MAX_DEVICES) return;
+    memCache->Read(base + EE_BLOCK_CRC, before, 5);
+    Scrubber::seal(base, SETTINGS_START, EE_DEVICE_SIZE, EE_BLOCK_CRC);
+    memCache->Read(base + EE_BLOCK_CRC, after, 5);
+    memCache->Read(base + EE_CHECKSUM, &csum);
+    for (int i = 0; i < 5; i++) csum += after[i] - before[i];
+    memCache->Write(base + EE_CHECKSUM, csum);
+    unsealedBlocks &= ~(1ull << pos);
+}
+
+//For whoever rewrites a whole device block (the scrubber restoring it). Its PrefHandler will
+//rebuild its key index from EEPROM the next time it looks something up.
+void PrefHandler::invalidateIndex(int pos)
+{
+    if (pos < 1 || pos >= CFG_DEV_MGR_MAX_DEVICES) return;
+    staleIndexes |= (1ull << pos);
+}
+
+FLASHMEM void PrefHandler::sealTable()
+{
+    Scrubber::seal(EE_DEVICE_TABLE, 0, EE_TABLE_CRC, EE_TABLE_CRC);
+}
+
+//Only the main copy has a CRC the scrubber checks. The last known good copy is taken care of by the scrubber
+void PrefHandler::markUnsealed()
+{
+    if (lkg_address != EE_MAIN_OFFSET) return;
+    if (position < 1 || position >= CFG_DEV_MGR_MAX_DEVICES) return;
+    unsealedBlocks |= (1ull << position);
 }
 
 void PrefHandler::LKG_mode(bool mode) {
-    if (mode) lkg_address = EE_LKG_OFFSET;
-    else lkg_address = EE_MAIN_OFFSET;
+    uint32_t newAddress = mode ? EE_LKG_OFFSET : EE_MAIN_OFFSET;
+    if (newAddress != lkg_address) //the other copy can have its settings in a different order
+    {
+        dropIndex();
+        snapValid = false;
+    }
+    lkg_address = newAddress;
 }
 
 /*
@@ -211,54 +340,528 @@ with nice descriptive names. Below are a series of functions that transparently
 actual drivers
 */
 
-//given a hash value it looks for that in the table. If it finds
-//the hash it'll return 5 bytes higher which skips the hash and length
-//so the return location will be the start of the actual value itself.
-FLASHMEM uint32_t PrefHandler::findSettingLocation(uint32_t hash)
+//Pull the whole block into RAM in one read then walk the [hash][length][data] chain there to
+//remember where every setting is. After this no read of a setting goes through the cache at all.
+FLASHMEM bool PrefHandler::buildIndex()
 {
-    while (semKeyLookup);
-    semKeyLookup = true;
-    Logger::avalanche("Key lookup for %x", hash);
     uint32_t readHash;
     uint8_t readLength;
-    for (uint32_t idx = SETTINGS_START; idx < EE_DEVICE_SIZE;)
+    uint32_t idx;
+    uint16_t entries = 0;
+    uint32_t startTime = micros();
+
+    dropIndex();
+    wastedBytes = 0;
+    blockImage = new uint8_t[EE_DEVICE_SIZE];
+    if (!blockImage) return false;
+    memCache->Read(base_address + lkg_address, blockImage, EE_DEVICE_SIZE);
+
+    //count the chain first so the index starts out big enough and never gets regrown while loading
+    indexSize = PREF_INDEX_MIN_SIZE;
+    for (idx = SETTINGS_START; idx + 5 <= EE_DEVICE_SIZE; idx += 5 + blockImage[idx + 4])
+    {
+        memcpy(&readHash, &blockImage[idx], 4);
+        if (readHash == 0xFFFFFFFFul) break;
+        if (++entries * 4 > indexSize * 3) indexSize *= 2;
+    }
+    keyIndex = new PrefIndexEntry[indexSize];
+    if (!keyIndex)
+    {
+        dropIndex();
+        return false;
+    }
+    memset(keyIndex, 0, sizeof(PrefIndexEntry) * indexSize);
+    if (position > 0) staleIndexes &= ~(1ull << position);
+
+    for (idx = SETTINGS_START; idx + 5 <= EE_DEVICE_SIZE;)
+    {
+        memcpy(&readHash, &blockImage[idx], 4);
+        if (readHash == 0xFFFFFFFFul) break; //first unused spot. Nothing past here
+        readLength = blockImage[idx + 4];
+        //erased settings have their hash zeroed but still take up room in the chain. So does a
+        //duplicate of a hash already seen or a setting that never got its length set
+        if (readHash != 0 && readLength != 0 && !indexFind(readHash)) indexInsert(readHash, idx + 5, readLength);
+        else wastedBytes += 5 + readLength;
+        idx += 5 + readLength;
+    }
+    nextFree = idx;
+    updateSpaceStats();
+    publish();
+    Logger::avalanche("Loaded %i settings in %uus. Next free spot %x", indexCount, micros() - startTime, nextFree);
+    return true;
+}
+
+void PrefHandler::dropIndex()
+{
+    if (!writerShared) //otherwise they belong to the live snapshot
+    {
+        if (keyIndex) delete[] keyIndex;
+        if (blockImage) delete[] blockImage;
+    }
+    keyIndex = nullptr;
+    blockImage = nullptr;
+    writerShared = false;
+    indexSize = 0;
+    indexCount = 0;
+}
+
+PrefIndexEntry *PrefHandler::indexFind(uint32_t hash)
+{
+    return probe(keyIndex, indexSize, hash);
+}
+
+PrefIndexEntry *PrefHandler::probe(PrefIndexEntry *index, uint16_t size, uint32_t hash)
+{
+    uint16_t mask = size - 1;
+    for (uint16_t slot = hash & mask; index[slot].hash != 0; slot = (slot + 1) & mask)
+    {
+        if (index[slot].hash == hash) return &index[slot];
+    }
+    return nullptr;
+}
+
+FLASHMEM bool PrefHandler::indexInsert(uint32_t hash, uint16_t offset, uint8_t length)
+{
+    if (!unshareWriter()) return false;
+    if ((indexCount + 1) * 4 > indexSize * 3) //getting full. Double it so probe runs stay short
+    {
+        PrefIndexEntry *old = keyIndex;
+        uint16_t oldSize = indexSize;
+        keyIndex = new PrefIndexEntry[oldSize * 2];
+        if (!keyIndex)
+        {
+            keyIndex = old;
+            return false;
+        }
+        indexSize = oldSize * 2;
+        indexCount = 0;
+        memset(keyIndex, 0, sizeof(PrefIndexEntry) * indexSize);
+        for (uint16_t i = 0; i < oldSize; i++)
+        {
+            if (old[i].hash != 0) indexInsert(old[i].hash, old[i].offset, old[i].length);
+        }
+        delete[] old;
+    }
+
+    uint16_t mask = indexSize - 1;
+    uint16_t slot = hash & mask;
+    while (keyIndex[slot].hash != 0) slot = (slot + 1) & mask;
+    keyIndex[slot].hash = hash;
+    keyIndex[slot].offset = offset;
+    keyIndex[slot].length = length;
+    indexCount++;
+    return true;
+}
+
+//Hand the writer's index and block image to readers as the new snapshot. Nothing is copied, the writer
+//keeps using them until it changes something (see unshareWriter). So loading a block costs no copy at all.
+//Writers only run in the main context and on a single core a reader in an interrupt always finishes before
+//the main context gets going again, so the snapshot being replaced isn't in use and is freed right away.
+FLASHMEM void PrefHandler::publish()
+{
+    PrefSnapshot *next = &snaps[liveSnap ^ 1];
+    PrefSnapshot *old = &snaps[liveSnap];
+    if (!keyIndex || !blockImage) return;
+    if (writerShared) //readers already have exactly this
+    {
+        snapPending = false;
+        return;
+    }
+    next->index = keyIndex;
+    next->image = blockImage;
+    next->size = indexSize;
+    next->version = old->version + 1;
+    portMEMORY_BARRIER();
+    liveSnap ^= 1;
+    snapValid = true;
+    snapPending = false;
+    writerShared = true;
+    if (old->index) delete[] old->index;
+    if (old->image) delete[] old->image;
+    old->index = nullptr;
+    old->image = nullptr;
+    old->size = 0;
+}
+
+//The writer's index and image are the live snapshot's until the first change after a publish. Readers
+//mustn't see a half done write so the writer takes its own copy then.
+FLASHMEM bool PrefHandler::unshareWriter()
+{
+    if (!writerShared) return true;
+    PrefIndexEntry *index = new PrefIndexEntry[indexSize];
+    uint8_t *image = new uint8_t[EE_DEVICE_SIZE];
+    if (!index || !image)
+    {
+        if (index) delete[] index;
+        if (image) delete[] image;
+        Logger::error("Out of memory changing settings of device %X", deviceID);
+        return false;
+    }
+    memcpy(index, keyIndex, sizeof(PrefIndexEntry) * indexSize);
+    memcpy(image, blockImage, EE_DEVICE_SIZE);
+    keyIndex = index;
+    blockImage = image;
+    writerShared = false;
+    return true;
+}
+
+void PrefHandler::publishPending()
+{
+    if (snapPending) publish();
+}
+
+//Give back the RAM index, block image and snapshots. A disabled device never reads its settings so it
+//has no use for them. Anything that does read later on just rebuilds them.
+FLASHMEM void PrefHandler::releaseIndex()
+{
+    dropIndex();
+    snapValid = false;
+    snapPending = false;
+    for (int i = 0; i < 2; i++)
+    {
+        if (snaps[i].index) delete[] snaps[i].index;
+        if (snaps[i].image) delete[] snaps[i].image;
+        snaps[i].index = nullptr;
+        snaps[i].image = nullptr;
+        snaps[i].size = 0;
+    }
+}
+
+//Readers need a published snapshot. Building one goes through MemCache so that only happens from the
+//main context. An interrupt makes do with what's there, even if it's stale. Writes are published in one
+//go when the save finishes (saveChecksum / forceCacheWrite) so until then an interrupt sees the settings
+//from before the save. The main context gets its own writes right away.
+bool PrefHandler::snapshotReady()
+{
+    if (IN_INTERRUPT()) return snapValid;
+    bool stale = !snapValid || (position > 0 && (staleIndexes & (1ull << position)));
+    if (stale) buildIndex();
+    else publishPending();
+    return snapValid;
+}
+
+//Look a setting up in the published snapshot. The version check catches the snapshot being republished
+//part way through. That can't happen with writers kept out of interrupts but if it ever does the read
+//is retried once on the newer copy instead of spinning.
+bool PrefHandler::loadValue(uint32_t hash, void *val, uint16_t len, bool isString)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
     {
-        memCache->Read((uint32_t)idx + base_address + lkg_address, &readHash);
-        if (readHash == hash) //matched! return the address + 5 which is the start of the actual value
+        if (!snapshotReady()) return false;
+        uint8_t which = liveSnap;
+        PrefSnapshot *snap = &snaps[which];
+        uint32_t version = snap->version;
+        portMEMORY_BARRIER();
+
+        bool found = false;
+        PrefIndexEntry *entry = probe(snap->index, snap->size, hash);
+        if (entry && entry->length != 0)
         {
-            semKeyLookup = false;
-            return (idx + 5);
+            if (isString) //the stored length includes the terminator so the caller's buffer is at least that big
+            {
+                uint16_t i = 0;
+                char *str = (char *)val;
+                while (i + 1 < entry->length && entry->offset + i < EE_DEVICE_SIZE && snap->image[entry->offset + i] != 0)
+                {
+                    str[i] = snap->image[entry->offset + i];
+                    i++;
+                }
+                str[i] = 0;
+                found = true;
+            }
+            else if (entry->offset + len <= EE_DEVICE_SIZE)
+            {
+                memcpy(val, &snap->image[entry->offset], len);
+                found = true;
+            }
         }
-        //otherwise, read length then skip the 4 for hash, 1 for length, and length too.
-        idx += 4;
-        memCache->Read((uint32_t)idx + base_address + lkg_address, &readLength);
-        idx += 1 + readLength;
+
+        portMEMORY_BARRIER();
+        if (snap->version == version && liveSnap == which) return found;
+    }
+    return false;
+}
+
+//Writes go to the RAM copy and straight through to the cache, which takes care of writing them back to EEPROM
+bool PrefHandler::storeValue(uint32_t address, const void *val, uint16_t len)
+{
+    if (address + len > EE_DEVICE_SIZE || !unshareWriter()) return false;
+    if (blockImage) memcpy(&blockImage[address], val, len);
+    markLkgDirty(address, len);
+    snapPending = true; //published once the whole write is done, not for every piece of it
+    return memCache->Write(address + base_address + lkg_address, val, len);
+}
+
+void PrefHandler::markLkgDirty(uint32_t address, uint16_t len)
+{
+    if (lkg_address != EE_MAIN_OFFSET || len == 0) return;
+    if (position < 1 || position >= CFG_DEV_MGR_MAX_DEVICES) return;
+    for (uint32_t chunk = address / PREF_LKG_CHUNK; chunk <= (address + len - 1) / PREF_LKG_CHUNK; chunk++)
+    {
+        lkgDirty[position] |= (1ul << chunk);
+    }
+}
+
+//Chunks of a device's main block written since the scrubber last brought its LKG copy up to date.
+//0 means nothing is known (first checkpoint since boot) rather than nothing changed.
+uint32_t PrefHandler::getLkgDirty(int pos)
+{
+    if (pos < 1 || pos >= CFG_DEV_MGR_MAX_DEVICES) return 0;
+    return lkgDirty[pos];
+}
+
+void PrefHandler::clearLkgDirty(int pos, uint32_t mask)
+{
+    if (pos < 1 || pos >= CFG_DEV_MGR_MAX_DEVICES) return;
+    lkgDirty[pos] &= ~mask;
+}
+
+//Writer side. Given a hash value it looks for that in the index. If it finds
+//the hash it'll return 5 bytes higher which skips the hash and length
+//so the return location will be the start of the actual value itself.
+uint32_t PrefHandler::findSettingLocation(uint32_t hash)
+{
+    uint32_t result = 0xFFFFFFFFul;
+    Logger::avalanche("Key lookup for %x", hash);
+    if (!keyIndex || (position > 0 && (staleIndexes & (1ull << position)))) buildIndex();
+    if (keyIndex)
+    {
+        PrefIndexEntry *entry = indexFind(hash);
+        if (entry) result = entry->offset;
     }
-    semKeyLookup = false;
-    return 0xFFFFFFFFul;
+    return result;
 }
 
 //Works similarly to above but finds a hash value that has not been initialized and
 //returns the address of the hash value (not 5 higher as with the above function)
-FLASHMEM uint32_t PrefHandler::findEmptySettingLoc()
+uint32_t PrefHandler::findEmptySettingLoc()
 {
-    uint32_t readHash;
-    uint8_t readLength;
-    for (uint32_t idx = SETTINGS_START; idx < EE_DEVICE_SIZE;)
+    //the index is always there by now since keyToAddress looked the key up first
+    if (nextFree + 5 > EE_DEVICE_SIZE) return 0xFFFFFFFFul;
+    return nextFree;
+}
+
+FLASHMEM void PrefHandler::updateSpaceStats()
+{
+    uint16_t used = (nextFree > EE_DEVICE_SIZE ? EE_DEVICE_SIZE : nextFree) - SETTINGS_START;
+    freeBytes = EE_DEVICE_SIZE - SETTINGS_START - used;
+    fragmentation = used ? (wastedBytes * 100ul) / used : 0;
+}
+
+static int compareOffsets(const void *a, const void *b)
+{
+    return (int)((const PrefIndexEntry *)a)->offset - (int)((const PrefIndexEntry *)b)->offset;
+}
+
+//Copy just the live settings, packed together in the order they are in the block, into image which has
+//to hold EE_DEVICE_SIZE - SETTINGS_START bytes. The rest of it is left blank. Returns the bytes used
+//or -1 if the index couldn't be built.
+FLASHMEM int PrefHandler::packSettings(uint8_t *image)
+{
+    uint16_t liveCount = 0;
+    uint16_t pos = 0;
+
+    if ((!keyIndex || (position > 0 && (staleIndexes & (1ull << position)))) && !buildIndex()) return -1;
+    PrefIndexEntry *live = new PrefIndexEntry[indexCount ? indexCount : 1];
+    if (!live) return -1;
+    for (uint16_t i = 0; i < indexSize; i++)
+    {
+        if (keyIndex[i].hash != 0 && keyIndex[i].length != 0) live[liveCount++] = keyIndex[i];
+    }
+    qsort(live, liveCount, sizeof(PrefIndexEntry), compareOffsets);
+
+    memset(image, 0xFF, EE_DEVICE_SIZE - SETTINGS_START);
+    for (uint16_t i = 0; i < liveCount; i++)
+    {
+        memcpy(&image[pos], &live[i].hash, 4);
+        image[pos + 4] = live[i].length;
+        memcpy(&image[pos + 5], &blockImage[live[i].offset], live[i].length);
+        pos += 5 + live[i].length;
+    }
+    delete[] live;
+    return pos;
+}
+
+//Replace everything past the block header with image. It all goes through one MemCache transaction so
+//losing power part way leaves either the old block or the new one, never a mix.
+FLASHMEM void PrefHandler::writeSettings(const uint8_t *image)
+{
+    memCache->beginTransaction();
+    memCache->Write(SETTINGS_START + base_address + lkg_address, image, EE_DEVICE_SIZE - SETTINGS_START);
+    markLkgDirty(SETTINGS_START, EE_DEVICE_SIZE - SETTINGS_START);
+    markUnsealed();
+    saveChecksum();
+    memCache->commitTransaction();
+    buildIndex();
+}
+
+//Rewrite the settings block with only the live settings
+FLASHMEM bool PrefHandler::compact()
+{
+    uint8_t *image;
+    bool result = false;
+
+    //loading the block cold and the commit that rewrites it can each take most of the loop stall timeout
+    supervisor.beginLongOperation();
+    if (keyIndex || buildIndex())
+    {
+        if (wastedBytes == 0) result = true;
+        else if ((image = new uint8_t[EE_DEVICE_SIZE - SETTINGS_START]))
+        {
+            if (packSettings(image) >= 0)
+            {
+                uint16_t reclaimed = wastedBytes;
+                writeSettings(image);
+                Logger::info("Compacted settings of device %X. Got back %i bytes", deviceID, reclaimed);
+                result = true;
+            }
+            delete[] image;
+        }
+    }
+    supervisor.endLongOperation();
+    return result;
+}
+
+//Settings of this device in packed form for a configuration package. image is sized like for packSettings
+FLASHMEM int PrefHandler::exportSettings(uint8_t *image, uint16_t *version)
+{
+    if (base_address == 0xF0F0) return -1;
+    memCache->Read(EE_SCHEMA_VERSION + base_address + lkg_address, version);
+    return packSettings(image);
+}
+
+//Whether data is a run of settings that ends exactly at length and fits in a device block
+bool PrefHandler::checkPacked(const uint8_t *data, uint16_t length)
+{
+    uint16_t pos = 0;
+
+    if (length > EE_DEVICE_SIZE - SETTINGS_START) return false;
+    while (pos < length)
+    {
+        if (pos + 5 > length || pos + 5 + data[pos + 4] > length) return false;
+        pos += 5 + data[pos + 4];
+    }
+    return true;
+}
+
+//Take over the settings from a configuration package. data has to be a packed run of settings (as made by
+//exportSettings) and is checked before anything gets written. The schema version goes in with them so the
+//normal migration at the next start brings settings from older firmware up to date.
+FLASHMEM bool PrefHandler::importSettings(const uint8_t *data, uint16_t length, uint16_t version)
+{
+    if (base_address == 0xF0F0 || !checkPacked(data, length)) return false;
+
+    uint8_t *image = new uint8_t[EE_DEVICE_SIZE - SETTINGS_START];
+    if (!image) return false;
+    memset(image, 0xFF, EE_DEVICE_SIZE - SETTINGS_START);
+    memcpy(image, data, length);
+    supervisor.beginLongOperation();
+    memCache->beginTransaction();
+    memCache->Write(EE_SCHEMA_VERSION + base_address + lkg_address, version);
+    writeSettings(image);
+    memCache->commitTransaction();
+    supervisor.endLongOperation();
+    delete[] image;
+    return true;
+}
+
+void PrefHandler::compactIfFragmented()
+{
+    if (fragmentation >= PREF_COMPACT_THRESHOLD) compact();
+}
+
+//Devices register the steps that convert their old settings layouts, usually from their constructor.
+//A device that bumps its schema version without a layout change doesn't need to register anything.
+FLASHMEM bool PrefHandler::registerMigration(DeviceId device, uint16_t fromVersion, PrefMigrationFunc func)
+{
+    if (numMigrations >= CFG_PREF_MAX_MIGRATIONS)
     {
-        memCache->Read((uint32_t)idx + base_address + lkg_address, &readHash);
-        Logger::avalanche("Read Hash = %x", readHash);
-        if (readHash == 0xFFFFFFFFul) //it's empty! Return this exact address
+        Logger::error("No room to register another settings migration. Raise CFG_PREF_MAX_MIGRATIONS");
+        return false;
+    }
+    migrations[numMigrations].device = device;
+    migrations[numMigrations].fromVersion = fromVersion;
+    migrations[numMigrations].func = func;
+    numMigrations++;
+    return true;
+}
+
+//Bring the stored settings up to the schema version the running firmware expects, one registered
+//step at a time. Blocks written before versioning existed count as version 0. It all happens in one
+//MemCache transaction so a power cut part way through starts the migration over from the old layout.
+FLASHMEM bool PrefHandler::migrateSchema(uint16_t currentVersion)
+{
+    uint16_t storedVersion;
+    uint16_t fromVersion;
+    bool result = true;
+
+    if (base_address == 0xF0F0) return false; //never got a spot in the device table
+    memCache->Read(EE_SCHEMA_VERSION + base_address + lkg_address, &storedVersion);
+    if (storedVersion == currentVersion) return true;
+    supervisor.beginLongOperation(); //a step can rewrite everything, then the whole block has to be committed
+    if (storedVersion == 0xFFFF)
+    {
+        if (!keyIndex) buildIndex();
+        //a brand new block has nothing to convert. It's in the current layout as soon as anything gets saved
+        storedVersion = (keyIndex && indexCount == 0) ? currentVersion : 0;
+    }
+    if (storedVersion > currentVersion)
+    {
+        Logger::warn("Settings of device %X are from newer firmware (schema %i, expected %i). Leaving them alone",
+                     deviceID, storedVersion, currentVersion);
+        supervisor.endLongOperation();
+        return false;
+    }
+
+    uint32_t startTime = micros();
+    memCache->beginTransaction();
+    for (fromVersion = storedVersion; fromVersion < currentVersion; fromVersion++)
+    {
+        for (int i = 0; i < numMigrations; i++)
         {
-            return (idx);
+            if (migrations[i].device != (DeviceId)deviceID || migrations[i].fromVersion != fromVersion) continue;
+            if (!migrations[i].func(this))
+            {
+                Logger::error("Settings migration of device %X from schema %i failed", deviceID, fromVersion);
+                result = false;
+            }
+            break;
         }
-        //otherwise, read length then skip the 4 for hash, 1 for length, and length too.
-        idx += 4;
-        memCache->Read((uint32_t)idx + base_address + lkg_address, &readLength);
-        Logger::avalanche("Read length: %u", readLength);
-        idx += 1 + readLength;
+        if (!result) break;
+    }
+    if (!result)
+    {
+        //leave EEPROM as it was so the next start up runs the failed step again on unconverted data. The
+        //index and image in RAM have the half converted settings so they get reloaded too, and the change
+        //log loses the records the failed steps made.
+        memCache->abortTransaction();
+        buildIndex();
+        changeLog.setup();
+        supervisor.endLongOperation();
+        return false;
+    }
+    memCache->Write(EE_SCHEMA_VERSION + base_address + lkg_address, fromVersion);
+    saveChecksum();
+    memCache->commitTransaction();
+    supervisor.endLongOperation();
+
+    if (storedVersion != fromVersion)
+    {
+        Logger::info("Migrated settings of device %X from schema %i to %i in %uus", deviceID, storedVersion, fromVersion, micros() - startTime);
     }
-    return 0xFFFFFFFFul;
+    return result;
+}
+
+//Let a device show how full and how fragmented its settings block is. Named after the device since
+//every device has one.
+FLASHMEM void PrefHandler::setupStatusEntries(Device *owner)
+{
+    StatusEntry stat;
+    if (!keyIndex) buildIndex();
+    stat = {String(owner->getShortName()) + "_CfgFree", &freeBytes, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {String(owner->getShortName()) + "_CfgFrag", &fragmentation, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
 }
 
 //Uses the above two functions to input a key name and see where it is stored
@@ -267,25 +870,36 @@ FLASHMEM uint32_t PrefHandler::findEmptySettingLoc()
 uint32_t PrefHandler::keyToAddress(const char *key, bool createIfNecessary)
 {
     Logger::avalanche("Key look up for %s", key);
-    uint32_t hash = fnvHash(key);
+    return hashToAddress(fnvHash(key), createIfNecessary);
+}
+
+//Same thing for callers that only have the hash, like the change log
+uint32_t PrefHandler::hashToAddress(uint32_t hash, bool createIfNecessary)
+{
+    if (IN_INTERRUPT()) return 0xFFFFFFFFul; //settings only change from the main context. Reads are fine anywhere
     uint32_t address = findSettingLocation(hash);
+    if (createIfNecessary) markUnsealed(); //only writers create entries so something is about to change
     if (address >= EE_DEVICE_SIZE) 
     {
         if (createIfNecessary)
         {
             Logger::avalanche("Must create new entry for this setting");
-            address = findEmptySettingLoc();        
+            address = findEmptySettingLoc();
+            if (address >= EE_DEVICE_SIZE && wastedBytes > 0 && compact()) address = findEmptySettingLoc();
             if (address >= EE_DEVICE_SIZE) return 0xFFFFFFFFul;
             //write the hash value to this entry because it's new
             Logger::avalanche("Setting stored at %x", address);
-            memCache->Write((uint32_t)address + base_address + lkg_address, hash);
+            storeValue(address, &hash, 4);
             uint8_t len = 0; //don't know length yet. Set it to zero.
             address += 4; //increment past hash location
-            memCache->Write((uint32_t)address + base_address + lkg_address, len);
+            storeValue(address, &len, 1);
             address += 1; //increment past length too
+            if (keyIndex) indexInsert(hash, address, 0);
+            nextFree = address; //this entry's length gets added once the first write claims it
+            updateSpaceStats();
         }
     }
-    Logger::avalanche("Key: %s Returned Addr: %x", key, address);
+    Logger::avalanche("Key: %x Returned Addr: %x", hash, address);
     return address;
 }
 
@@ -295,226 +909,290 @@ FLASHMEM bool PrefHandler::eraseByKey(const char *key)
     if (address >= 0xFFFFFFF) return false; //obviously does not exist
     //but returned value is 5 bytes past the start. First 4 are hash, last one is length
     //can't change length or everything gets messed up but can ruin the hash
-    uint32_t dummy = 0;
     Logger::console("Erasing config entry at %x", address);
-    memCache->Write(address - 5, dummy);
-    memCache->AgeFullyAddress(address - 5); //cause the page to be written very soon
+    removeEntry(address);
+    memCache->AgeFullyAddress(address + base_address + lkg_address - 5); //cause the page to be written very soon
+    compactIfFragmented();
     return true;
 }
 
-//Now we have the actual functions that drivers will call to read and write things
+//Zero the hash of the setting whose value starts at address. Its bytes stay until the block gets compacted
+FLASHMEM void PrefHandler::removeEntry(uint32_t address)
+{
+    uint32_t dummy = 0;
+    markUnsealed();
+    storeValue(address - 5, &dummy, 4);
+    buildIndex(); //rare enough to just rebuild the index. That also counts the newly wasted bytes
+}
 
-//Given a key, write an 8 bit value with that key name
-FLASHMEM bool PrefHandler::write(const char *key, uint8_t val) {
-    uint32_t address = keyToAddress(key, true);
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
+//Every numeric read hands over the default the device would use. It's kept so writes can tell whether
+//a value really needs to go into EEPROM. Same open addressing as the key index so a device with dozens
+//of settings doesn't scan a list on every read and write.
+void PrefHandler::rememberDefault(uint32_t hash, const void *defval, uint8_t size)
+{
+    if (IN_INTERRUPT()) return; //can allocate
+    PrefDefault *def = findDefault(hash);
+    if (!def)
     {
-        len = 1;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
+        if ((defaultsCount + 1) * 4 > defaultsSize * 3) //getting full. Double it so probe runs stay short
+        {
+            PrefDefault *old = defaults;
+            uint16_t oldSize = defaultsSize;
+            //a device reads at least the settings it has stored so the index size is a good first guess
+            uint16_t newSize = oldSize ? oldSize * 2 : (indexSize > PREF_INDEX_MIN_SIZE ? indexSize : PREF_INDEX_MIN_SIZE);
+            defaults = new PrefDefault[newSize];
+            if (!defaults)
+            {
+                defaults = old;
+                return;
+            }
+            memset(defaults, 0, sizeof(PrefDefault) * newSize);
+            defaultsSize = newSize;
+            for (uint16_t i = 0; i < oldSize; i++)
+            {
+                if (old[i].hash == 0) continue;
+                uint16_t slot = old[i].hash & (newSize - 1);
+                while (defaults[slot].hash != 0) slot = (slot + 1) & (newSize - 1);
+                defaults[slot] = old[i];
+            }
+            if (old) delete[] old;
+        }
+        uint16_t slot = hash & (defaultsSize - 1);
+        while (defaults[slot].hash != 0) slot = (slot + 1) & (defaultsSize - 1);
+        def = &defaults[slot];
+        def->hash = hash;
+        defaultsCount++;
     }
-    else if (len != 1)
+    def->size = size;
+    memcpy(def->value, defval, size);
+}
+
+PrefDefault *PrefHandler::findDefault(uint32_t hash)
+{
+    if (!defaults) return nullptr;
+    uint16_t mask = defaultsSize - 1;
+    for (uint16_t slot = hash & mask; defaults[slot].hash != 0; slot = (slot + 1) & mask)
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
+        if (defaults[slot].hash == hash) return &defaults[slot];
     }
-    //then return whether we could write the value into the memory cache
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+    return nullptr;
 }
 
-FLASHMEM bool PrefHandler::write(const char *key, uint16_t val) {
-    uint32_t address = keyToAddress(key, true);
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
+//Only settings that differ from their default take up EEPROM. Setting one back to its default gets rid
+//of the stored copy so the default comes back on the next load too. See PrefDefault for what that means
+//when a firmware update changes a default.
+FLASHMEM bool PrefHandler::matchesDefault(uint32_t hash, const void *val, uint8_t size)
+{
+    PrefDefault *def = findDefault(hash);
+    if (!def) return false; //never read so there's no known default
+    if (def->size != size || memcmp(def->value, val, size)) return false;
+    uint32_t address = hashToAddress(hash, false);
+    if (address < EE_DEVICE_SIZE) removeEntry(address);
+    return true;
+}
+
+//Grabs what a numeric write is about to replace so it can go to the change log once the write has worked.
+//The old value comes from the writer's copy of the block, or the remembered default if the setting isn't
+//stored at all. Returns false if there's nothing worth logging. oldValue has room for 8 bytes
+FLASHMEM bool PrefHandler::captureChange(uint32_t hash, const void *val, uint8_t size, uint8_t *oldValue, bool *absent)
+{
+    bool known = false;
+
+    *absent = true;
+    if (IN_INTERRUPT()) return false; //the look up below can rebuild the index. Not in an interrupt
+    if (lkg_address != EE_MAIN_OFFSET || size > 8) return false; //LKG copies aren't edits
+    memset(oldValue, 0, 8);
+    if (findSettingLocation(hash) < EE_DEVICE_SIZE && blockImage)
     {
-        len = 2;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
+        PrefIndexEntry *entry = indexFind(hash);
+        if (entry && entry->length == size)
+        {
+            memcpy(oldValue, &blockImage[entry->offset], size);
+            *absent = false;
+            known = true;
+        }
     }
-    else if (len != 2)
+    if (*absent)
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
+        PrefDefault *def = findDefault(hash);
+        if (def && def->size == size)
+        {
+            memcpy(oldValue, def->value, size);
+            known = true;
+        }
     }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+    return !known || memcmp(oldValue, val, size); //saveConfiguration writes everything, most of it unchanged
 }
 
-FLASHMEM bool PrefHandler::write(const char *key, uint32_t val) {
-    uint32_t address = keyToAddress(key, true);
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
+//Put a setting back exactly the way the change log says it was. Absent means it wasn't stored at all
+//(so the device used its default) and the stored copy gets removed.
+FLASHMEM bool PrefHandler::restoreValue(uint32_t hash, const void *val, uint8_t size, bool absent)
+{
+    uint8_t oldValue[8];
+    bool wasAbsent;
+    bool result = true;
+
+    if (size == 0 || size > 8) return false;
+    bool changed = captureChange(hash, val, size, oldValue, &wasAbsent);
+    uint32_t address = hashToAddress(hash, false);
+    if (absent)
     {
-        len = 4;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
+        if (address < EE_DEVICE_SIZE) removeEntry(address);
     }
-    else if (len != 4)
+    else
+    {
+        address = hashToAddress(hash, true);
+        result = claimLength(hash, address, size, nullptr) && storeValue(address, val, size);
+    }
+    if (result && changed) changeLog.record(deviceID, hash, oldValue, val, size, wasAbsent);
+    return result;
+}
+
+//Give a setting a new name but keep its value. Mostly for schema migrations
+FLASHMEM bool PrefHandler::renameKey(const char *oldKey, const char *newKey)
+{
+    uint32_t address = keyToAddress(oldKey, false);
+    if (address >= EE_DEVICE_SIZE) return false;
+    if (keyToAddress(newKey, false) < EE_DEVICE_SIZE)
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
+        Logger::error("Can't rename %s to %s. That setting already exists", oldKey, newKey);
         return false;
     }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+    uint32_t hash = fnvHash(newKey);
+    markUnsealed();
+    storeValue(address - 5, &hash, 4);
+    buildIndex();
+    return true;
 }
 
-FLASHMEM bool PrefHandler::write(const char *key, float val) {
-    uint32_t address = keyToAddress(key, true);    
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
+//A new setting has a length of 0 until the first write to it says how big it is. After that every
+//write has to use the same size.
+FLASHMEM bool PrefHandler::claimLength(const char *key, uint32_t address, uint8_t size)
+{
+    return claimLength(fnvHash(key), address, size, key);
+}
+
+FLASHMEM bool PrefHandler::claimLength(uint32_t hash, uint32_t address, uint8_t size, const char *key)
+{
+    if (address >= EE_DEVICE_SIZE || !unshareWriter()) return false; //no room left in the block for a new setting
+    PrefIndexEntry *entry = keyIndex ? indexFind(hash) : nullptr;
+    if (!entry) return false;
+    if (entry->length == 0)
     {
-        len = 4;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
+        entry->length = size;
+        storeValue(address - 1, &size, 1);
+        if (entry->offset == nextFree) nextFree += size;
+        updateSpaceStats();
     }
-    else if (len != 4)
+    else if (entry->length != size)
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
+        if (key) Logger::error("Attempt to write improper length to variable %s!", key);
+        else Logger::error("Attempt to write improper length to setting %x!", hash);
         return false;
     }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+    return true;
+}
+
+//Now we have the actual functions that drivers will call to read and write things
+
+//Given a key, write an 8 bit value with that key name
+FLASHMEM bool PrefHandler::write(const char *key, uint8_t val) {
+    return writeValue(key, &val, sizeof(val));
+}
+
+FLASHMEM bool PrefHandler::write(const char *key, uint16_t val) {
+    return writeValue(key, &val, sizeof(val));
+}
+
+FLASHMEM bool PrefHandler::write(const char *key, uint32_t val) {
+    return writeValue(key, &val, sizeof(val));
+}
+
+FLASHMEM bool PrefHandler::write(const char *key, float val) {
+    return writeValue(key, &val, sizeof(val));
 }
 
 FLASHMEM bool PrefHandler::write(const char *key, double val) {
-    uint32_t address = keyToAddress(key, true);
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
-    {
-        len = 8;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
-    }
-    else if (len != 8)
+    return writeValue(key, &val, sizeof(val));
+}
+
+//All of the numeric writes end up here. Only a write that actually went through makes it into the change
+//log, otherwise a rollback would "restore" something that was never there
+FLASHMEM bool PrefHandler::writeValue(const char *key, const void *val, uint8_t size)
+{
+    uint8_t oldValue[8];
+    bool wasAbsent;
+
+    if (IN_INTERRUPT()) return false; //settings only change from the main context
+    uint32_t hash = fnvHash(key);
+    bool changed = captureChange(hash, val, size, oldValue, &wasAbsent);
+    bool result = true;
+    if (!matchesDefault(hash, val, size))
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
+        uint32_t address = hashToAddress(hash, true);
+        //then whether we could write the value into the memory cache
+        result = claimLength(hash, address, size, key) && storeValue(address, val, size);
     }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+    if (result && changed) changeLog.record(deviceID, hash, oldValue, val, size, wasAbsent);
+    return result;
 }
 
 FLASHMEM bool PrefHandler::write(const char *key, const char *val, size_t maxlen) {
     uint32_t address = keyToAddress(key, true);    
-    uint8_t len;
     size_t stringLen = strlen(val);
     if (stringLen > maxlen) stringLen = maxlen;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
-    {
-        len = maxlen + 1;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
-    }
-    else if (len != (maxlen + 1))
-    {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
-    }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val, stringLen + 1);
+    return claimLength(key, address, maxlen + 1) && storeValue(address, val, stringLen + 1);
 }
 
 FLASHMEM bool PrefHandler::writeBlock(const char *key, uint8_t *data, size_t length)
 {
     uint32_t address = keyToAddress(key, true);    
-    uint8_t len;
-    
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
-    {
-        len = length;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
-    }
-    else if (len != length)
-    {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
-    }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, data, length);
+    return claimLength(key, address, length) && storeValue(address, data, length);
 }
 
 FLASHMEM bool PrefHandler::read(const char *key, uint8_t *val, uint8_t defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+    uint32_t hash = fnvHash(key); //once for both
+    rememberDefault(hash, &defval, sizeof(defval));
+    if (!loadValue(hash, val, sizeof(*val), false)) *val = defval;
+    return true;
 }
 
 FLASHMEM bool PrefHandler::read(const char *key, uint16_t *val, uint16_t defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+    uint32_t hash = fnvHash(key); //once for both
+    rememberDefault(hash, &defval, sizeof(defval));
+    if (!loadValue(hash, val, sizeof(*val), false)) *val = defval;
+    return true;
 }
 
 FLASHMEM bool PrefHandler::read(const char *key, uint32_t *val, uint32_t defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+    uint32_t hash = fnvHash(key); //once for both
+    rememberDefault(hash, &defval, sizeof(defval));
+    if (!loadValue(hash, val, sizeof(*val), false)) *val = defval;
+    return true;
 }
 
 FLASHMEM bool PrefHandler::read(const char *key, float *val, float defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+    uint32_t hash = fnvHash(key); //once for both
+    rememberDefault(hash, &defval, sizeof(defval));
+    if (!loadValue(hash, val, sizeof(*val), false)) *val = defval;
+    return true;
 }
 
 FLASHMEM bool PrefHandler::read(const char *key, double *val, double defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+    uint32_t hash = fnvHash(key); //once for both
+    rememberDefault(hash, &defval, sizeof(defval));
+    if (!loadValue(hash, val, sizeof(*val), false)) *val = defval;
+    return true;
 }
 
 FLASHMEM bool PrefHandler::read(const char *key, char *val, const char* defval)
 {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) 
-    {
-        uint8_t c;
-        int i = 0;
-        while ( memCache->Read((uint32_t)address + base_address + lkg_address + i, &c) )
-        {
-            *val++ = c;
-            i++;
-            if (c == 0) break;
-        }
-        *val = 0;
-        return true;
-    }
-    else 
-    {
-        strcpy(val, defval);
-        return true;
-    }
+    if (!loadValue(fnvHash(key), val, 0, true)) strcpy(val, defval);
+    return true;
 }
 
 FLASHMEM bool PrefHandler::readBlock(const char *key, uint8_t *data, size_t length) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, data, length);
-    else 
-    {
-        return false; //was not found. Return false to let caller know
-    }
+    return loadValue(fnvHash(key), data, length, false); //false if not found to let the caller know
 }
 
 FLASHMEM uint8_t PrefHandler::calcChecksum() {
@@ -531,9 +1209,11 @@ FLASHMEM uint8_t PrefHandler::calcChecksum() {
 //calculate the current checksum and save it to the proper place
 FLASHMEM void PrefHandler::saveChecksum() {
     uint8_t csum;
+    if (lkg_address == EE_MAIN_OFFSET) sealPosition(position); //the CRC bytes are part of what gets summed
     csum = calcChecksum();
     Logger::debug("New checksum: %x", csum);
     memCache->Write(EE_CHECKSUM + base_address + lkg_address, csum);
+    publishPending(); //every save ends here or in forceCacheWrite
 }
 
 FLASHMEM bool PrefHandler::checksumValid() {
@@ -570,6 +1250,9 @@ FLASHMEM bool PrefHandler::checksumValid() {
 
 FLASHMEM void PrefHandler::forceCacheWrite()
 {
+    if (keyIndex) compactIfFragmented(); //a config save is a good time to tidy up
+    if (!isSealed(position)) sealPosition(position);
+    publishPending();
     memCache->FlushAllPages();
 }
 
@@ -592,11 +1275,20 @@ uint32_t PrefHandler::fnvHash(const char *input)
 //to 0xFF's and the cache flushed so the settings will be fresh thereafter. 
 FLASHMEM void PrefHandler::resetEEPROM()
 {
-    //write over all the settings 32 bits at a time
+    //write over all the settings 32 bits at a time. Nothing past the end of the chain was ever written so
+    //with the chain indexed only the used part needs it. A stale index (the scrubber put back a longer chain
+    //from LKG, say) doesn't know where the end is so then the whole area gets it. Bytes that are already
+    //blank don't cost an EEPROM write anyway.
     uint32_t val = 0xFFFFFFFFul;
-    for (uint32_t idx = SETTINGS_START; idx < EE_DEVICE_SIZE; idx = idx + 4)
+    bool stale = (position > 0 && (staleIndexes & (1ull << position)));
+    uint32_t end = (keyIndex && !stale && nextFree < EE_DEVICE_SIZE) ? nextFree : EE_DEVICE_SIZE;
+    for (uint32_t idx = SETTINGS_START; idx < end; idx = idx + 4)
     {
         memCache->Write((uint32_t)idx + base_address + lkg_address, val);
     }
+    markLkgDirty(SETTINGS_START, end - SETTINGS_START);
+    markUnsealed();
+    dropIndex();
+    snapValid = false;
     memCache->FlushAllPages();
 }
@@ -46,6 +46,61 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 extern MemCache *memCache;
 
+class Device;
+class PrefHandler;
+
+//Converts a device's settings from one schema version to the next. Gets the device's PrefHandler and
+//can use the normal read/write/eraseByKey/renameKey calls on it. Return false if it couldn't.
+typedef bool (*PrefMigrationFunc)(PrefHandler *prefs);
+
+typedef struct
+{
+    DeviceId device;
+    uint16_t fromVersion; //converts this version to fromVersion + 1
+    PrefMigrationFunc func;
+} PrefMigration;
+
+//starting number of slots in a device's key index. Doubles whenever it gets 3/4 full
+#define PREF_INDEX_MIN_SIZE  32
+
+//percent of the used part of a settings block that can be erased settings before it gets compacted
+#define PREF_COMPACT_THRESHOLD  25
+
+//Default a device passed when it read a setting. A write of that same value doesn't need to be stored.
+//Defaults are only known for keys read since boot: a write before the first read of its key is always
+//stored. A write equal to the current default drops the stored copy, so if a later firmware changes
+//that default the setting follows the new one instead of keeping the old value.
+//Kept open addressed by hash like the key index. A hash of 0 marks an empty slot
+typedef struct
+{
+    uint32_t hash;
+    uint8_t size;
+    uint8_t value[8];
+} PrefDefault;
+
+//Changes to a device block are tracked in chunks of this many bytes so the last known good copy only has
+//to be updated where something changed. 1024 / 32 chunks fits a 32 bit mask.
+#define PREF_LKG_CHUNK  32
+
+//One slot in the RAM index of settings. A hash of 0 marks an empty slot
+typedef struct
+{
+    uint32_t hash;
+    uint16_t offset; //where the value starts within the device block (past the hash and length)
+    uint8_t length; //0 until the first write sets it
+} PrefIndexEntry;
+
+//Read side of the key index and block image. Readers only ever look at the published one of a pair
+//so they never wait on a writer. The version goes up every time one is published. That happens once per
+//save (saveChecksum or forceCacheWrite), not per write, so interrupts see a save all at once.
+typedef struct
+{
+    PrefIndexEntry *index;
+    uint8_t *image;
+    uint16_t size;
+    volatile uint32_t version;
+} PrefSnapshot;
+
 class PrefHandler {
 public:
 
@@ -58,6 +113,7 @@ public:
     bool write(const char *key, uint32_t val);
     bool write(const char *key, float val);
     bool write(const char *key, double val);
+    //strings and blocks don't go through the change log (records hold 8 bytes) so they can't be rolled back
     bool write(const char *key, const char *val, size_t maxlen);
     bool writeBlock(const char *key, uint8_t *data, size_t length);
     bool read(const char *key, uint8_t *val, uint8_t defval);
@@ -68,18 +124,36 @@ public:
     bool read(const char *key, char *val, const char* defval);
     bool readBlock(const char *key, uint8_t *data, size_t length);
     bool eraseByKey(const char *key);
+    bool renameKey(const char *oldKey, const char *newKey);
+    bool restoreValue(uint32_t hash, const void *val, uint8_t size, bool absent);
 
     uint8_t calcChecksum();
     void saveChecksum();
     bool checksumValid();
     void forceCacheWrite();
     void resetEEPROM();
+    void releaseIndex();
     bool isEnabled();
     void setEnabledStatus(bool en);
     static bool setDeviceStatus(uint16_t device, bool enabled);
     static void dumpDeviceTable();
     static void initDevTable();
+    static void prefetchDevices();
+    static int findPosition(uint16_t device);
+    static bool isSealed(int pos);
+    static void sealPosition(int pos);
+    static void sealTable();
+    static void invalidateIndex(int pos);
+    static uint32_t getLkgDirty(int pos);
+    static void clearLkgDirty(int pos, uint32_t mask);
     void checkTableValidity();
+    bool compact();
+    int exportSettings(uint8_t *image, uint16_t *version);
+    bool importSettings(const uint8_t *data, uint16_t length, uint16_t version);
+    static bool checkPacked(const uint8_t *data, uint16_t length);
+    bool migrateSchema(uint16_t currentVersion);
+    static bool registerMigration(DeviceId device, uint16_t fromVersion, PrefMigrationFunc func);
+    void setupStatusEntries(Device *owner);
 
 private:
     uint32_t base_address; //base address for the parent device
@@ -88,13 +162,61 @@ private:
     bool use_lkg; //use last known good config?
     bool enabled;
     int position; //position within the device table
-    volatile bool semKeyLookup;
+    //the writer's copy. Only ever touched from the main context. Built from EEPROM on first use
+    PrefIndexEntry *keyIndex; //open addressed by hash
+    uint8_t *blockImage; //copy of the whole device block. Lives as long as keyIndex
+    bool writerShared; //keyIndex and blockImage are the live snapshot's until the next change
+    uint16_t indexSize; //always a power of two
+    uint16_t indexCount;
+    uint16_t nextFree; //offset where the next new setting goes. EE_DEVICE_SIZE or more when the block is full
+    uint16_t wastedBytes; //taken up by erased or abandoned settings. Compaction gets them back
+    uint32_t freeBytes; //these two are status entries
+    uint32_t fragmentation; //percent of the used part of the block that's wasted
+    PrefDefault *defaults; //numeric defaults seen by reads since boot
+    uint16_t defaultsSize; //always a power of two
+    uint16_t defaultsCount;
+    PrefSnapshot snaps[2]; //what reads are served from. Any context, interrupts included
+    volatile uint8_t liveSnap;
+    volatile bool snapValid;
+    bool snapPending; //the writer's copy changed since it was last published
 
     uint32_t fnvHash(const char *input);
     uint32_t findSettingLocation(uint32_t hash);
     uint32_t findEmptySettingLoc();
     uint32_t keyToAddress(const char *key, bool createIfNecessary);
+    uint32_t hashToAddress(uint32_t hash, bool createIfNecessary);
+    bool claimLength(const char *key, uint32_t address, uint8_t size);
+    bool claimLength(uint32_t hash, uint32_t address, uint8_t size, const char *key);
+    bool buildIndex();
+    void dropIndex();
+    bool indexInsert(uint32_t hash, uint16_t offset, uint8_t length);
+    PrefIndexEntry *indexFind(uint32_t hash);
+    bool loadValue(uint32_t hash, void *val, uint16_t len, bool isString);
+    bool snapshotReady();
+    void publish();
+    void publishPending();
+    bool unshareWriter();
+    bool writeValue(const char *key, const void *val, uint8_t size);
+    static PrefIndexEntry *probe(PrefIndexEntry *index, uint16_t size, uint32_t hash);
+    bool storeValue(uint32_t address, const void *val, uint16_t len);
+    void rememberDefault(uint32_t hash, const void *defval, uint8_t size);
+    PrefDefault *findDefault(uint32_t hash);
+    bool matchesDefault(uint32_t hash, const void *val, uint8_t size);
+    void removeEntry(uint32_t address);
+    int packSettings(uint8_t *image);
+    void writeSettings(const uint8_t *image);
+    bool captureChange(uint32_t hash, const void *val, uint8_t size, uint8_t *oldValue, bool *absent);
+    void updateSpaceStats();
+    void compactIfFragmented();
     static void processAutoEntry(uint16_t val, uint16_t pos);
+    void markUnsealed();
+    void markLkgDirty(uint32_t address, uint16_t len);
+
+    static PrefMigration migrations[CFG_PREF_MAX_MIGRATIONS];
+    static uint8_t numMigrations;
+    static uint64_t staleIndexes; //positions whose block was rewritten behind the PrefHandler's back
+    static uint64_t unsealedBlocks; //one bit per device table position with changes the block CRC doesn't cover yet
+    static uint32_t lkgDirty[CFG_DEV_MGR_MAX_DEVICES]; //chunks of each main block changed since its last LKG checkpoint
 };
 
 #endif
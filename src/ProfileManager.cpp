@@ -0,0 +1,341 @@
+/*
+ * ProfileManager.cpp
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "ProfileManager.h"
+#include "DeviceManager.h"
+#include "PrefHandler.h"
+#include "MemCache.h"
+#include "ControlLane.h"
+#include "ChangeLog.h"
+#include "SysClock.h"
+#include "Logger.h"
+
+ProfileManager profileManager;
+
+ProfileManager::ProfileManager()
+{
+    memset(&header, 0, sizeof(header));
+    header.active = 0xFF;
+    numStaged = 0;
+    stagedProfile = 0xFF;
+    state = PROFILE_IDLE;
+    stageTime = 0;
+    applyTime = 0;
+}
+
+FLASHMEM void ProfileManager::setup()
+{
+    if (readHeader() && header.active < PROFILE_COUNT)
+    {
+        Logger::info("Active settings profile: %i (%s)", header.active, header.names[header.active]);
+    }
+    tickHandler.detach(this);
+    tickHandler.attach(this, CFG_TICK_INTERVAL_PROFILES);
+    if (header.saving && header.active < PROFILE_COUNT)
+    {
+        //power went out part way through saving a switch. Some devices came up with the new values and
+        //some with the old. Switching to the same profile again stages only what's still old.
+        Logger::warn("Switch to profile %i was interrupted. Finishing it", header.active);
+        if (!selectProfile(header.active))
+        {
+            header.saving = 0;
+            writeHeader();
+        }
+    }
+}
+
+FLASHMEM bool ProfileManager::readHeader()
+{
+    memCache->Read(EE_PROFILES, &header, sizeof(header));
+    if (header.magic == PROFILE_MAGIC) return true;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROFILE_MAGIC;
+    header.active = 0xFF;
+    return false;
+}
+
+//in a transaction of its own so the header page is never half written
+FLASHMEM void ProfileManager::writeHeader()
+{
+    memCache->beginTransaction();
+    memCache->Write(EE_PROFILES, &header, sizeof(header));
+    memCache->commitTransaction();
+}
+
+uint8_t ProfileManager::getActive()
+{
+    return header.active;
+}
+
+uint32_t ProfileManager::slotAddress(uint8_t profile, int position)
+{
+    return EE_PROFILES + 256 + (((uint32_t)profile * CFG_DEV_MGR_MAX_DEVICES) + position) * PROFILE_SLOT_SIZE;
+}
+
+//only fixed size values go in profiles. Strings are things like names and don't belong to a drive mode
+uint8_t ProfileManager::entrySize(const ConfigEntry *entry)
+{
+    switch (entry->varType)
+    {
+    case CFG_ENTRY_VAR_TYPE::BYTE:
+        return 1;
+    case CFG_ENTRY_VAR_TYPE::INT16:
+    case CFG_ENTRY_VAR_TYPE::UINT16:
+        return 2;
+    case CFG_ENTRY_VAR_TYPE::INT32:
+    case CFG_ENTRY_VAR_TYPE::UINT32:
+    case CFG_ENTRY_VAR_TYPE::FLOAT:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+//Snapshot the current settings of every enabled device into a profile. There are far more slots than
+//the journal can take in one transaction so the profile is unnamed (never saved as far as selectProfile
+//is concerned) until every slot is written. A power cut leaves either the whole profile or none of it.
+FLASHMEM bool ProfileManager::saveProfile(uint8_t profile, const char *name)
+{
+    uint8_t slot[PROFILE_SLOT_SIZE];
+    ProfileSlotHeader *slotHeader = (ProfileSlotHeader *)slot;
+    int devices = 0;
+
+    if (profile >= PROFILE_COUNT) return false;
+    readHeader();
+    header.names[profile][0] = 0;
+    if (header.active == profile) header.active = 0xFF;
+    writeHeader();
+
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    {
+        Device *dev = deviceManager.getDeviceByIdx(i);
+        if (!dev || !dev->isEnabled()) continue;
+        int position = PrefHandler::findPosition(dev->getId());
+        if (position < 1) continue;
+
+        const std::vector<ConfigEntry> *entries = dev->getConfigEntries();
+        uint16_t pos = sizeof(ProfileSlotHeader);
+        memset(slot, 0xFF, sizeof(slot));
+        slotHeader->device = dev->getId();
+        slotHeader->count = 0;
+        slotHeader->reserved = 0;
+        for (size_t e = 0; e < entries->size(); e++)
+        {
+            const ConfigEntry *entry = &entries->at(e);
+            uint8_t size = entrySize(entry);
+            if (size == 0) continue;
+            if (pos + 5 + size > PROFILE_SLOT_SIZE || slotHeader->count == 255)
+            {
+                Logger::warn("Profile slot for %s is full. Not all of its settings were saved", dev->getShortName());
+                break;
+            }
+            uint32_t hash = StatusEntry::fnvHash(entry->cfgName.c_str());
+            memcpy(&slot[pos], &hash, 4);
+            slot[pos + 4] = size;
+            memcpy(&slot[pos + 5], entry->varPtr, size);
+            pos += 5 + size;
+            slotHeader->count++;
+        }
+        slotHeader->crc = crc.crc32(&slot[sizeof(ProfileSlotHeader)], pos - sizeof(ProfileSlotHeader));
+        memCache->beginTransaction(); //a slot spans two pages
+        memCache->Write(slotAddress(profile, position), slot, pos);
+        memCache->commitTransaction();
+        devices++;
+    }
+
+    strncpy(header.names[profile], name, PROFILE_NAME_LEN - 1);
+    header.names[profile][PROFILE_NAME_LEN - 1] = 0;
+    header.active = profile; //what's running right now is exactly this profile
+    writeHeader(); //queued after every slot so it can't land first
+
+    Logger::console("Saved settings of %i devices as profile %i (%s)", devices, profile, header.names[profile]);
+    return true;
+}
+
+//Read the profile out of EEPROM and line up every value that would change. Nothing takes effect here.
+//The switch itself happens all at once at the start of the next control lane cycle.
+FLASHMEM bool ProfileManager::selectProfile(uint8_t profile)
+{
+    uint8_t slot[PROFILE_SLOT_SIZE];
+    ProfileSlotHeader *slotHeader = (ProfileSlotHeader *)slot;
+
+    if (profile >= PROFILE_COUNT) return false;
+    if (state != PROFILE_IDLE)
+    {
+        Logger::console("A profile switch is still in progress");
+        return false;
+    }
+    readHeader();
+    if (header.names[profile][0] == 0)
+    {
+        Logger::console("Profile %i has never been saved", profile);
+        return false;
+    }
+
+    numStaged = 0;
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    {
+        Device *dev = deviceManager.getDeviceByIdx(i);
+        if (!dev || !dev->isEnabled()) continue;
+        int position = PrefHandler::findPosition(dev->getId());
+        if (position < 1) continue;
+
+        memCache->Read(slotAddress(profile, position), slot, sizeof(ProfileSlotHeader));
+        if (slotHeader->device != dev->getId()) continue; //device wasn't enabled when the profile was saved
+        uint16_t len = sizeof(ProfileSlotHeader);
+        memCache->Read(slotAddress(profile, position) + len, &slot[len], PROFILE_SLOT_SIZE - len);
+        for (int e = 0; e < slotHeader->count && len + 5 <= PROFILE_SLOT_SIZE; e++) len += 5 + slot[len + 4];
+        if (len > PROFILE_SLOT_SIZE || crc.crc32(&slot[sizeof(ProfileSlotHeader)], len - sizeof(ProfileSlotHeader)) != slotHeader->crc)
+        {
+            Logger::error("Profile %i has corrupt settings for %s. Skipping them", profile, dev->getShortName());
+            continue;
+        }
+
+        const std::vector<ConfigEntry> *entries = dev->getConfigEntries();
+        uint16_t pos = sizeof(ProfileSlotHeader);
+        for (int e = 0; e < slotHeader->count; e++)
+        {
+            uint32_t hash;
+            uint8_t size = slot[pos + 4];
+            memcpy(&hash, &slot[pos], 4);
+            for (size_t c = 0; c < entries->size(); c++)
+            {
+                const ConfigEntry *entry = &entries->at(c);
+                if (StatusEntry::fnvHash(entry->cfgName.c_str()) != hash) continue;
+                //the setting changed type since the profile was saved or already has this value
+                if (entrySize(entry) != size || !memcmp(entry->varPtr, &slot[pos + 5], size)) break;
+                if (numStaged >= PROFILE_MAX_VALUES)
+                {
+                    Logger::error("Profile %i changes too many settings to switch to at once", profile);
+                    numStaged = 0;
+                    return false;
+                }
+                staged[numStaged].varPtr = entry->varPtr;
+                staged[numStaged].device = dev;
+                staged[numStaged].entry = entry;
+                staged[numStaged].size = size;
+                memcpy(staged[numStaged].value, &slot[pos + 5], size);
+                numStaged++;
+                break;
+            }
+            pos += 5 + size;
+        }
+    }
+
+    stagedProfile = profile;
+    stageTime = sysClock->micros();
+    portMEMORY_BARRIER();
+    state = PROFILE_STAGED;
+    return true;
+}
+
+//Called from the control lane interrupt before it samples anything so the lane sees either the old
+//profile or the new one for the whole cycle. Just copies, nothing here can block. That's all it promises
+//though. A device tick in the main loop can be interrupted between reading two of its settings and see
+//one old and one new value for that tick. Profile values are tuning values that each make sense on their
+//own, and the next tick sees the new profile in full.
+void ProfileManager::applyStaged()
+{
+    if (state != PROFILE_STAGED) return;
+    for (uint16_t i = 0; i < numStaged; i++)
+    {
+        switch (staged[i].size)
+        {
+        case 1:
+            *(uint8_t *)staged[i].varPtr = staged[i].value[0];
+            break;
+        case 2:
+            memcpy(staged[i].varPtr, staged[i].value, 2);
+            break;
+        case 4:
+            memcpy(staged[i].varPtr, staged[i].value, 4);
+            break;
+        }
+    }
+    applyTime = sysClock->micros();
+    portMEMORY_BARRIER();
+    state = PROFILE_APPLIED;
+}
+
+void ProfileManager::handleTick()
+{
+    if (state == PROFILE_STAGED && !controlLane.isRunning())
+    {
+        //nothing is running the lane (no motor controller) so a tick boundary is as good as it gets
+        __disable_irq();
+        applyStaged();
+        __enable_irq();
+    }
+    if (state == PROFILE_APPLIED) finishSwitch();
+}
+
+//The new values are already live. Let devices react to them and make them the saved settings so the
+//profile is still in effect after a reboot. All the devices together are too much for one journal, so
+//each saves in a transaction of its own and the header says a switch is being saved until they're done.
+FLASHMEM void ProfileManager::finishSwitch()
+{
+    Device *saved[CFG_DEV_MGR_MAX_DEVICES];
+    int numSaved = 0;
+
+    for (uint16_t i = 0; i < numStaged; i++)
+    {
+        if (staged[i].entry->afterUpdateFunc) CALL_MEMBER_FN(staged[i].device, staged[i].entry->afterUpdateFunc)();
+    }
+
+    header.active = stagedProfile;
+    header.saving = 1;
+    writeHeader();
+
+    changeLog.setSource(CHANGE_PROFILE);
+    for (uint16_t i = 0; i < numStaged; i++)
+    {
+        bool done = false;
+        for (int j = 0; j < numSaved; j++) if (saved[j] == staged[i].device) done = true;
+        if (done) continue;
+        memCache->beginTransaction();
+        staged[i].device->saveConfiguration();
+        memCache->commitTransaction();
+        saved[numSaved++] = staged[i].device;
+    }
+    changeLog.setSource(CHANGE_DEVICE);
+
+    header.saving = 0;
+    writeHeader();
+
+    Logger::info("Switched to profile %i (%s). %i settings changed, live %uus after the request",
+                 stagedProfile, header.names[stagedProfile], numStaged, applyTime - stageTime);
+    numStaged = 0;
+    state = PROFILE_IDLE;
+}
+
+FLASHMEM void ProfileManager::listProfiles()
+{
+    readHeader();
+    for (int i = 0; i < PROFILE_COUNT; i++)
+    {
+        Logger::console("Profile %i: %s%s", i, header.names[i][0] ? header.names[i] : "<empty>", (i == header.active) ? " (active)" : "");
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * ProfileManager.h
+ *
+ * Named sets of device settings (eco, sport, valet...) that can be switched between while running
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef PROFILEMANAGER_H_
+#define PROFILEMANAGER_H_
+
+#include <Arduino.h>
+#include <FastCRC.h>
+#include "config.h"
+#include "eeprom_layout.h"
+#include "TickHandler.h"
+
+class Device;
+struct ConfigEntry;
+
+//how often the main side checks whether a switch needs finishing up
+#define CFG_TICK_INTERVAL_PROFILES  10000
+
+#define PROFILE_NAME_LEN            16
+#define PROFILE_MAGIC               0x50524F46
+#define PROFILE_MAX_VALUES          256 //settings that can change in one switch, all devices together
+
+//first page of EE_PROFILES
+typedef struct
+{
+    uint32_t magic;
+    uint8_t active; //0xFF if no profile has been selected
+    char names[PROFILE_COUNT][PROFILE_NAME_LEN];
+    uint8_t saving; //non zero while devices are still saving the switch to active. Start up finishes it
+} ProfileHeader;
+
+//start of each slot. Followed by count entries of [name hash][size][value]
+typedef struct
+{
+    uint16_t device;
+    uint8_t count;
+    uint8_t reserved;
+    uint32_t crc; //of the entries
+} ProfileSlotHeader;
+
+//one setting that changes when the staged profile goes live
+typedef struct
+{
+    void *varPtr;
+    Device *device;
+    const ConfigEntry *entry;
+    uint8_t size;
+    uint8_t value[4];
+} ProfileValue;
+
+enum ProfileState
+{
+    PROFILE_IDLE,
+    PROFILE_STAGED, //values are ready. The next control lane cycle (or tick if the lane isn't running) applies them
+    PROFILE_APPLIED //in effect. Waiting for the main side to run update callbacks and save
+};
+
+class ProfileManager : public TickObserver {
+public:
+    ProfileManager();
+    void setup();
+    void handleTick();
+    bool saveProfile(uint8_t profile, const char *name);
+    bool selectProfile(uint8_t profile);
+    void applyStaged();
+    void listProfiles();
+    uint8_t getActive();
+
+private:
+    bool readHeader();
+    void writeHeader();
+    void finishSwitch();
+    uint32_t slotAddress(uint8_t profile, int position);
+    static uint8_t entrySize(const ConfigEntry *entry);
+
+    ProfileHeader header;
+    ProfileValue staged[PROFILE_MAX_VALUES];
+    uint16_t numStaged;
+    uint8_t stagedProfile;
+    volatile uint8_t state;
+    uint32_t stageTime;
+    volatile uint32_t applyTime;
+    FastCRC32 crc;
+};
+
+extern ProfileManager profileManager;
+
+#endif /* PROFILEMANAGER_H_ */
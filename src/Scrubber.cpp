@@ -0,0 +1,356 @@
+/*
+ * Scrubber.cpp
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Scrubber.h"
+#include "MemCache.h"
+#include "PrefHandler.h"
+#include "FaultHandler.h"
+#include "DeviceManager.h"
+#include "eeprom_layout.h"
+#include "Logger.h"
+
+Scrubber scrubber;
+
+Scrubber::Scrubber()
+{
+    memset(&block, 0, sizeof(block));
+    memset(&stats, 0, sizeof(stats));
+    inBlock = false;
+    slot = 0;
+    page = 0;
+    lastPage = 0;
+    generation = 0;
+    runningCRC = 0;
+    crcStarted = false;
+    storedCRC = 0;
+    storedMarker = 0;
+    passBlocks = 0;
+    passVerified = 0;
+}
+
+FLASHMEM void Scrubber::setup()
+{
+    tickHandler.detach(this);
+    tickHandler.attach(this, CFG_TICK_INTERVAL_SCRUBBER);
+}
+
+FLASHMEM void Scrubber::setupStatusEntries(Device *owner)
+{
+    StatusEntry stat;
+    //        name              var         type             prevVal  obj
+    stat = {"SCRUB_Passes", &stats.passes, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"SCRUB_Coverage", &stats.coverage, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"SCRUB_Errors", &stats.errors, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"SCRUB_Repaired", &stats.repaired, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"SCRUB_LKGSaves", &stats.lkgSaves, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+    stat = {"SCRUB_LKGBytes", &stats.lkgBytesLast, CFG_ENTRY_VAR_TYPE::UINT32, 0, owner};
+    deviceManager.addStatusEntry(stat);
+}
+
+//CRC of the covered part of a block as the cache sees it. That's what the EEPROM will hold once it's written.
+FLASHMEM uint32_t Scrubber::calcCRC(uint32_t start, uint16_t coverStart, uint16_t coverEnd)
+{
+    FastCRC32 calc;
+    uint8_t buffer[64];
+    uint32_t result = 0;
+    bool first = true;
+
+    for (uint16_t offset = coverStart; offset < coverEnd; offset += sizeof(buffer))
+    {
+        uint16_t len = coverEnd - offset;
+        if (len > sizeof(buffer)) len = sizeof(buffer);
+        memCache->Read(start + offset, buffer, len);
+        result = first ? calc.crc32(buffer, len) : calc.crc32_upd(buffer, len);
+        first = false;
+    }
+    return result;
+}
+
+//Store a fresh CRC for a block. Call it after changing anything in the covered area.
+FLASHMEM void Scrubber::seal(uint32_t start, uint16_t coverStart, uint16_t coverEnd, uint16_t crcOffset)
+{
+    uint32_t value = calcCRC(start, coverStart, coverEnd);
+    uint8_t marker = SCRUB_CRC_MARKER;
+    memCache->Write(start + crcOffset, value);
+    memCache->Write(start + crcOffset + 4, marker);
+}
+
+//Fill in the layout of a slot. False if there's nothing there (unused device table position)
+bool Scrubber::describe(uint8_t which, ScrubBlock *blk)
+{
+    uint16_t id;
+
+    if (which == 0)
+    {
+        blk->start = EE_DEVICE_TABLE;
+        blk->coverStart = 0;
+        blk->coverEnd = EE_TABLE_CRC;
+        blk->crcOffset = EE_TABLE_CRC;
+        blk->size = EE_TABLE_CRC + 5;
+        blk->kind = SCRUB_TABLE;
+        blk->position = 0;
+        return true;
+    }
+    if (which < CFG_DEV_MGR_MAX_DEVICES)
+    {
+        memCache->Read(EE_DEVICE_TABLE + (2 * which), &id);
+        if ((id & 0x7FFF) == 0 || id == 0xFFFF) return false;
+        blk->start = EE_DEVICES_BASE + (EE_DEVICE_SIZE * which);
+        blk->coverStart = SETTINGS_START;
+        blk->coverEnd = EE_DEVICE_SIZE;
+        blk->crcOffset = EE_BLOCK_CRC;
+        blk->size = EE_DEVICE_SIZE;
+        blk->kind = SCRUB_DEVICE;
+        blk->position = which;
+        return true;
+    }
+    blk->start = EE_FAULT_LOG;
+    blk->coverStart = 0;
+    blk->coverEnd = EEFAULT_CRC;
+    blk->crcOffset = EEFAULT_CRC;
+    blk->size = EEFAULT_CRC + 5;
+    blk->kind = SCRUB_FAULTS;
+    blk->position = 0;
+    return true;
+}
+
+//Move on to the next block that exists. Wraps around (and finishes a pass) after the fault log.
+bool Scrubber::nextBlock()
+{
+    while (true)
+    {
+        if (slot >= SCRUB_NUM_SLOTS)
+        {
+            slot = 0;
+            stats.passes++;
+            stats.coverage = passBlocks ? (passVerified * 100) / passBlocks : 0;
+            passBlocks = 0;
+            passVerified = 0;
+            return false; //one block per tick at the most, starting a new pass counts
+        }
+        if (describe(slot++, &block)) break;
+    }
+    passBlocks++;
+    page = block.start >> 8;
+    uint16_t end = max(block.coverEnd, (uint16_t)(block.crcOffset + 5));
+    lastPage = (block.start + end - 1) >> 8;
+    generation = memCache->getChangeCount();
+    crcStarted = false;
+    inBlock = true;
+    return true;
+}
+
+//Check one page of the current block against what the chip actually holds
+void Scrubber::handleTick()
+{
+    uint8_t buffer[256];
+
+    if (!inBlock && !nextBlock()) return;
+    if (memCache->isWriting()) return; //let the write back get through first. Try again next tick
+
+    if (!memCache->ReadRaw(page, buffer))
+    {
+        inBlock = false; //chip's copy is out of date right now. Skip the block this time around
+        return;
+    }
+
+    //the covered part of this page, relative to the block
+    int32_t pageOffset = (int32_t)(page << 8) - (int32_t)block.start;
+    int32_t from = max((int32_t)block.coverStart, pageOffset);
+    int32_t to = min((int32_t)block.coverEnd, pageOffset + 256);
+    if (from < to)
+    {
+        uint8_t *data = &buffer[from - pageOffset];
+        runningCRC = crcStarted ? crc.crc32_upd(data, to - from) : crc.crc32(data, to - from);
+        crcStarted = true;
+    }
+    if (block.crcOffset >= pageOffset && block.crcOffset < pageOffset + 256)
+    {
+        memcpy(&storedCRC, &buffer[block.crcOffset - pageOffset], 4);
+        storedMarker = buffer[block.crcOffset - pageOffset + 4];
+    }
+
+    if (++page > lastPage) finishBlock();
+}
+
+FLASHMEM void Scrubber::finishBlock()
+{
+    static const char *kindNames[] = {"device table", "settings", "fault log"};
+    inBlock = false;
+
+    //something changed while we were reading it so the pages we read might not go together
+    if (memCache->getChangeCount() != generation) return;
+
+    passVerified++;
+    stats.blocksChecked++;
+
+    if (storedMarker != SCRUB_CRC_MARKER || (block.kind == SCRUB_DEVICE && !PrefHandler::isSealed(block.position)))
+    {
+        //written by a build that didn't keep CRCs or the owner hasn't sealed its latest changes yet
+        sealBlock(&block);
+        return;
+    }
+
+    if (runningCRC == storedCRC)
+    {
+        if (!lkgAvailable(&block)) return;
+        uint32_t lkgCRC;
+        uint8_t lkgMarker;
+        memCache->Read(block.start + EE_LKG_OFFSET + block.crcOffset, &lkgCRC);
+        memCache->Read(block.start + EE_LKG_OFFSET + block.crcOffset + 4, &lkgMarker);
+        if (lkgMarker != SCRUB_CRC_MARKER || lkgCRC != storedCRC) checkpointLKG(&block);
+        return;
+    }
+
+    stats.errors++;
+    Logger::error("EEPROM corruption in %s at %x. Stored CRC %x, calculated %x", kindNames[block.kind], block.start, storedCRC, runningCRC);
+    if (lkgAvailable(&block) && lkgValid(&block))
+    {
+        //drop any cached copy first. It may predate the damage and the cache won't rewrite bytes it thinks match
+        for (uint32_t p = block.start; p < block.start + block.size; p += 256) memCache->InvalidateAddress(p);
+        copyBlock(block.start + EE_LKG_OFFSET, block.start, block.size);
+        if (block.kind == SCRUB_DEVICE) PrefHandler::invalidateIndex(block.position); //settings may sit at different offsets now
+        stats.repaired++;
+        Logger::warn("Restored %s at %x from its last known good copy. Reboot so everything picks it up", kindNames[block.kind], block.start);
+    }
+    else
+    {
+        //nothing to restore from. Seal what's there so it's only reported once
+        Logger::error("No good copy to restore from. Check the settings of that device");
+        sealBlock(&block);
+    }
+}
+
+void Scrubber::sealBlock(ScrubBlock *blk)
+{
+    if (blk->kind == SCRUB_DEVICE) PrefHandler::sealPosition(blk->position);
+    else seal(blk->start, blk->coverStart, blk->coverEnd, blk->crcOffset);
+}
+
+//The last known good area is every block's address plus EE_LKG_OFFSET. The fault log has none and for
+//devices far down the table that would land on top of another device's settings or the system log.
+bool Scrubber::lkgAvailable(ScrubBlock *blk)
+{
+    uint16_t id;
+    if (blk->kind == SCRUB_FAULTS) return false;
+    uint32_t lkgStart = blk->start + EE_LKG_OFFSET;
+    uint32_t lkgEnd = lkgStart + blk->size;
+    if (lkgEnd > EE_SYS_LOG) return false;
+    for (int pos = (lkgStart - EE_DEVICES_BASE) / EE_DEVICE_SIZE; pos <= (int)((lkgEnd - 1 - EE_DEVICES_BASE) / EE_DEVICE_SIZE); pos++)
+    {
+        if (pos >= CFG_DEV_MGR_MAX_DEVICES) break;
+        memCache->Read(EE_DEVICE_TABLE + (2 * pos), &id);
+        if ((id & 0x7FFF) != 0 && id != 0xFFFF) return false;
+    }
+    return true;
+}
+
+//does the last known good copy itself check out?
+bool Scrubber::lkgValid(ScrubBlock *blk)
+{
+    uint32_t lkg = blk->start + EE_LKG_OFFSET;
+    uint32_t lkgCRC;
+    uint8_t lkgMarker;
+    memCache->Read(lkg + blk->crcOffset, &lkgCRC);
+    memCache->Read(lkg + blk->crcOffset + 4, &lkgMarker);
+    if (lkgMarker != SCRUB_CRC_MARKER) return false;
+    return (calcCRC(lkg, blk->coverStart, blk->coverEnd) == lkgCRC);
+}
+
+FLASHMEM void Scrubber::copyBlock(uint32_t from, uint32_t to, uint16_t len)
+{
+    uint8_t buffer[64];
+    for (uint16_t offset = 0; offset < len; offset += sizeof(buffer))
+    {
+        uint16_t chunk = len - offset;
+        if (chunk > sizeof(buffer)) chunk = sizeof(buffer);
+        memCache->Read(from + offset, buffer, chunk);
+        memCache->Write(to + offset, buffer, chunk);
+    }
+}
+
+//Bring the last known good copy of a verified block up to date. Only the chunks PrefHandler saw change
+//get compared and only the ones that really differ get written. The header chunk is always looked at
+//since the checksum and CRC live there. Without any tracking (the table or first time since boot)
+//every chunk is compared.
+FLASHMEM void Scrubber::checkpointLKG(ScrubBlock *blk)
+{
+    uint32_t mask = (blk->kind == SCRUB_DEVICE) ? PrefHandler::getLkgDirty(blk->position) : 0;
+    uint16_t written = copyChanged(blk, mask ? (mask | 1) : 0xFFFFFFFFul);
+
+    //verify. The copy has to check out on its own and carry the same CRC as the block it came from
+    uint32_t lkgCRC;
+    memCache->Read(blk->start + EE_LKG_OFFSET + blk->crcOffset, &lkgCRC);
+    if (!lkgValid(blk) || lkgCRC != storedCRC)
+    {
+        if (mask == 0)
+        {
+            Logger::error("Last known good copy of block at %x didn't verify after being updated", blk->start);
+            return;
+        }
+        //something changed that the tracking didn't see. Fall back to looking at the whole thing
+        Logger::debug("Partial LKG update of block at %x didn't verify. Comparing all of it", blk->start);
+        written += copyChanged(blk, 0xFFFFFFFFul);
+        memCache->Read(blk->start + EE_LKG_OFFSET + blk->crcOffset, &lkgCRC);
+        if (!lkgValid(blk) || lkgCRC != storedCRC)
+        {
+            Logger::error("Last known good copy of block at %x didn't verify after being updated", blk->start);
+            return;
+        }
+    }
+    if (blk->kind == SCRUB_DEVICE) PrefHandler::clearLkgDirty(blk->position, mask);
+    stats.lkgSaves++;
+    stats.lkgBytesLast = written;
+    stats.lkgBytesTotal += written;
+    Logger::debug("Checkpointed last known good copy of block at %x. %i bytes written", blk->start, written);
+}
+
+//Copy the chunks of a block picked by mask from main to LKG, skipping any that already match.
+//Returns how many bytes had to be written.
+FLASHMEM uint16_t Scrubber::copyChanged(ScrubBlock *blk, uint32_t mask)
+{
+    uint8_t mainChunk[PREF_LKG_CHUNK];
+    uint8_t lkgChunk[PREF_LKG_CHUNK];
+    uint16_t written = 0;
+
+    for (uint16_t offset = 0, chunk = 0; offset < blk->size; offset += PREF_LKG_CHUNK, chunk++)
+    {
+        if (!(mask & (1ul << chunk))) continue;
+        uint16_t len = blk->size - offset;
+        if (len > PREF_LKG_CHUNK) len = PREF_LKG_CHUNK;
+        memCache->Read(blk->start + offset, mainChunk, len);
+        memCache->Read(blk->start + EE_LKG_OFFSET + offset, lkgChunk, len);
+        if (!memcmp(mainChunk, lkgChunk, len)) continue;
+        memCache->Write(blk->start + EE_LKG_OFFSET + offset, mainChunk, len);
+        written += len;
+    }
+    return written;
+}
@@ -0,0 +1,120 @@
+/*
+ * Scrubber.h
+ *
+ * Walks the EEPROM in the background a page at a time checking the CRCs of
+ * the device table, every device's settings and the fault log against what
+ * is actually stored in the chip. Corrupted settings are put back from the
+ * last known good copy which is refreshed whenever a block checks out.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SCRUBBER_H_
+#define SCRUBBER_H_
+
+#include <Arduino.h>
+#include <FastCRC.h>
+#include "config.h"
+#include "TickHandler.h"
+
+//one page is read per tick so this is also what limits how much of the I2C bus the scrubber uses
+#define CFG_TICK_INTERVAL_SCRUBBER  100000
+
+//marker byte after a stored CRC. Blocks written by older firmware don't have one and just get sealed
+#define SCRUB_CRC_MARKER            0xC5
+
+//device table, then every device table position, then the fault log
+#define SCRUB_NUM_SLOTS             (CFG_DEV_MGR_MAX_DEVICES + 1)
+
+enum ScrubKind
+{
+    SCRUB_TABLE,
+    SCRUB_DEVICE,
+    SCRUB_FAULTS
+};
+
+typedef struct
+{
+    uint32_t start; //EEPROM address of the block
+    uint16_t coverStart; //first byte covered by the CRC, relative to start
+    uint16_t coverEnd; //one past the last covered byte
+    uint16_t crcOffset; //where the CRC and marker are stored. Must not straddle a page boundary
+    uint16_t size; //whole block, which is what gets copied to and from the last known good copy
+    uint8_t kind;
+    uint8_t position; //device table position for SCRUB_DEVICE
+} ScrubBlock;
+
+typedef struct
+{
+    uint32_t passes; //complete trips through every block
+    uint32_t coverage; //percent of blocks that could be verified on the last pass. Busy ones get skipped
+    uint32_t blocksChecked;
+    uint32_t errors; //blocks whose contents didn't match their CRC
+    uint32_t repaired; //of those, how many were put back from the last known good copy
+    uint32_t lkgSaves; //checkpoints of a block into its last known good area
+    uint32_t lkgBytesLast; //bytes the last checkpoint actually had to write
+    uint32_t lkgBytesTotal;
+} ScrubStats;
+
+class Device;
+
+class Scrubber : public TickObserver {
+public:
+    Scrubber();
+    void setup();
+    void handleTick();
+    void setupStatusEntries(Device *owner);
+
+    static uint32_t calcCRC(uint32_t start, uint16_t coverStart, uint16_t coverEnd);
+    static void seal(uint32_t start, uint16_t coverStart, uint16_t coverEnd, uint16_t crcOffset);
+
+private:
+    bool describe(uint8_t which, ScrubBlock *blk);
+    bool nextBlock();
+    void finishBlock();
+    void sealBlock(ScrubBlock *blk);
+    bool lkgAvailable(ScrubBlock *blk);
+    bool lkgValid(ScrubBlock *blk);
+    void copyBlock(uint32_t from, uint32_t to, uint16_t len);
+    uint16_t copyChanged(ScrubBlock *blk, uint32_t mask);
+    void checkpointLKG(ScrubBlock *blk);
+
+    ScrubBlock block;
+    bool inBlock;
+    uint8_t slot; //next slot to look at
+    uint32_t page; //next EEPROM page of the current block
+    uint32_t lastPage;
+    uint32_t generation; //MemCache change count when the block was started
+    FastCRC32 crc;
+    uint32_t runningCRC;
+    bool crcStarted;
+    uint32_t storedCRC;
+    uint8_t storedMarker;
+    uint16_t passBlocks; //blocks that exist this pass
+    uint16_t passVerified; //and how many of them were actually checked
+    ScrubStats stats;
+};
+
+extern Scrubber scrubber;
+
+#endif /* SCRUBBER_H_ */
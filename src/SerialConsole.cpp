@@ -26,6 +26,12 @@
 
 #include "SerialConsole.h"
 #include <ArduinoJson.h>
+#include "ControlLane.h"
+#include "LoopProfiler.h"
+#include "Supervisor.h"
+#include "ProfileManager.h"
+#include "ChangeLog.h"
+#include "ConfigPackage.h"
 
 template<class T> inline Print &operator <<(Print &obj, T arg) { obj.print(arg); return obj; } //Lets us stream SerialUSB
 
@@ -309,7 +315,9 @@ void SerialConsole::updateSetting(const char *settingName, char *valu)
     if (result == 0) //value was stored
     {
         Logger::console("%s was set as value for parameter %s", valu, settingName);
+        memCache->beginTransaction(); //all of the device's settings make it to EEPROM or none do
         deviceMatched->saveConfiguration(); //devices are responsible for doing their own saving and writing to eeprom
+        memCache->commitTransaction();
         if (entry->afterUpdateFunc)
         {
             CALL_MEMBER_FN(deviceMatched, entry->afterUpdateFunc)();
@@ -350,7 +358,16 @@ FLASHMEM void SerialConsole::printMenu() {
     Logger::console("   RESTORE=1 - Read eeprom backup from sdcard and flash it to EEPROM");
     Logger::console("   JSONDUMP=1 - Read config of every enabled device and store it in JSON format to sdcard");
     Logger::console("   JSONREAD=1 - Read JSON file from sdCard and update all devices accordingly");
+    Logger::console("   CFGEXPORT=<1-2> - Save a binary package of all stored settings. 1 = sdcard, 2 = straight out the USB port");
+    Logger::console("   CFGIMPORT=<1-2> - Load a binary settings package. 1 = sdcard, 2 = send it over USB right after the command");
     Logger::console("   NUKE=1 - Resets all device settings in EEPROM. You have been warned.");
+    Logger::console("   LANESTATS=<0-1> - 1 shows control lane timing histograms, 0 resets them");
+    Logger::console("   LOOPSTATS=<0-1> - 1 shows main loop stage timing and CPU load, 0 resets them");
+    Logger::console("   MEMSTATS=<0-2> - 1 shows EEPROM cache statistics, 2 adds the recent access trace, 0 resets them");
+    Logger::console("   PROFILESAVE=<0-3>,name - Save the current settings of all enabled devices as a named profile");
+    Logger::console("   PROFILE=<0-3> - Switch to a saved profile while running. Any other number lists the profiles");
+    Logger::console("   CHANGELOG=<n> - Show the last n settings changes");
+    Logger::console("   ROLLBACK=<n> - Undo every settings change made after change number n");
 
     //This call causes the device manager to list all enabled and disabled devices
     //nothing hard coded here, it can query the list of registered devices
@@ -408,7 +425,9 @@ void SerialConsole::serialEvent() {
     }
 
     if (incoming == 10 || incoming == 13) { //command done. Parse it.
+        changeLog.setSource(CHANGE_CONSOLE);
         handleConsoleCmd();
+        changeLog.setSource(CHANGE_DEVICE);
         ptrBuffer = 0; //reset line counter once the line has been processed
     } else {
         cmdBuffer[ptrBuffer++] = (unsigned char) incoming;
@@ -432,6 +451,7 @@ void SerialConsole::injectChar(char c)
 
 FLASHMEM void SerialConsole::handleConsoleCmd() {
     handlingEvent = true;
+    supervisor.beginLongOperation(); //some commands take a good long while. Nobody should be blamed for that
 
     if (state == STATE_ROOT_MENU) {
         if (ptrBuffer == 1) { //command is a single ascii character
@@ -440,6 +460,7 @@ FLASHMEM void SerialConsole::handleConsoleCmd() {
             handleConfigCmd();
         }
     }
+    supervisor.endLongOperation();
     handlingEvent = false;
 }
 
@@ -486,6 +507,7 @@ FLASHMEM void SerialConsole::handleConfigCmd() {
             {
                 dev->forceEnableState(true);
                 dev->setup();
+                controlLane.refreshDevices();
             } 
             else Logger::error("Couldn't initialize the device without a reboot!");
         }
@@ -501,6 +523,7 @@ FLASHMEM void SerialConsole::handleConfigCmd() {
             {
                 dev->disableDevice();
                 dev->forceEnableState(false);
+                controlLane.refreshDevices();
             }
         }
         else {
@@ -538,9 +561,8 @@ FLASHMEM void SerialConsole::handleConfigCmd() {
     } else if (cmdString == String("NUKE")) {
         if (newValue == 1) {
             Logger::console("Start of EEPROM Nuke");
-            memCache->InvalidateAll(); //first force writing of all dirty pages and invalidate them
-            memCache->nukeFromOrbit(); //then completely erase EEPROM
-            Logger::console("Device settings have been nuked. Reboot to reload default settings");
+            memCache->nukeFromOrbit(); //erases in the background then reboots to load default settings
+            Logger::console("EEPROM is being erased. The system will reboot when it's done");
         }
     } else if (cmdString == String("DUMP")) {
         if (newValue == 1) {
@@ -558,6 +580,33 @@ FLASHMEM void SerialConsole::handleConfigCmd() {
         if (newValue == 1) {
             loadEEPROMJSON();
         }
+    } else if (cmdString == String("CFGEXPORT")) {
+        if (newValue == 1 || newValue == 2) generateConfigPackage(newValue == 2);
+    } else if (cmdString == String("CFGIMPORT")) {
+        if (newValue == 1 || newValue == 2) loadConfigPackage(newValue == 2);
+    } else if (cmdString == String("LANESTATS")) {
+        if (newValue == 1) controlLane.dumpStats();
+        else controlLane.resetStats();
+    } else if (cmdString == String("LOOPSTATS")) {
+        if (newValue == 1) loopProfiler.dumpStats();
+        else loopProfiler.reset();
+    } else if (cmdString == String("PROFILE")) {
+        if (newValue >= 0 && newValue < PROFILE_COUNT)
+        {
+            if (profileManager.selectProfile(newValue)) Logger::console("Switching to profile %i", newValue);
+        }
+        else profileManager.listProfiles();
+    } else if (cmdString == String("PROFILESAVE")) {
+        char *name = strchr(strVal, ',');
+        if (newValue >= 0 && newValue < PROFILE_COUNT) profileManager.saveProfile(newValue, name ? name + 1 : "unnamed");
+        else Logger::console("Profile number has to be 0 to %i", PROFILE_COUNT - 1);
+    } else if (cmdString == String("CHANGELOG")) {
+        changeLog.dump(newValue > 0 ? newValue : 20);
+    } else if (cmdString == String("ROLLBACK")) {
+        if (newValue >= 0) changeLog.rollback(newValue);
+    } else if (cmdString == String("MEMSTATS")) {
+        if (newValue > 0) memCache->dumpStats(newValue == 2);
+        else memCache->resetStats();
     } else {
         //Logger::console("Unknown command");
         updateSetting(cmdString.c_str(), strVal);
@@ -611,7 +660,9 @@ FLASHMEM void SerialConsole::handleShortCmd() {
         break;
     case 'Z': // save throttle settings
         if (accelerator) {
+            memCache->beginTransaction();
             accelerator->saveConfiguration();
+            memCache->commitTransaction();
         }
         break;
     case 'b':
@@ -622,7 +673,9 @@ FLASHMEM void SerialConsole::handleShortCmd() {
         break;
     case 'B':
         if (brake != NULL) {
+            memCache->beginTransaction();
             brake->saveConfiguration();
+            memCache->commitTransaction();
         }
         break;
     
@@ -631,7 +684,9 @@ FLASHMEM void SerialConsole::handleShortCmd() {
         {
             systemIO.calibrateADCOffset(i, true);
         }        
+        memCache->beginTransaction();
         sysDev->saveConfiguration();
+        memCache->commitTransaction();
         systemIO.setup_ADC_params(); //change takes immediate effect
         break;
     case 'a':
@@ -658,6 +713,7 @@ FLASHMEM void SerialConsole::generateEEPROMBinary()
         return;
     }
     Logger::console("Reading from EEPROM and saving to SDCard.");
+    uint32_t startTime = millis();
     uint8_t buffer[130];
     int x = 0;
     for (int i = 0; i < (1024 * 256); i = i + 128)
@@ -672,6 +728,7 @@ FLASHMEM void SerialConsole::generateEEPROMBinary()
             file.close();
             return;
         }
+        supervisor.pet();
         x++;
         if (x == 256)
         {
@@ -681,7 +738,7 @@ FLASHMEM void SerialConsole::generateEEPROMBinary()
     }
     file.flush();
     file.close();
-    Logger::console("Successfully saved EEPROM to sdcard.");
+    Logger::console("Successfully saved EEPROM to sdcard (%u bytes in %ums).", 1024 * 256, millis() - startTime);
 }
 
 //load binary snapshot of eeprom from sdcard
@@ -693,6 +750,7 @@ FLASHMEM void SerialConsole::loadEEPROMBinary()
         return;
     }
     Logger::console("Reading from sdCard and writing to EEPROM");
+    uint32_t startTime = millis();
     uint8_t buffer[130];
     int x = 0;
     for (int i = 0; i < (1024 * 256); i = i + 128)
@@ -712,6 +770,7 @@ FLASHMEM void SerialConsole::loadEEPROMBinary()
             file.close();
             return;
         }
+        supervisor.pet();
         x++;
         if (x == 256)
         {
@@ -722,7 +781,7 @@ FLASHMEM void SerialConsole::loadEEPROMBinary()
     file.close();
     Logger::console("Flushing all eeprom caches.");
     memCache->InvalidateAll();
-    Logger::console("Successfully updated EEPROM from sdCard. Please reboot now.");
+    Logger::console("Successfully updated EEPROM from sdCard in %ums. Please reboot now.", millis() - startTime);
 }
 
 //instead of binary, generate a pretty json file of all the enabled devices with all
@@ -734,6 +793,7 @@ FLASHMEM void SerialConsole::generateEEPROMJSON()
         return;
     }
     Logger::console("Creating json settings document on sdcard.");
+    uint32_t startTime = millis();
 
     DynamicJsonDocument doc(20000);
 
@@ -746,12 +806,12 @@ FLASHMEM void SerialConsole::generateEEPROMJSON()
 
     //can remove the Pretty part of the function call to get a minified version. But, sdcards are large and this version
     //is much easier to read by human beings
-    serializeJsonPretty(doc, file);
+    size_t bytes = serializeJsonPretty(doc, file);
     file.println();
     file.flush();
     file.close();
 
-    Logger::console("Done saving json settings file.");
+    Logger::console("Done saving json settings file (%u bytes in %ums).", bytes, millis() - startTime);
 }
 
 //You know that editable JSON file we made above? Load it from sdcard and parse it. Update
@@ -766,6 +826,7 @@ FLASHMEM void SerialConsole::loadEEPROMJSON()
         return;
     }
     Logger::console("Reading json from SDCard and writing settings to EEPROM");
+    uint32_t startTime = millis();
 
     deserializeJson(doc, file);
 
@@ -817,7 +878,46 @@ FLASHMEM void SerialConsole::loadEEPROMJSON()
             }
         }
     }
-    Logger::console("Finished importing settings from JSON");
+    Logger::console("Finished importing settings from JSON in %ums", millis() - startTime);
 }
 
+//Binary package of only the settings that are stored. Much smaller than the EEPROM image or the json file
+//and quick enough to pull straight over USB. On USB nothing else can be printed until the package is out.
+FLASHMEM void SerialConsole::generateConfigPackage(bool toUSB)
+{
+    uint32_t bytes = 0;
+    uint32_t startTime = millis();
+    bool result;
+
+    if (toUSB) result = configPackage.exportTo(&SerialUSB, &bytes);
+    else
+    {
+        if (!file.open("gevcu7_config.pkg", O_RDWR | O_CREAT | O_TRUNC)) {
+            Logger::error("Could not create the settings package on the sdcard. Aborting.");
+            return;
+        }
+        result = configPackage.exportTo(&file, &bytes);
+        file.close();
+    }
+    if (result) Logger::console("Saved settings package (%u bytes in %ums)", bytes, millis() - startTime);
+    else Logger::error("Could not save the settings package");
+}
 
+FLASHMEM void SerialConsole::loadConfigPackage(bool fromUSB)
+{
+    uint32_t bytes = 0;
+    uint32_t startTime = millis();
+    bool result;
+
+    if (fromUSB) result = configPackage.importFrom(&SerialUSB, &bytes);
+    else
+    {
+        if (!file.open("gevcu7_config.pkg", O_READ)) {
+            Logger::error("Could not open the settings package on the sdcard. Aborting.");
+            return;
+        }
+        result = configPackage.importFrom(&file, &bytes);
+        file.close();
+    }
+    if (result) Logger::console("Loaded settings package (%u bytes in %ums). Please reboot now.", bytes, millis() - startTime);
+}
@@ -82,6 +82,8 @@ private:
     void loadEEPROMBinary();
     void generateEEPROMJSON();
     void loadEEPROMJSON();
+    void generateConfigPackage(bool toUSB);
+    void loadConfigPackage(bool fromUSB);
 };
 
 #endif /* SERIALCONSOLE_H_ */
@@ -0,0 +1,244 @@
+/*
+ * Supervisor.cpp
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+
+#include "Supervisor.h"
+#include <TeensyTimerTool.h>
+#include "Watchdog_t4.h"
+#include "CrashHandler.h"
+#include "Logger.h"
+#include "SysClock.h"
+
+using namespace TeensyTimerTool;
+
+extern WDT_T4<WDT3> wdt;
+
+//TMR2 is free. The stall monitor needs its own timer so it still runs when everything else is stuck
+PeriodicTimer stallTimer(TMR2);
+
+static void stallTrampoline()
+{
+    supervisor.handleInterrupt();
+}
+
+Supervisor::Supervisor()
+{
+    for (int i = 0; i < CFG_SUPERVISOR_MAX_TASKS; i++) tasks[i].task = nullptr;
+    lastLoopTime = 0;
+    longOperations = 0;
+    lastScan = 0;
+    alive = true;
+    running = false;
+}
+
+/*
+ * Call at the end of setup once all the devices have registered. Everything gets a fresh
+ * check in time here so that the long boot doesn't immediately count against anyone.
+ */
+FLASHMEM void Supervisor::setup()
+{
+    resetCheckIns();
+    lastLoopTime = sysClock->millis();
+    running = true;
+    stallTimer.begin(stallTrampoline, CFG_SUPERVISOR_STALL_CHECK);
+    NVIC_SET_PRIORITY(IRQ_QTIMER2, CFG_SUPERVISOR_PRIORITY);
+    int count = 0;
+    for (int i = 0; i < CFG_SUPERVISOR_MAX_TASKS; i++) if (tasks[i].task) count++;
+    Logger::info("Supervisor watching %i tasks, loop stall timeout %ims", count, CFG_LOOP_STALL_TIMEOUT);
+}
+
+/*
+ * Register a task that must check in at least every expectedInterval microseconds. A bit of
+ * slack is given (CFG_SUPERVISOR_MISSED_TICKS intervals) since a busy loop can easily push
+ * a tick back a little. Registering the same task again just updates its interval.
+ */
+FLASHMEM bool Supervisor::watch(const void *task, uint16_t id, uint32_t expectedInterval)
+{
+    int freeSlot = -1;
+    if (!task || expectedInterval == 0) return false;
+
+    for (int i = 0; i < CFG_SUPERVISOR_MAX_TASKS; i++)
+    {
+        if (tasks[i].task == task)
+        {
+            freeSlot = i;
+            break;
+        }
+        if (!tasks[i].task && freeSlot == -1) freeSlot = i;
+    }
+    if (freeSlot == -1)
+    {
+        Logger::error("Supervisor has no room to watch task %X", id);
+        return false;
+    }
+    //fill in everything before the task pointer so checkIn never sees a half set up entry
+    tasks[freeSlot].id = id;
+    tasks[freeSlot].maxInterval = expectedInterval * CFG_SUPERVISOR_MISSED_TICKS;
+    tasks[freeSlot].lastCheckIn = sysClock->micros();
+    tasks[freeSlot].late = false;
+    tasks[freeSlot].task = task;
+    return true;
+}
+
+void Supervisor::unwatch(const void *task)
+{
+    for (int i = 0; i < CFG_SUPERVISOR_MAX_TASKS; i++)
+    {
+        if (tasks[i].task == task) tasks[i].task = nullptr;
+    }
+}
+
+//Called a lot, from the tick handler and possibly interrupts, so keep it quick.
+void Supervisor::checkIn(const void *task)
+{
+    for (int i = 0; i < CFG_SUPERVISOR_MAX_TASKS; i++)
+    {
+        if (tasks[i].task == task)
+        {
+            tasks[i].lastCheckIn = sysClock->micros();
+            return;
+        }
+    }
+}
+
+/*
+ * Called once per trip through loop() in place of feeding the watchdog directly. Records that
+ * the loop is alive then, every few milliseconds, checks every registered task. The watchdog
+ * only gets fed if all of them checked in recently enough. A task that went quiet is logged
+ * once and dropped into the breadcrumbs so the crash report says who it was.
+ */
+void Supervisor::loopCheck()
+{
+    uint32_t now = sysClock->millis();
+    lastLoopTime = now;
+
+    if ((now - lastScan) < CFG_SUPERVISOR_SCAN_INTERVAL) 
+    {
+        if (alive) wdt.feed();
+        return;
+    }
+    lastScan = now;
+
+    if (longOperations > 0)
+    {
+        wdt.feed();
+        return;
+    }
+
+    uint32_t nowMicros = sysClock->micros();
+    alive = true;
+    for (int i = 0; i < CFG_SUPERVISOR_MAX_TASKS; i++)
+    {
+        if (!tasks[i].task) continue;
+        uint32_t since = nowMicros - tasks[i].lastCheckIn;
+        if (since > tasks[i].maxInterval)
+        {
+            alive = false;
+            if (!tasks[i].late)
+            {
+                tasks[i].late = true;
+                uint32_t lateMs = since / 1000;
+                if (lateMs > 0xFFFF) lateMs = 0xFFFF;
+                crashHandler.addBreadcrumb(ENCODE_BREAD("SUPVR") + 1);
+                crashHandler.addBreadcrumb(((uint32_t)tasks[i].id << 16) | lateMs);
+                Logger::error("Task %X has not checked in for %ims. Watchdog will not be fed.", tasks[i].id, lateMs);
+            }
+        }
+        else tasks[i].late = false;
+    }
+
+    if (alive) wdt.feed();
+}
+
+/*
+ * For code that legitimately keeps the loop from running for a while (flashing, bulk EEPROM
+ * operations) and can't use beginLongOperation because it doesn't know when it'll finish.
+ * Feeds the hardware watchdog and tells the stall monitor we're still going.
+ */
+void Supervisor::pet()
+{
+    lastLoopTime = sysClock->millis();
+    wdt.feed();
+}
+
+/*
+ * Bracket things like console commands that are allowed to take a long time. The stall monitor
+ * stands down and nobody is held to their check in interval until the matching end call.
+ * The hardware watchdog still applies so the operation itself must call pet() if it can run
+ * for seconds.
+ */
+void Supervisor::beginLongOperation()
+{
+    longOperations++;
+}
+
+void Supervisor::endLongOperation()
+{
+    if (longOperations > 0) longOperations--;
+    if (longOperations == 0)
+    {
+        //give everyone a clean slate. Ticks that couldn't run during the operation weren't their fault
+        resetCheckIns();
+        lastLoopTime = sysClock->millis();
+    }
+}
+
+bool Supervisor::allAlive()
+{
+    return alive;
+}
+
+void Supervisor::resetCheckIns()
+{
+    uint32_t now = sysClock->micros();
+    for (int i = 0; i < CFG_SUPERVISOR_MAX_TASKS; i++)
+    {
+        tasks[i].lastCheckIn = now;
+        tasks[i].late = false;
+    }
+    alive = true;
+}
+
+/*
+ * The stall monitor. Runs from its own timer at a higher priority than everything else we
+ * own so it gets to run even if the loop or the control lane is wedged. If loop() hasn't been
+ * through loopCheck() in CFG_LOOP_STALL_TIMEOUT there's no point waiting for the hardware
+ * watchdog to notice five seconds later - leave a breadcrumb and reset now.
+ */
+void Supervisor::handleInterrupt()
+{
+    if (!running || longOperations > 0) return;
+    if (sysClock->isSimulated()) return; //simulated time only moves when someone moves it
+    uint32_t stalled = sysClock->millis() - lastLoopTime;
+    if (stalled > CFG_LOOP_STALL_TIMEOUT)
+    {
+        crashHandler.addBreadcrumb(ENCODE_BREAD("SUPVR") + 2);
+        crashHandler.addBreadcrumb(stalled);
+        wdt.reset();
+    }
+}
+
+Supervisor supervisor;
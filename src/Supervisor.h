@@ -0,0 +1,77 @@
+/*
+ * Supervisor.h
+ *
+ * The supervisor decides when the hardware watchdog gets fed. Anything critical registers
+ * itself with how often it expects to run and then checks in every time it does. The watchdog
+ * is only fed while every registered task is on time. Separately, a small high priority timer
+ * watches the main loop itself and resets the board if the loop stops cycling for more than
+ * CFG_LOOP_STALL_TIMEOUT. Either way the culprit goes into the crash handler breadcrumbs first.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SUPERVISOR_H_
+#define SUPERVISOR_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+//things that aren't devices still need an ID for the breadcrumbs. Device IDs don't go this high
+#define SUPERVISOR_ID_CONTROL_LANE  0xFF01
+
+struct SupervisedTask {
+    const void *task; //whatever registered. Usually a device but only used as a key
+    uint16_t id; //device ID or some other number that makes sense in a breadcrumb
+    uint32_t maxInterval; //microseconds allowed between check ins before the task is considered dead
+    volatile uint32_t lastCheckIn; //sysClock micros of the last check in
+    bool late; //already reported so the log doesn't fill up with the same complaint
+};
+
+class Supervisor {
+public:
+    Supervisor();
+    void setup();
+    bool watch(const void *task, uint16_t id, uint32_t expectedInterval);
+    void unwatch(const void *task);
+    void checkIn(const void *task);
+    void loopCheck();
+    void pet();
+    void beginLongOperation();
+    void endLongOperation();
+    bool allAlive();
+    void handleInterrupt(); //public so the timer callback can get here
+
+private:
+    void resetCheckIns();
+
+    SupervisedTask tasks[CFG_SUPERVISOR_MAX_TASKS];
+    volatile uint32_t lastLoopTime; //sysClock millis of the last trip through loop()
+    volatile uint8_t longOperations; //nesting count. The stall monitor stands down while this is non-zero
+    uint32_t lastScan;
+    bool alive;
+    bool running;
+};
+
+extern Supervisor supervisor;
+
+#endif /* SUPERVISOR_H_ */
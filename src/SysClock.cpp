@@ -0,0 +1,115 @@
+/*
+ * SysClock.cpp
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SysClock.h"
+
+static HardwareClock hardwareClock;
+SysClock *sysClock = &hardwareClock;
+
+bool SysClock::isSimulated()
+{
+    return false;
+}
+
+uint32_t HardwareClock::millis()
+{
+    return ::millis();
+}
+
+uint32_t HardwareClock::micros()
+{
+    return ::micros();
+}
+
+void HardwareClock::delay(uint32_t ms)
+{
+    ::delay(ms);
+}
+
+void HardwareClock::delayMicroseconds(uint32_t us)
+{
+    ::delayMicroseconds(us);
+}
+
+SimulatedClock::SimulatedClock()
+{
+    now = 0;
+}
+
+uint32_t SimulatedClock::millis()
+{
+    return (uint32_t)(now / 1000ull);
+}
+
+uint32_t SimulatedClock::micros()
+{
+    return (uint32_t)now;
+}
+
+//a blocking delay in virtual time just moves time forward. Nothing else gets to
+//run while that happens which is exactly what would happen on the real hardware too
+void SimulatedClock::delay(uint32_t ms)
+{
+    now += (uint64_t)ms * 1000ull;
+}
+
+void SimulatedClock::delayMicroseconds(uint32_t us)
+{
+    now += us;
+}
+
+bool SimulatedClock::isSimulated()
+{
+    return true;
+}
+
+void SimulatedClock::advance(uint64_t us)
+{
+    now += us;
+}
+
+//time never goes backward. Asking for an earlier time is ignored.
+void SimulatedClock::advanceTo(uint64_t us)
+{
+    if (us > now) now = us;
+}
+
+uint64_t SimulatedClock::getTime()
+{
+    return now;
+}
+
+void SimulatedClock::reset()
+{
+    now = 0;
+}
+
+void setSysClock(SysClock *clock)
+{
+    if (clock) sysClock = clock;
+    else sysClock = &hardwareClock;
+}
+
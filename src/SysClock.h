@@ -0,0 +1,83 @@
+/*
+ * SysClock.h
+ *
+ * Central time source. Everything that cares about elapsed time should ask
+ * sysClock instead of calling millis() / micros() / delay() directly. On the
+ * hardware that just passes through to the Teensy core. The simulated clock
+ * only moves when told to so the tick driven code can be run faster than
+ * real time (and repeatably) for benchmarking and off target testing.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SYSCLOCK_H_
+#define SYSCLOCK_H_
+
+#include <Arduino.h>
+
+class SysClock {
+public:
+    virtual uint32_t millis() = 0;
+    virtual uint32_t micros() = 0;
+    virtual void delay(uint32_t ms) = 0;
+    virtual void delayMicroseconds(uint32_t us) = 0;
+    virtual bool isSimulated();
+};
+
+//straight pass through to the hardware timers
+class HardwareClock : public SysClock {
+public:
+    uint32_t millis();
+    uint32_t micros();
+    void delay(uint32_t ms);
+    void delayMicroseconds(uint32_t us);
+};
+
+//virtual time. Starts at zero and only moves forward when advance() is called
+//or something calls delay. Time is kept in 64 bits so a long simulation won't
+//wrap even though millis() and micros() wrap just like the real thing.
+class SimulatedClock : public SysClock {
+public:
+    SimulatedClock();
+    uint32_t millis();
+    uint32_t micros();
+    void delay(uint32_t ms);
+    void delayMicroseconds(uint32_t us);
+    bool isSimulated();
+
+    void advance(uint64_t us);
+    void advanceTo(uint64_t us);
+    uint64_t getTime();
+    void reset();
+
+private:
+    volatile uint64_t now; //virtual time in microseconds
+};
+
+extern SysClock *sysClock;
+
+//Install a different clock. Passing nullptr goes back to the hardware clock.
+void setSysClock(SysClock *clock);
+
+#endif /* SYSCLOCK_H_ */
+
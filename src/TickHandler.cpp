@@ -32,6 +32,7 @@
  */
 
 #include "TickHandler.h"
+#include "Supervisor.h"
 
 int timer;
 //we're using up to 12 timers and they are defined here so that they can
@@ -75,6 +76,7 @@ TickHandler::TickHandler() {
 
     for (int i = 0; i < NUM_TIMERS; i++) {
         timerEntry[i].interval = 0;
+        timerEntry[i].nextFire = 0;
         for (int j = 0; j < CFG_TIMER_NUM_OBSERVERS; j++) {
             timerEntry[i].observer[j] = NULL;
         }
@@ -82,6 +84,9 @@ TickHandler::TickHandler() {
 #ifdef CFG_TIMER_USE_QUEUING
     bufferHead = bufferTail = 0;
 #endif
+    simClock = nullptr;
+    for (int i = 0; i < CFG_TIMER_NUM_CONTINUATIONS; i++) pending[i].cont = nullptr;
+    lastBlockingReport = 0;
 }
 
 FLASHMEM void TickHandler::setup()
@@ -122,6 +127,12 @@ FLASHMEM void TickHandler::attach(TickObserver* observer, uint32_t interval) {
     }
     timerEntry[timer].observer[observerIndex] = observer;
     Logger::debug("attached TickObserver (%X) as number %d to timer %d, %dus interval", observer, observerIndex, timer, interval);
+    if (simClock)
+    {
+        //no hardware timer in simulation. Just schedule the first firing in virtual time
+        if (timerEntry[timer].nextFire == 0) timerEntry[timer].nextFire = simClock->getTime() + interval;
+        return;
+    }
     //I might be dumb but using a line like:
     // timers[timer]->beginPeriodic([timer]() { timerTrampoline(timer); }, interval);
     // doesn't work. Instead the value passed by the lambda function ends up always being the last timer you made
@@ -178,6 +189,7 @@ FLASHMEM void TickHandler::detach(TickObserver* observer) {
         Logger::debug("Attempt to call TickHandler::detach with a null ptr!");
         return;
     }
+    supervisor.unwatch(observer); //something that stopped ticking on purpose isn't dead
     for (int timer = 0; timer < NUM_TIMERS; timer++) {
         for (int observerIndex = 0; observerIndex < CFG_TIMER_NUM_OBSERVERS; observerIndex++) {
             if (timerEntry[timer].observer[observerIndex] == observer) {
@@ -190,7 +202,8 @@ FLASHMEM void TickHandler::detach(TickObserver* observer) {
                 for (int p = 0; p < CFG_TIMER_NUM_OBSERVERS; p++) sum += (uint32_t)timerEntry[timer].observer[p];
                 if (sum != 0) continue; 
                 //didn't continue above? Then nobody is listening. Stop the timer.
-                timers[timer]->stop();
+                if (simClock) timerEntry[timer].nextFire = 0;
+                else timers[timer]->stop();
             }
         }
     }
@@ -248,7 +261,10 @@ int TickHandler::findObserver(int timer, TickObserver *observer) {
  */
 void TickHandler::process() {
     while (bufferHead != bufferTail) {
+        uint32_t startTime = sysClock->micros();
         tickBuffer[bufferTail]->handleTick();
+        checkBlocking(tickBuffer[bufferTail], startTime);
+        supervisor.checkIn(tickBuffer[bufferTail]);
         bufferTail = (bufferTail + 1) % CFG_TIMER_BUFFER_SIZE;
         //Logger::debug("process, bufferHead=%d bufferTail=%d", bufferHead, bufferTail);
     }
@@ -260,6 +276,158 @@ void TickHandler::cleanBuffer() {
 
 #endif //CFG_TIMER_USE_QUEUING
 
+/*
+ * Schedule a continuation to be resumed once the given number of microseconds have gone by.
+ * If the continuation is already pending it is just rescheduled. Returns false if there
+ * was no room to queue it which the caller has to deal with (probably by trying again next tick)
+ */
+bool TickHandler::resumeAfter(Continuation *cont, uint32_t delayMicros)
+{
+    int freeSlot = -1;
+    if (!cont) return false;
+    for (int i = 0; i < CFG_TIMER_NUM_CONTINUATIONS; i++)
+    {
+        if (pending[i].cont == cont)
+        {
+            freeSlot = i;
+            break;
+        }
+        if (!pending[i].cont && freeSlot == -1) freeSlot = i;
+    }
+    if (freeSlot == -1)
+    {
+        Logger::error("No free continuation slot for (%X)", cont);
+        return false;
+    }
+    pending[freeSlot].resumeTime = sysClock->micros() + delayMicros;
+    pending[freeSlot].cont = cont;
+    return true;
+}
+
+void TickHandler::cancel(Continuation *cont)
+{
+    for (int i = 0; i < CFG_TIMER_NUM_CONTINUATIONS; i++)
+    {
+        if (pending[i].cont == cont) pending[i].cont = nullptr;
+    }
+}
+
+/*
+ * Resume any continuations whose time has come. Must be called from loop(). The slot is
+ * freed before calling resume() so a continuation is free to schedule itself again.
+ */
+void TickHandler::runContinuations()
+{
+    for (int i = 0; i < CFG_TIMER_NUM_CONTINUATIONS; i++)
+    {
+        Continuation *cont = pending[i].cont;
+        if (!cont) continue;
+        uint32_t startTime = sysClock->micros();
+        if ((int32_t)(startTime - pending[i].resumeTime) < 0) continue; //not yet
+        pending[i].cont = nullptr;
+        cont->resume();
+        checkBlocking(cont, startTime);
+    }
+}
+
+/*
+ * Runtime blocking detector. Anything on the main loop that hogs the CPU for more than
+ * CFG_BLOCKING_THRESHOLD gets reported. Reports are limited to one per second
+ * so that something which blocks every time doesn't flood the log.
+ */
+void TickHandler::checkBlocking(void *who, uint32_t startTime)
+{
+    uint32_t now = sysClock->micros();
+    uint32_t elapsed = now - startTime;
+    if (elapsed < CFG_BLOCKING_THRESHOLD) return;
+    if ((now - lastBlockingReport) < 1000000ul && lastBlockingReport != 0) return;
+    lastBlockingReport = now;
+    Logger::warn("Blocking call detected: (%X) took %uus on the main loop", who, elapsed);
+}
+
+/*
+ * Switch over to virtual time. All hardware timers are stopped and from here on
+ * runSimulation() is what causes ticks to happen. Timers already attached keep
+ * their interval and get their first firing one interval from the current virtual time.
+ * This is a one way trip, there is no switching back to the hardware timers afterward.
+ */
+FLASHMEM void TickHandler::setSimulation(SimulatedClock *clock)
+{
+    if (!clock) return;
+    simClock = clock;
+    setSysClock(clock);
+    for (int i = 0; i < NUM_TIMERS; i++)
+    {
+        timers[i]->stop();
+        timerEntry[i].nextFire = 0;
+        if (timerEntry[i].interval == 0) continue;
+        for (int j = 0; j < CFG_TIMER_NUM_OBSERVERS; j++)
+        {
+            if (timerEntry[i].observer[j])
+            {
+                timerEntry[i].nextFire = clock->getTime() + timerEntry[i].interval;
+                break;
+            }
+        }
+    }
+}
+
+bool TickHandler::isSimulated()
+{
+    return (simClock != nullptr);
+}
+
+/*
+ * Run the system in virtual time for the given number of microseconds.
+ * Timers fire in deadline order exactly as if they were the hardware timers and
+ * the queued ticks are dispatched right after each firing. Anything the observers do
+ * that takes (virtual) time pushes the clock forward so a slow handler delays
+ * the following ticks just like it would on the real thing.
+ */
+void TickHandler::runSimulation(uint64_t duration)
+{
+    if (!simClock) return;
+    uint64_t endTime = simClock->getTime() + duration;
+
+    while (true)
+    {
+        uint64_t now = simClock->getTime();
+        int next = -1;
+        for (int i = 0; i < NUM_TIMERS; i++)
+        {
+            if (timerEntry[i].nextFire == 0) continue;
+            if (next == -1 || timerEntry[i].nextFire < timerEntry[next].nextFire) next = i;
+        }
+        uint64_t nextTime = (next == -1) ? endTime + 1 : timerEntry[next].nextFire;
+
+        //continuations keep 32 bit deadlines so convert them relative to the current virtual time
+        for (int i = 0; i < CFG_TIMER_NUM_CONTINUATIONS; i++)
+        {
+            if (!pending[i].cont) continue;
+            int32_t remaining = (int32_t)(pending[i].resumeTime - (uint32_t)now);
+            uint64_t contTime = (remaining > 0) ? now + remaining : now;
+            if (contTime < nextTime)
+            {
+                nextTime = contTime;
+                next = -2;
+            }
+        }
+        if (next == -1 || nextTime > endTime) break;
+
+        simClock->advanceTo(nextTime);
+        if (next >= 0)
+        {
+            timerEntry[next].nextFire += timerEntry[next].interval;
+            handleInterrupt(next);
+#ifdef CFG_TIMER_USE_QUEUING
+            process();
+#endif
+        }
+        runContinuations();
+    }
+    simClock->advanceTo(endTime);
+}
+
 /*
  * Handle the interrupt of any timer.
  * All the registered TickObservers of the timer are called.
@@ -273,11 +441,16 @@ void TickHandler::handleInterrupt(int timerNumber) {
             //Logger::debug("TN: %i bufferHead=%d, bufferTail=%d, observer=%x", timerNumber, bufferHead, bufferTail, timerEntry[timerNumber].observer[i]);
 #else
             timerEntry[timerNumber].observer[i]->handleTick();
+            supervisor.checkIn(timerEntry[timerNumber].observer[i]);
 #endif //CFG_TIMER_USE_QUEUING
         }
     }
 }
 
+void Continuation::resume() {
+    Logger::error("Continuation does not implement resume()");
+}
+
 /*
  * Default implementation of the TickObserver method. Must be overwritten
  * by every sub-class.
@@ -33,6 +33,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "config.h"
 #include <TeensyTimerTool.h>
 #include "Logger.h"
+#include "SysClock.h"
 
 using namespace TeensyTimerTool;
 
@@ -45,6 +46,14 @@ public:
     virtual void handleTick();
 };
 
+//A one shot callback. Used to break up sequences that would otherwise need delay().
+//Do one step, ask tickHandler to resume you some time later, return. resume() is always
+//called from loop() context, never from an interrupt.
+class Continuation {
+public:
+    virtual void resume();
+};
+
 
 class TickHandler {
 public:
@@ -57,6 +66,12 @@ public:
     void cleanBuffer();
     void process();
 #endif
+    bool resumeAfter(Continuation *cont, uint32_t delayMicros);
+    void cancel(Continuation *cont);
+    void runContinuations();
+    void setSimulation(SimulatedClock *clock);
+    bool isSimulated();
+    void runSimulation(uint64_t duration);
 
 protected:
 
@@ -65,18 +80,28 @@ private:
         long interval; // interval of timer in microseconds
         uint64_t maxInterval; //maximum achieveable interval for this timer (in microseconds)
         TickObserver *observer[CFG_TIMER_NUM_OBSERVERS]; // array of pointers to observers with this interval
+        uint64_t nextFire; //only used in simulation - virtual time (us) at which this timer fires next
     };
     TimerEntry timerEntry[NUM_TIMERS]; // array of timer entries
 #ifdef CFG_TIMER_USE_QUEUING
     TickObserver *tickBuffer[CFG_TIMER_BUFFER_SIZE];
     volatile uint16_t bufferHead, bufferTail;
 #endif
+    struct PendingContinuation {
+        Continuation *cont;
+        uint32_t resumeTime; //sysClock micros at which to resume
+    };
+    PendingContinuation pending[CFG_TIMER_NUM_CONTINUATIONS];
+    uint32_t lastBlockingReport;
+
+    void checkBlocking(void *who, uint32_t startTime);
     
     int findTimer(long interval);
     int findFreeTimer(uint64_t interval);
     int findObserver(int timerNumber, TickObserver *observer);
 
     PeriodicTimer* timers[NUM_TIMERS];
+    SimulatedClock *simClock; //non-null when running in virtual time instead of off the hardware timers
 };
 
 extern TickHandler tickHandler;
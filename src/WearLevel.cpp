@@ -0,0 +1,131 @@
+/*
+ * WearLevel.cpp
+ *
+ Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+
+#include "WearLevel.h"
+#include "MemCache.h"
+#include "eeprom_layout.h"
+#include "Logger.h"
+
+extern MemCache *memCache;
+
+WearLevel::WearLevel()
+{
+    memset(&current, 0, sizeof(current));
+    pending = false;
+}
+
+/*
+ * Find the newest valid record in the ring. Only the records themselves are read (not whole pages)
+ * so this doesn't fill the cache with 64 pages nobody needs. Must be called after MemCache is set up
+ * and before anything asks for a value.
+ */
+FLASHMEM void WearLevel::setup()
+{
+    WearRecord rec;
+    bool found = false;
+
+    for (int page = 0; page < WEAR_NUM_PAGES; page++)
+    {
+        if (!memCache->ReadDirect(EE_WEAR_LEVEL + page * 256, &rec, sizeof(rec))) continue;
+        if (rec.sequence == 0xFFFFFFFF) continue;
+        if (rec.checksum != calcChecksum(&rec)) continue; //torn write or never initialized. Skip it
+        if (!found || (int32_t)(rec.sequence - current.sequence) > 0)
+        {
+            current = rec;
+            found = true;
+        }
+    }
+
+    if (found) Logger::info("Wear leveled storage at sequence %u", current.sequence);
+    else
+    {
+        Logger::info("No wear leveled records found. Starting fresh.");
+        memset(&current, 0, sizeof(current));
+        current.sequence = 0xFFFFFFFF; //so the first commit ends up as sequence 0
+    }
+    pending = false;
+    tickHandler.resumeAfter(this, WEAR_COMMIT_INTERVAL * 1000ul);
+}
+
+//Commit any changes on a schedule. The interval sets how often each page gets written:
+//WEAR_COMMIT_INTERVAL * WEAR_NUM_PAGES between writes to any one page.
+void WearLevel::resume()
+{
+    if (pending) commit();
+    tickHandler.resumeAfter(this, WEAR_COMMIT_INTERVAL * 1000ul);
+}
+
+//For a controlled power down. Nothing gets written if no value changed since the last commit
+void WearLevel::commitPending()
+{
+    if (pending) commit();
+}
+
+//returns false if this value has never been saved
+bool WearLevel::get(WearValue which, uint32_t *value)
+{
+    if (!(current.validMask & (1ul << which))) return false;
+    *value = current.values[which];
+    return true;
+}
+
+//Only changes RAM. It'll get to EEPROM on the next commit
+void WearLevel::set(WearValue which, uint32_t value)
+{
+    if ((current.validMask & (1ul << which)) && current.values[which] == value) return;
+    current.values[which] = value;
+    current.validMask |= (1ul << which);
+    pending = true;
+}
+
+//Write the current values out as a new record in the next page of the ring. Call directly to save
+//right now (a setting that was changed on purpose for instance), otherwise it happens on its own.
+void WearLevel::commit()
+{
+    current.sequence++;
+    current.checksum = calcChecksum(&current);
+    uint32_t address = recordAddress(current.sequence);
+    memCache->Write(address, &current, sizeof(current));
+    memCache->AgeFullyAddress(address); //one write per page per trip around the ring so no reason to hold it back
+    pending = false;
+}
+
+uint32_t WearLevel::calcChecksum(WearRecord *rec)
+{
+    //simple but it catches erased and half written records which is all that is needed here
+    uint32_t sum = 0x5AA5F00F;
+    uint32_t *words = (uint32_t *)rec;
+    for (uint32_t i = 0; i < (sizeof(WearRecord) / 4) - 1; i++) sum = (sum << 5) + (sum >> 27) + words[i];
+    return sum;
+}
+
+uint32_t WearLevel::recordAddress(uint32_t sequence)
+{
+    return EE_WEAR_LEVEL + (sequence % WEAR_NUM_PAGES) * 256;
+}
+
+WearLevel wearLevel;
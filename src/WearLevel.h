@@ -0,0 +1,79 @@
+/*
+ * WearLevel.h
+ *
+ * Storage for the handful of values that change all the time (total run time, odometer). Saving those in
+ * place means the same EEPROM page gets written over and over for the life of the car. Instead, every save
+ * goes into the next page of a ring in its own region of EEPROM so each page only sees one write per trip
+ * around the ring. At boot the ring is scanned and the record with the highest sequence number wins.
+ *
+Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef WEAR_LEVEL_H_
+#define WEAR_LEVEL_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "TickHandler.h"
+
+//Which value in a record is which. Add new ones before WL_NUM_VALUES. Existing records stay valid as
+//long as the order of the ones already here doesn't change.
+enum WearValue
+{
+    WL_RUNTIME, //tenths of a second the system has been on, ever. Owned by FaultHandler
+    WL_ODOMETER, //hundredths of a mile. Owned by the motor controller
+    WL_CHANGELOG, //sequence number of the newest settings change log record. Owned by ChangeLog
+    WL_NUM_VALUES
+};
+
+#define WEAR_MAX_VALUES     6
+
+typedef struct
+{
+    uint32_t sequence; //0xFFFFFFFF means this slot has never been written (erased EEPROM)
+    uint32_t validMask; //bit N set if values[N] has ever been set
+    uint32_t values[WEAR_MAX_VALUES];
+    uint32_t checksum;
+} WearRecord;
+
+class WearLevel : public Continuation {
+public:
+    WearLevel();
+    void setup();
+    void resume();
+    bool get(WearValue which, uint32_t *value);
+    void set(WearValue which, uint32_t value);
+    void commit();
+    void commitPending();
+
+private:
+    uint32_t calcChecksum(WearRecord *rec);
+    uint32_t recordAddress(uint32_t sequence);
+
+    WearRecord current;
+    bool pending; //something changed since the last commit
+};
+
+extern WearLevel wearLevel;
+
+#endif /* WEAR_LEVEL_H_ */
@@ -40,12 +40,21 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //date and time is more accurate but an attempt is made to update this number too.
 #define CFG_BUILD_NUM	1086
 
+#ifdef __IMXRT1062__
 #define portMEMORY_BARRIER()     __asm volatile ( "dmb" ::: "memory" )
 #define portDATA_SYNC_BARRIER()  __asm volatile ( "dsb" ::: "memory" )
 #define portINSTR_SYNC_BARRIER() __asm volatile ( "isb" )
 #define CPU_RESTART_ADDR	((uint32_t *)0xE000ED0C)
 #define CPU_RESTART_VAL		(0x5FA0004)
 #define REBOOT			(*CPU_RESTART_ADDR = CPU_RESTART_VAL)
+#else
+//native (host) test builds. Compiler barriers only and there is no chip to restart
+#define portMEMORY_BARRIER()     __asm volatile ( "" ::: "memory" )
+#define portDATA_SYNC_BARRIER()  __asm volatile ( "" ::: "memory" )
+#define portINSTR_SYNC_BARRIER() __asm volatile ( "" ::: "memory" )
+#define REBOOT			exit(0)
+#endif
+#define IN_INTERRUPT()  ((SCB_ICSR & 0x1FF) != 0) //VECTACTIVE is non-zero whenever an exception handler is running
 
 
 /*
@@ -67,11 +76,39 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define CFG_DEV_MGR_MAX_DEVICES     60 // the maximum number of devices supported by the DeviceManager
 #define CFG_CAN_NUM_OBSERVERS	    32 // maximum number of device subscriptions per CAN bus
 #define CFG_STATUS_NUM_OBSERVERS    4 //How many devices can register to get StatusEntry updates. Use sparingly!
+#define CFG_PREF_MAX_MIGRATIONS     16 // settings schema migrations all devices together can register
 #define CFG_TIMER_NUM_OBSERVERS	    16 // the maximum number of supported observers per timer
 #define CFG_TIMER_USE_QUEUING	    // if defined, TickHandler uses a queuing buffer instead of direct calls from interrupts - MUCH safer!
 #define CFG_TIMER_BUFFER_SIZE	    100 // the size of the queuing buffer for TickHandler
+#define CFG_TIMER_NUM_CONTINUATIONS 16 // how many one shot continuations can be pending in TickHandler at once
+#define CFG_BLOCKING_THRESHOLD      1000 // any tick handler or continuation taking longer than this (in microseconds) gets reported
+
+/*
+ * CONTROL LANE
+ *
+ * Throttle sampling, torque arbitration and slewing run from their own high priority timer interrupt
+ * at this rate instead of from the main loop. Comment out CFG_CONTROL_LANE_HZ to go back to doing
+ * all of that in the normal tick handlers.
+ */
+#define CFG_CONTROL_LANE_HZ         1000
+#define CFG_CONTROL_LANE_BUDGET     200 // microseconds. Cycles that take longer than this are counted as overruns
+#define CFG_CONTROL_LANE_PRIORITY   16 // NVIC priority of the lane timer. Lower number is higher priority. most other interrupts default to 128
 #define CFG_FAULT_HISTORY_SIZE	    50 //number of faults to store in eeprom. A circular buffer so the last 50 faults are always stored.
 
+/*
+ * SUPERVISOR
+ *
+ * The hardware watchdog only gets fed while every registered task keeps checking in. A task gets
+ * CFG_SUPERVISOR_MISSED_TICKS of its own intervals before it counts as dead. The stall monitor
+ * resets the board if loop() stops running for longer than CFG_LOOP_STALL_TIMEOUT.
+ */
+#define CFG_SUPERVISOR_MAX_TASKS        16
+#define CFG_SUPERVISOR_MISSED_TICKS     10
+#define CFG_SUPERVISOR_SCAN_INTERVAL    10 // milliseconds between checks of the registered tasks
+#define CFG_SUPERVISOR_STALL_CHECK      10000 // microseconds between runs of the stall monitor
+#define CFG_SUPERVISOR_PRIORITY         8 // NVIC priority of the stall monitor. Must be higher (lower number) than the control lane
+#define CFG_LOOP_STALL_TIMEOUT          100 // milliseconds
+
 /*
  * PIN ASSIGNMENT
  */
@@ -51,6 +51,7 @@ Device::Device() {
     deviceManager.addDevice(this);
     commonName = "Generic Device";
     shortName = "GENDEV";
+    schemaVersion = 0;
 }
 
 //Empty functions to handle these callbacks if the derived classes don't
@@ -61,7 +62,12 @@ void Device::setup()
 
 void Device::earlyInit()
 {
-    if (!prefsHandler) prefsHandler = new PrefHandler(deviceId);
+    if (!prefsHandler)
+    {
+        prefsHandler = new PrefHandler(deviceId);
+        prefsHandler->migrateSchema(schemaVersion); //before anything reads settings in the old layout
+        if (!prefsHandler->isEnabled()) prefsHandler->releaseIndex(); //migrating may have loaded them
+    }
 }
 
 //when called this will unregister the device so it quits getting updates
@@ -92,6 +98,10 @@ const char* Device::getShortName() {
     return shortName;
 }
 
+PrefHandler* Device::getPrefHandler() {
+    return prefsHandler;
+}
+
 void Device::handleTick() {
 }
 
@@ -119,6 +129,7 @@ void Device::handleMessage(uint32_t msgType, const void* message) {
         break;
     case MSG_SETUP:
         this->setup();
+        if (prefsHandler) prefsHandler->setupStatusEntries(this);
         //send enable message to the device in case it wants to do anything fancy
         deviceManager.sendMessage(DEVICE_ANY, this->getId(), MSG_ENABLE, NULL);
         break;
@@ -181,5 +192,10 @@ DeviceType Device::getType()
     return deviceType;
 }
 
+uint16_t Device::getSchemaVersion()
+{
+    return schemaVersion;
+}
+
 
 
@@ -81,9 +81,11 @@ public:
     bool isEnabled();
     DeviceId getId();
     DeviceType getType();
+    uint16_t getSchemaVersion();
     virtual uint32_t getTickInterval();
     const char* getCommonName();
     const char* getShortName();
+    PrefHandler *getPrefHandler();
     void forceEnableState(bool state);
 
     virtual void loadConfiguration();
@@ -101,6 +103,7 @@ protected:
     const char *shortName;
     DeviceId deviceId;
     DeviceType deviceType;
+    uint16_t schemaVersion; //bump when the stored settings change shape and register a migration with PrefHandler
     std::vector<ConfigEntry> cfgEntries;
 
 private:
@@ -30,6 +30,7 @@
 #include "CanHandler.h"
 #include "RingBuf.h"
 #include "devices/esp32/ESP32Driver.h"
+#include "Supervisor.h"
 
 extern bool sdCardWorking;
 #define RING_BUF_CAPACITY 16 * 1024
@@ -144,14 +145,17 @@ void StatusCSV::flushFile()
     size_t n = csvRingBuf.bytesUsed();
     int ret = 0;
     int writeBytes = min(n, 512u);
+    supervisor.beginLongOperation(); //an SD card can sit on a write for well over the loop stall timeout
     ret = csvRingBuf.writeOut(writeBytes);
     if (writeBytes != ret) {
         Serial.printf("Writeout failed. Want to write %u bytes but wrote %u\n", writeBytes, ret);
         logFile.close();
+        supervisor.endLongOperation();
         fileInitialized = false;
         return;
     }
     else logFile.flush(); //make sure it is updated on disk
+    supervisor.endLongOperation();
 }
 
 //This method handles periodic tick calls received from the tasker.
@@ -4,6 +4,8 @@
 #include "../../SerialConsole.h"
 #include "devices/display/StatusCSV.h"
 #include "FlasherX.h"
+#include "ChangeLog.h"
+#include "Supervisor.h"
 
 extern SerialConsole *serialConsole;
 
@@ -115,6 +117,7 @@ ESP32Driver::ESP32Driver() : Device()
     deviceType = DEVICE_MISC;
     currState = ESP32NS::RESET;
     desiredState = ESP32NS::RESET;
+    resetStep = 0;
     systemAlive = false;
     systemEnabled = false;
     didInitialStatus = false;
@@ -213,9 +216,30 @@ void ESP32Driver::setup()
     lastTime = millis();
 }
 
+//steps through the reset sequence started in handleTick
+void ESP32Driver::resume()
+{
+    switch (resetStep)
+    {
+    case 1:
+        digitalWrite(ESP32_ENABLE, HIGH);
+        resetStep = 2;
+        //seems we have to wait this long on the B hardware otherwise it won't stick
+        //no continuation slot means no way back here. Start the whole pulse over on the next tick instead
+        if (!tickHandler.resumeAfter(this, (sysConfig->systemType == GEVCU7B) ? 400000 : 40000)) resetStep = 0;
+        break;
+    case 2:
+        resetStep = 0;
+        currState = ESP32NS::NORMAL;
+        break;
+    }
+}
+
 void ESP32Driver::disableDevice()
 {
     Device::disableDevice(); //do the common stuff first
+    tickHandler.cancel(this);
+    resetStep = 0;
     deviceManager.removeStatusObserver(this);
     digitalWrite(ESP32_ENABLE, LOW); //put the esp32 into reset
     digitalWrite(ESP32_BOOT, HIGH); //use normal mode
@@ -231,16 +255,14 @@ void ESP32Driver::handleTick() {
 
     if (currState == ESP32NS::RESET)
     {
-        if (desiredState == ESP32NS::NORMAL)
+        if (desiredState == ESP32NS::NORMAL && resetStep == 0)
         {
-            //TODO: this is naughty code! No delays allowed! Refactor this to remove the delays (use state machine?)
+            //the rest of the reset pulse happens in resume() so we don't sit here in delay()
             digitalWrite(ESP32_BOOT, HIGH); //boot high = boot into normal mode
             digitalWrite(ESP32_ENABLE, LOW); //low means reset. High means run. So, we pulse low then high to reset the esp32
-            delay(40);
-            digitalWrite(ESP32_ENABLE, HIGH);
-            if (sysConfig->systemType == GEVCU7B) delay(400); //seems we have to wait this long otherwise it won't stick
-            else delay(40);
-            currState = ESP32NS::NORMAL;
+            resetStep = 1;
+            //if there's no continuation slot free the ESP32 just stays in reset and the next tick tries again
+            if (!tickHandler.resumeAfter(this, 40000)) resetStep = 0;
         }
     }
 
@@ -364,6 +386,8 @@ void ESP32Driver::processSerial()
 
                 if (bufferedLine[0] == '{')
                 {
+                    //a device list or a config reply (which saves the device's settings) takes a good while
+                    supervisor.beginLongOperation();
                     StaticJsonDocument<1300>doc;
                     DeserializationError err = deserializeJson(doc, bufferedLine.c_str());
                     if (err)
@@ -389,16 +413,19 @@ void ESP32Driver::processSerial()
                             processConfigReply(&doc);
                         }
                     }
+                    supervisor.endLongOperation();
                 }
                 
                 if (bufferedLine[0] == '~')
                 {
                     //send the whole thing (minus the ~) as input to the normal serial console
+                    changeLog.setSource(CHANGE_ESP32);
                     for (unsigned int l = 1; l < bufferedLine.length(); l++)
                     {
                         serialConsole->injectChar(bufferedLine[l]);
                     }
                     serialConsole->injectChar('\n');
+                    changeLog.setSource(CHANGE_DEVICE);
                 }
                 if (bufferedLine[0] == '`')
                 {
@@ -30,10 +30,11 @@ public:
     int espUpdateType;
 };
 
-class ESP32Driver : public Device
+class ESP32Driver : public Device, public Continuation
 {
 public:
     virtual void handleTick();
+    virtual void resume();
     virtual void handleMessage(uint32_t msgType, const void* message);
     virtual void setup();
     void disableDevice();
@@ -59,6 +60,7 @@ private:
     String bufferedLine;
     ESP32NS::ESP32_STATE currState;
     ESP32NS::ESP32_STATE desiredState;
+    uint8_t resetStep; //where we are in the reset pulse sequence. 0 = not resetting
     bool systemAlive;
     bool systemEnabled;
     bool inhibitJSON;
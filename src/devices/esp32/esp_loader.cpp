@@ -23,10 +23,7 @@
 #include <assert.h>
 #include "../../Logger.h"
 #include "gevcu_port.h"
-#include <Watchdog_t4.h>
-
-extern WDT_T4<WDT3> wdt;
-
+#include "../../Supervisor.h"
 
 #ifndef MAX
 #define MAX(a, b) ((a) > (b)) ? (a) : (b)
@@ -88,7 +85,7 @@ FLASHMEM esp_loader_error_t flash_esp32_binary(FsFile *file, size_t address)
 
     size_t size = file->fileSize();
 
-    wdt.feed();
+    supervisor.pet();
 
     Logger::info("Erasing flash (this may take a while)...");
     err = esp_loader_flash_start(address, size, sizeof(payload));
@@ -97,7 +94,7 @@ FLASHMEM esp_loader_error_t flash_esp32_binary(FsFile *file, size_t address)
         return err;
     }
 
-    wdt.feed();
+    supervisor.pet();
 
     Logger::info("Start programming %u bytes", size);
 
@@ -121,7 +118,7 @@ FLASHMEM esp_loader_error_t flash_esp32_binary(FsFile *file, size_t address)
         //bin_addr += to_read;
         written += to_read;
 
-        wdt.feed();
+        supervisor.pet();
         Logger::loop();
 
         int progress = (int)(((float)written / binary_size) * 100);
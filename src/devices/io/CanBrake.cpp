@@ -25,6 +25,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "CanBrake.h"
+#include "../../Supervisor.h"
 
 CanBrake::CanBrake() : Throttle() {
     rawSignal.input1 = 0;
@@ -89,6 +90,7 @@ void CanBrake::setup() {
 
     attachedCANBus->attach(this, responseId, responseMask, responseExtended);
     tickHandler.attach(this, CFG_TICK_INTERVAL_CAN_THROTTLE);
+    supervisor.watch(this, getId(), CFG_TICK_INTERVAL_CAN_THROTTLE);
 }
 
 /*
@@ -25,6 +25,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "CanThrottle.h"
+#include "../../Supervisor.h"
 
 CanThrottle::CanThrottle() : Throttle() {
     rawSignal.input1 = 0;
@@ -90,6 +91,7 @@ void CanThrottle::setup() {
 
     attachedCANBus->attach(this, responseId, responseMask, responseExtended);
     tickHandler.attach(this, CFG_TICK_INTERVAL_CAN_THROTTLE);
+    supervisor.watch(this, getId(), CFG_TICK_INTERVAL_CAN_THROTTLE);
 }
 
 /*
@@ -25,6 +25,7 @@
  */
 
 #include "PotBrake.h"
+#include "../../Supervisor.h"
 
 /*
  * Constructor
@@ -69,6 +70,7 @@ void PotBrake::setup() {
     //pinMode(THROTTLE_INPUT_BRAKELIGHT, INPUT_PULLUP); //Brake light switch
 
     tickHandler.attach(this, CFG_TICK_INTERVAL_POT_THROTTLE);
+    supervisor.watch(this, getId(), CFG_TICK_INTERVAL_POT_THROTTLE);
 }
 
 /*
@@ -25,6 +25,7 @@
  */
 
 #include "PotThrottle.h"
+#include "../../Supervisor.h"
 
 /*
  * Constructor
@@ -70,6 +71,7 @@ void PotThrottle::setup() {
     //pinMode(THROTTLE_INPUT_BRAKELIGHT, INPUT_PULLUP); //Brake light switch
 
     tickHandler.attach(this, CFG_TICK_INTERVAL_POT_THROTTLE);
+    supervisor.watch(this, getId(), CFG_TICK_INTERVAL_POT_THROTTLE);
 }
 
 /*
@@ -27,6 +27,7 @@
 
 #include "Throttle.h"
 #include "../../DeviceManager.h"
+#include "../../ControlLane.h"
 
 const char* THROTTLE_FAULT_DESCS[] =
 {
@@ -48,6 +49,7 @@ Throttle::Throttle() : Device() {
     rawThrottle = 0;
     status = OK;
     sma_idx = 0;
+    smoothTime = 0;
     deviceType = DEVICE_THROTTLE;
     bAboveCutoff = 0;
 }
@@ -101,14 +103,21 @@ void Throttle::setup()
 
 
 /*
- * Controls the main flow of throttle data acquisiton, validation and mapping to
- * user defined behaviour.
- *
  * Get's called by the sub-class which is triggered by the tick handler
+ * If the control lane is running it does the sampling (much more often) and we stay out of the way.
  */
 void Throttle::handleTick() {
     Device::handleTick();
 
+    if (!controlLane.isRunning()) sample(THROTTLE_SMOOTH_INTERVAL);
+}
+
+/*
+ * Controls the main flow of throttle data acquisiton, validation and mapping to
+ * user defined behaviour. interval is the number of microseconds since the last call.
+ * This can be called from the control lane interrupt so it must not block.
+ */
+void Throttle::sample(uint32_t interval) {
     RawSignalData *rawSignals = acquireRawSignal(); // get raw data from the throttle device
 
     ThrottleConfiguration *config = (ThrottleConfiguration *) getConfiguration();
@@ -132,12 +141,19 @@ void Throttle::handleTick() {
                 {
                     for (int j = 0; j < config->smartSmooth; j++) sma_buffer[j] = config->smoothStop; //reset the buffer to the new value
                     sma_idx = 0;
+                    smoothTime = THROTTLE_SMOOTH_INTERVAL; //take the first sample right away
                 }
             }
-            //store the new reading in our sma buffer
-            sma_buffer[sma_idx] = rawThrottle;
-            sma_idx = (sma_idx + 1);
-            if (sma_idx >= config->smartSmooth) sma_idx = 0;
+            //store the new reading in our sma buffer. Only do so at the original tick rate
+            //so the smoothing time constant doesn't depend on how fast we're being sampled
+            smoothTime += interval;
+            if (smoothTime >= THROTTLE_SMOOTH_INTERVAL)
+            {
+                smoothTime = 0;
+                sma_buffer[sma_idx] = rawThrottle;
+                sma_idx = (sma_idx + 1);
+                if (sma_idx >= config->smartSmooth) sma_idx = 0;
+            }
 
             int32_t accum = 0;
             for (int i = 0; i < config->smartSmooth; i++) accum += sma_buffer[i];
@@ -57,6 +57,7 @@ extern const char* THROTTLE_FAULT_DESCS[];
 #define CFG_CANTHROTTLE_MAX_NUM_LOST_MSG            3 // maximum number of lost messages allowed
 #define CFG_THROTTLE_TOLERANCE  150 //the max that things can go over or under the min/max without fault - 1/10% each #
 #define ThrottleMaxErrValue		150		//tenths of percentage allowable deviation between pedals
+#define THROTTLE_SMOOTH_INTERVAL    40000   //smart smoothing takes one sample per this many microseconds no matter how often we're sampled
 
 /*
  * Data structure to hold raw signal(s) of the throttle.
@@ -107,6 +108,7 @@ public:
     Throttle();
     virtual int16_t getLevel();
     void handleTick();
+    void sample(uint32_t interval);
     virtual ThrottleStatus getStatus();
     virtual bool isFaulted();
     virtual void setup();
@@ -131,6 +133,7 @@ private:
     RawSignalData lastVal;
     int16_t sma_buffer[256];
     size_t sma_idx;
+    uint32_t smoothTime;
     uint8_t bAboveCutoff;
 };
 
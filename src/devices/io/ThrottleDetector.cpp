@@ -91,7 +91,7 @@ void ThrottleDetector::detect() {
     }
 
     // we wait for 2 seconds so kick this off
-    startTime = millis();
+    startTime = sysClock->millis();
     state = DetectMinWait;
 
     tickHandler.attach(this, CFG_TICK_INTERVAL_POT_THROTTLE);
@@ -101,9 +101,9 @@ void ThrottleDetector::detect() {
  * Step 2. Wait for 2 seconds then start taking MIN readings
  */
 void ThrottleDetector::detectMinWait() {
-    if ((millis() - startTime) >= 2000) {
+    if ((sysClock->millis() - startTime) >= 2000) {
         // take MIN readings for 2 seconds
-        startTime = millis();
+        startTime = sysClock->millis();
         readThrottleValues();
         state = DetectMinCalibrate;
     }
@@ -113,7 +113,7 @@ void ThrottleDetector::detectMinWait() {
  * Step 3. Take MIN readings for 2 seconds then start waiting again
  */
 void ThrottleDetector::detectMinCalibrate() {
-    if ((millis() - startTime) < 2000 || sampleCount < maxSamples / 3) {
+    if ((sysClock->millis() - startTime) < 2000 || sampleCount < maxSamples / 3) {
         readThrottleValues();
     } else {
         displayCalibratedValues(true);
@@ -128,7 +128,7 @@ void ThrottleDetector::detectMinCalibrate() {
         Logger::console("and hold the pedal until complete");
 
         // wait for 5 seconds so they can react and then still get some readings
-        startTime = millis();
+        startTime = sysClock->millis();
         state = DetectMaxWait;
     }
 }
@@ -137,11 +137,11 @@ void ThrottleDetector::detectMinCalibrate() {
  * Step 4. Wait for 5 seconds then start taking MAX readings
  */
 void ThrottleDetector::detectMaxWait() {
-    if ((millis() - startTime) >= 5000 || sampleCount >= maxSamples * 2 / 3) {
+    if ((sysClock->millis() - startTime) >= 5000 || sampleCount >= maxSamples * 2 / 3) {
 
         // take MAX readings for 2 seconds
         resetValues();
-        startTime = millis();
+        startTime = sysClock->millis();
         readThrottleValues();
         state = DetectMaxCalibrate;
     } else {
@@ -153,7 +153,7 @@ void ThrottleDetector::detectMaxWait() {
  * Step 5. Take MAX readings for 3 seconds then show results
  */
 void ThrottleDetector::detectMaxCalibrate() {
-    if ((millis() - startTime) < 2000 && sampleCount < maxSamples) {
+    if ((sysClock->millis() - startTime) < 2000 && sampleCount < maxSamples) {
         readThrottleValues();
     } else {
         displayCalibratedValues(false);
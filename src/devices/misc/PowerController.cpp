@@ -24,6 +24,7 @@
  */
 
 #include "PowerController.h"
+#include "../../WearLevel.h"
 
 /*
  * Constructor
@@ -97,6 +98,7 @@ void PowerController::handleTick() {
         countdown--;
         if ((countdown == 0) && (config->powerOutputPin != 255) )
         {
+            wearLevel.commitPending(); //run time and odometer only go to the cache once a minute otherwise
             memCache->FlushAllPages(); //write out everything pending. This routine blocks until it happens
             systemIO.setDigitalOutput(config->powerOutputPin, false); //and turn off power to everything if pin is set
         }
@@ -109,7 +109,7 @@ void Precharger::handleTick() {
         }
 
         //need to set up to enter in progress
-        prechargeBeginTime = millis();
+        prechargeBeginTime = sysClock->millis();
 
         if (config->prechargeRelay != 255) 
         {
@@ -128,7 +128,7 @@ void Precharger::handleTick() {
         //check on status, maybe fault, maybe set complete
         if (config->prechargeType == PT_TIME_DELAY)
         {
-            if ( (millis() - prechargeBeginTime) >= config->prechargeTime) //done!
+            if ( (sysClock->millis() - prechargeBeginTime) >= config->prechargeTime) //done!
             {
                 state = PRECHARGE_COMPLETE;
                 if (config->mainRelay != 255) 
@@ -26,6 +26,8 @@
 
 #include "SystemDevice.h"
 #include "SD.h"
+#include "../../LoopProfiler.h"
+#include "../../Scrubber.h"
 
 #define CFG_TICK_SYSTEM 40000
 
@@ -87,6 +89,10 @@ void SystemDevice::setup() {
     entry = {"SWCANMODE", "Set whether CAN0 is in SingleWire mode (only with hardware mods)", &config->swcanMode, CFG_ENTRY_VAR_TYPE::BYTE, 0, 1, 0, nullptr, nullptr};
     cfgEntries.push_back(entry);
 
+    loopProfiler.setupStatusEntries(this);
+    memCache->setupStatusEntries(this);
+    scrubber.setupStatusEntries(this);
+
     tickHandler.attach(this, CFG_TICK_SYSTEM);
 }
 
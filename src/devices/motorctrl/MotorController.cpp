@@ -27,6 +27,9 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "MotorController.h"
+#include "../../ControlLane.h"
+#include "../../Supervisor.h"
+#include "../../WearLevel.h"
 
 const char* MCTRL_FAULT_DESCS[] =
 {
@@ -80,7 +83,6 @@ MotorController::MotorController() : Device() {
     testenableinput = 0;
     testreverseinput = 0;
     odoReadingAtLastSave = 0;
-    lastOdoSave = 0;
     lastOdoAccum = 0;
     odo_accum = 0;
     slewedTorque = 0.0;
@@ -166,6 +168,9 @@ FLASHMEM void MotorController::setup() {
     deviceManager.addStatusEntry(stat);
     stat = {"MC_SysTemp", &temperatureSystem, CFG_ENTRY_VAR_TYPE::FLOAT, 0, this};
     deviceManager.addStatusEntry(stat);
+
+    //the drivers all attach at getTickInterval() right after this so hold them to that
+    supervisor.watch(this, getId(), getTickInterval());
     
     Device::setup();
 }
@@ -185,7 +190,7 @@ void MotorController::handleTick() {
     //do odometer calculations
     if (lastOdoAccum == 0)
     {
-        lastOdoAccum = micros();
+        lastOdoAccum = sysClock->micros();
     }
     else
     {
@@ -194,7 +199,7 @@ void MotorController::handleTick() {
         //the time since last tick is (micros() - lastAccum) / a million in seconds. 1 second is 
         //1 / 3600th of an hour
         //so, take MPH and multiply by (interval in microseconds / 3.6 billion)
-        uint32_t timestamp = micros();
+        uint32_t timestamp = sysClock->micros();
         uint32_t interval = timestamp - lastOdoAccum;
         lastOdoAccum = timestamp;
 
@@ -214,30 +219,24 @@ void MotorController::handleTick() {
         }
     }
 
-    //now, save the odometer reading every so often if it has changed
-    if (config->odometer > odoReadingAtLastSave)
+    //hand the odometer to wear leveled storage whenever it changes. It gets committed once a minute
+    //into a different page each time instead of rewriting (and force flushing) our settings page.
+    if (config->odometer != odoReadingAtLastSave)
     {
-        if ((millis() - lastOdoSave) >= 60000) //save every minute 
-        {
-            lastOdoSave = millis();
-            prefsHandler->write("odometer", config->odometer);
-            prefsHandler->forceCacheWrite();
-            odoReadingAtLastSave = config->odometer;
-        }
+        wearLevel.set(WL_ODOMETER, config->odometer);
+        odoReadingAtLastSave = config->odometer;
     }
 
-    //Throttle check
-    Throttle *accelerator = deviceManager.getAccelerator();
-    Throttle *brake = deviceManager.getBrake();
-    if (accelerator)
-        throttleRequested = accelerator->getLevel();
-    if (brake && brake->getLevel() < -10 && brake->getLevel() < accelerator->getLevel()) //if the brake has been pressed it overrides the accelerator.
-        throttleRequested = brake->getLevel();
+    //Throttle check. The control lane takes care of this itself when it's running
+    if (!controlLane.isRunning())
+    {
+        Throttle *accelerator = deviceManager.getAccelerator();
+        Throttle *brake = deviceManager.getBrake();
+        ChargeController *charger = static_cast<ChargeController *>(deviceManager.getDeviceByType(DeviceType::DEVICE_CHARGER));
+        arbitrateThrottle(accelerator, brake, charger);
+    }
     //Logger::debug("Throttle: %d", throttleRequested);
 
-    ChargeController *charger = static_cast<ChargeController *>(deviceManager.getDeviceByType(DeviceType::DEVICE_CHARGER));
-    if (charger && charger->getEVSEConnected()) throttleRequested = 0; //NO DRIVING AWAY!
-
     if (skipcounter++ > 30)    //A very low priority loop for checks that only need to be done once per second.
     {
         skipcounter = 0; //Reset our laptimer
@@ -246,7 +245,30 @@ void MotorController::handleTick() {
     }
 }
 
+//Decide what throttle level is being asked for from the accelerator and brake
+//Called from the control lane interrupt when that is running so no logging in here.
+void MotorController::arbitrateThrottle(Throttle *accelerator, Throttle *brake, ChargeController *charger)
+{
+    if (accelerator)
+        throttleRequested = accelerator->getLevel();
+    if (accelerator && brake && brake->getLevel() < -10 && brake->getLevel() < accelerator->getLevel()) //if the brake has been pressed it overrides the accelerator.
+        throttleRequested = brake->getLevel();
+
+    if (charger && charger->getEVSEConnected()) throttleRequested = 0; //NO DRIVING AWAY!
+}
+
+//If the control lane is running then slewedTorque is kept up to date by it every cycle. Otherwise
+//step it here using the tick interval of this controller like it always has been.
 float MotorController::getSlewedTorque()
+{
+    if (controlLane.isRunning()) return slewedTorque;
+    slewTorque(getTickInterval());
+    Logger::debug("torqueTarget %f  slewedTorque %f", torqueRequested, slewedTorque);
+    return slewedTorque;
+}
+
+//move slewedTorque toward torqueRequested by no more than the slew rate allows for an interval (in microseconds)
+void MotorController::slewTorque(uint32_t interval)
 {
     MotorControllerConfiguration *config = (MotorControllerConfiguration *)getConfiguration();
     //if we're asking for regen but are going slow or backward of the motoring direction then
@@ -255,8 +277,7 @@ float MotorController::getSlewedTorque()
 
     //now, take torqueRequested and compare it to torqueCommand. If it is farther away than our slew rate
     //then just move toward target by slew rate. Otherwise set it directly
-    float slewInc = config->torqueSlewRate / (1000000.0f / getTickInterval());
-    Logger::debug("slewInc %f  torqueTarget %f", slewInc, torqueRequested);
+    float slewInc = config->torqueSlewRate / (1000000.0f / interval);
     if (slewInc < 0.05f) slewInc = 0.05f; //just for sanity. Even a stupidly low value set to torqueSlewRate will still do... something.
     if (torqueRequested > 0)
     {
@@ -264,7 +285,6 @@ float MotorController::getSlewedTorque()
         {
             slewedTorque += slewInc;
             if (slewedTorque > torqueRequested) slewedTorque = torqueRequested;
-            Logger::debug("Going up %f", slewedTorque);
         }
         else 
         {
@@ -287,8 +307,6 @@ float MotorController::getSlewedTorque()
     }
 
     //if (torqueRequested == 0) slewedTorque = 0;
-
-    return slewedTorque;
 }
 
 float MotorController::getMPH()
@@ -564,8 +582,10 @@ void MotorController::loadConfiguration() {
         prefsHandler->read("FwdDIN", &config->forwardIn, 255);
         prefsHandler->read("MPHFactor", &config->mphConvFactor, 0.5f);
         prefsHandler->read("odometer", &config->odometer, 0);
+        uint32_t wearOdo;
+        //the wear leveled copy is the live one. The settings copy is only there for older builds and for when it's set by hand
+        if (wearLevel.get(WL_ODOMETER, &wearOdo)) config->odometer = wearOdo;
         odoReadingAtLastSave = config->odometer;
-        lastOdoSave = millis();
         if (config->regenTaperLower < 0 || config->regenTaperLower > 10000 ||
             config->regenTaperUpper < config->regenTaperLower || config->regenTaperUpper > 10000) {
             config->regenTaperLower = 75;
@@ -592,6 +612,10 @@ void MotorController::saveConfiguration() {
     prefsHandler->write("RegenTaperUpper", config->regenTaperUpper);
     prefsHandler->write("MPHFactor", config->mphConvFactor);
     prefsHandler->write("odometer", config->odometer);
+    //if this was set by hand it has to win over the wear leveled copy at the next boot
+    wearLevel.set(WL_ODOMETER, config->odometer);
+    wearLevel.commit();
+    odoReadingAtLastSave = config->odometer;
 
     prefsHandler->saveChecksum();
     prefsHandler->forceCacheWrite();
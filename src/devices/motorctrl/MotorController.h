@@ -183,6 +183,8 @@ public:
     float getTorqueActual();
     float getTorqueAvailable();
     float getSlewedTorque();
+    void arbitrateThrottle(Throttle *accelerator, Throttle *brake, ChargeController *charger);
+    void slewTorque(uint32_t interval);
     uint32_t getOdometerReading();
     float getMPH();
     int preMillis();
@@ -234,7 +236,6 @@ private:
     PowerMode powerMode;
     uint32_t lastOdoAccum;
     double odo_accum;
-    uint32_t lastOdoSave;
     uint32_t odoReadingAtLastSave;
 };
 
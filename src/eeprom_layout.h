@@ -68,6 +68,7 @@ This means that valid IDs must be under 0x8000 but that still leaves a couple of
 First device entry is 0xDEAD if valid - otherwise table is initialized
 */
 #define EE_DEVICE_TABLE         512 //where is the table of devices found in EEPROM?
+#define EE_TABLE_CRC            (2 * CFG_DEV_MGR_MAX_DEVICES) //offset of the table's CRC, right after the last entry
 
 #define EE_DEVICE_SIZE          1024 //# of bytes allocated to each device
 #define EE_DEVICES_BASE         1024 //start of where devices in the table can use
@@ -76,12 +77,39 @@ First device entry is 0xDEAD if valid - otherwise table is initialized
 #define EE_MAIN_OFFSET          0 //offset from start of EEPROM where main config is
 #define EE_LKG_OFFSET           34816  //start EEPROM addr where last known good config is
 
-//start EEPROM addr where the system log starts. <SYS LOG YET TO BE DEFINED>
+//Settings change log (Used by ChangeLog). A ring of 32 byte records, 8 to a page, up to EE_FAULT_LOG
 #define EE_SYS_LOG              69632
+#define CHANGELOG_NUM_RECORDS   1024
 
 //start EEPROM addr for fault log (Used by fault_handler)
 #define EE_FAULT_LOG            102400
 
+//Write ahead journal for settings changes that span more than one page (Used by MemCache). The first page
+//is the header, the rest hold copies of the pages being changed until they're safely in their real home.
+#define EE_JOURNAL              106496
+#define JOURNAL_NUM_PAGES       16
+
+//Ring of pages for values that get saved constantly (Used by WearLevel). One record at the start of each
+//page. 64 pages at one commit a minute means any given page is written a bit over once an hour at most.
+#define EE_WEAR_LEVEL           110592
+#define WEAR_NUM_PAGES          64
+#define WEAR_COMMIT_INTERVAL    60000 //milliseconds
+
+//Named parameter profiles (Used by ProfileManager). The first page has the names and which profile is
+//active. After that one slot per profile per device table position. 126976 to 250112
+#define EE_PROFILES             126976
+#define PROFILE_COUNT           4
+#define PROFILE_SLOT_SIZE       512
+
+//Configuration package being imported (Used by ConfigPackage). The first page says whether an import is
+//waiting to be finished, the package itself follows. 250112 to 261888
+#define EE_CFG_STAGING          250112
+#define CFG_STAGING_PAGES       46
+
+//Progress marker for a full EEPROM erase (MemCache::nukeFromOrbit). Very last page of the chip. It is
+//erased last so if it's still there at boot the erase got interrupted and picks up where the marker says.
+#define EE_ERASE_MARKER         261888
+
 /*Now, all devices also have a default list of things that WILL be stored in EEPROM. Each actual
 implementation for a given device can store it's own custom info as well. This data must come after
 the end of the stardard data. The below numbers are offsets from the device's eeprom section
@@ -90,6 +118,8 @@ the end of the stardard data. The below numbers are offsets from the device's ee
 //first, things in common to all devices - leave 20 bytes for this
 #define EE_CHECKSUM              0 //1 byte - checksum for this section of EEPROM to makesure it is valid
 #define EE_DEVICE_ID             1 //2 bytes - the value of the ENUM DEVID of this device.
+#define EE_BLOCK_CRC             3 //5 bytes - CRC32 of the settings area then a marker byte. Checked by the Scrubber
+#define EE_SCHEMA_VERSION        8 //2 bytes - version of the device's settings layout. 0xFFFF on blocks from before versioning
 
 #define EEFAULT_VALID            0 //1 byte - Set to value of 0xB2 if fault data has been initialized
 #define EEFAULT_READPTR          1 //2 bytes - index where reading should start (first unacknowledged fault)
@@ -57,6 +57,7 @@ void I2CDriverWire::beginTransmission(int address) {
 }
 
 uint8_t I2CDriverWire::endTransmission(int stop) {
+    claim_bus(); // Let any background transfer (EEPROM write back) complete. Starting now would abort it.
     master.write_async(write_address, tx_buffer, tx_next_byte_to_write, stop);
     finish();
     return toWireResult(master.error());
@@ -84,6 +85,7 @@ size_t I2CDriverWire::write(const uint8_t* data, size_t length) {
 uint8_t I2CDriverWire::requestFrom(int address, int quantity, int stop) {
     rx_bytes_available = 0;
     rx_next_byte_to_read = 0;
+    claim_bus();
     master.read_async((uint8_t)address, rxBuffer, min((size_t)quantity, rx_buffer_length), stop);
     finish();
     rx_bytes_available = master.get_bytes_transferred();
@@ -115,6 +117,12 @@ void I2CDriverWire::before_transmit(uint16_t address) {
     slave.set_transmit_buffer(tx_buffer, tx_next_byte_to_write);
 }
 
+// Wait out any background transfer then let its owner read the result before ours overwrites it
+void I2CDriverWire::claim_bus() {
+    finish();
+    if (on_bus_handoff) on_bus_handoff();
+}
+
 void I2CDriverWire::finish() {
     elapsedMillis timeout;
     while (timeout < timeout_millis) {
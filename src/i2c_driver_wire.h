@@ -49,6 +49,9 @@ public:
     // The default is 100000.
     void setClock(uint32_t frequency);
 
+    // Returns the frequency last given to setClock()
+    inline uint32_t getClock() { return master_frequency; }
+
     // Use this version of begin() to initialise a master.
     void begin();
 
@@ -105,6 +108,14 @@ public:
         on_request = function;
     }
 
+    // Registers a function to be called just before Wire starts a transfer
+    // of its own, after any background transfer on the same master has
+    // finished. Whoever started that background transfer can collect its
+    // result here before Wire's transfer replaces it.
+    inline void onBusHandoff(void (* function)()) {
+        on_bus_handoff = function;
+    }
+
     // Returns the address that the slave responded to the last
     // time the master accessed it. This is only useful for slaves
     // that are listening to more than one address.
@@ -130,6 +141,7 @@ private:
 
     void (* on_receive)(int len) = nullptr;
     void (* on_request)() = nullptr;
+    void (* on_bus_handoff)() = nullptr;
 
     uint8_t write_address = 0;
     uint8_t tx_buffer[tx_buffer_length] = {};
@@ -144,6 +156,7 @@ private:
     void prepare_slave();
     void before_transmit(uint16_t address);
     void finish();
+    void claim_bus();
     void on_receive_wrapper(size_t num_bytes, uint16_t address);
 };
 
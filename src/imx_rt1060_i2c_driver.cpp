@@ -138,7 +138,7 @@ void IMX_RT1060_I2CMaster::end() {
     stop(port, config.irq);
 }
 
-inline bool IMX_RT1060_I2CMaster::finished() {
+bool IMX_RT1060_I2CMaster::finished() {
     return state >= State::idle;
 }
 
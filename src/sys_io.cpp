@@ -65,6 +65,7 @@ SystemIO::SystemIO() : Device()
     numAnaOut = 0;
     pcaDigitalOutputCache = 0; //all outputs off by default
     adcMuxSelect = 0;
+    adcMuxSwitchTime = 0;
     ioStatusIdx = 0;
 
     for (int i = 0; i < NUM_OUTPUT; i++)
@@ -97,7 +98,9 @@ FLASHMEM void SystemIO::setSystemType(SystemType systemType) {
         sysConfig->systemType = systemType;
         Device *sysDev;
         sysDev = deviceManager.getDeviceByID(SYSTEM);
+        memCache->beginTransaction();
         sysDev->saveConfiguration();
+        memCache->commitTransaction();
     }
 }
 
@@ -383,6 +386,10 @@ int16_t SystemIO::_pGetAnalogRaw(uint8_t which)
     }
         
     int neededMux = which % 4;
+    //The control lane reads the pedals from its interrupt. If it got in between us switching the mux
+    //and reading the ADC one of us would read the wrong input so keep it out until we're done.
+    bool guard = !IN_INTERRUPT();
+    if (guard) __disable_irq();
     //we don't change the analog mux unless absolutely necessary
     if (neededMux != adcMuxSelect) //must change mux to read this
     {
@@ -398,6 +405,7 @@ int16_t SystemIO::_pGetAnalogRaw(uint8_t which)
         digitalWrite(3, (neededMux & 1) ? HIGH : LOW);
         //Logger::debug("ADC for %u mux1 %u mux2 %u", which, (neededMux & 1), (neededMux & 2));
         adcMuxSelect = neededMux;
+        adcMuxSwitchTime = micros();
         //the analog multiplexor input switch pins are on direct outputs from the teensy
         //and so will change very rapidly. The multiplexor also switches inputs in less than
         //1 microsecond. The inputs are all buffered with 1uF caps and so perhaps the slowest
@@ -406,10 +414,12 @@ int16_t SystemIO::_pGetAnalogRaw(uint8_t which)
         //Perhaps only 1us goes by between switching the mux and the new value appearing
         //but give it at least a few microseconds for everything to switch and the new value to
         //settle at the Teensy ADC pin.
-        delayMicroseconds(5);
         //delay(6); //really long delay!
-
     }
+    //Only wait out whatever is left of the settling time. The mux is shared by both ADCs so reading
+    //input 4 right after input 0 (or anything else already on this mux setting) doesn't wait again.
+    while ((micros() - adcMuxSwitchTime) < ADC_MUX_SETTLE_TIME) ;
+
     //Analog inputs 0-3 are always on ADC0, 4-7 are on ADC1
     if (which < 4) 
     {
@@ -423,6 +433,7 @@ int16_t SystemIO::_pGetAnalogRaw(uint8_t which)
         valu = adc->adc1->analogRead(1);
         //Logger::debug("AREAD1: %u", valu);
     }
+    if (guard) __enable_irq();
     return valu;
 }
 
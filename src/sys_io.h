@@ -68,6 +68,9 @@ public:
 #define PCA_POLARITY_1  5
 #define PCA_CFG_0       6
 #define PCA_CFG_1       7
+
+#define ADC_MUX_SETTLE_TIME 5 //microseconds to let the ADC pin settle after switching the analog mux
+
 #define PCA_WRITE       0
 #define PCA_READ        1
 
@@ -132,6 +135,7 @@ private:
     bool ranSetup;
 
     int adcMuxSelect;
+    uint32_t adcMuxSwitchTime; //micros when the mux was last switched
 
     int ioStatusIdx;
 
@@ -0,0 +1,18 @@
+/*
+ * ADC.h
+ *
+ * Host stand-in so sys_io.h can be included. There are no analog inputs on a PC.
+ */
+
+#ifndef HOST_ADC_H_
+#define HOST_ADC_H_
+
+#include <Arduino.h>
+
+class ADC_Module {};
+class ADC {
+public:
+    ADC_Module *adc0, *adc1;
+};
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Arduino.h
+ *
+ * Host stand-in for the Teensy core. Only what the storage and settings code
+ * needs to build and run on a PC for the native unit tests and benchmarks.
+ * Time comes from sysClock in the code under test so the functions here are
+ * only the wall clock fallbacks.
+ */
+
+#ifndef HOST_ARDUINO_H_
+#define HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define FLASHMEM
+#define DMAMEM
+#define PROGMEM
+#define EXTMEM
+#define FASTRUN
+#define F(s) (s)
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define A0 14
+#define A1 15
+#define DEC 10
+#define HEX 16
+
+#define __disable_irq()
+#define __enable_irq()
+#define NVIC_SET_PRIORITY(irq, prio)
+#define IRQ_QTIMER1 1
+#define IRQ_QTIMER2 2
+#define IRQ_QTIMER3 3
+
+//nothing on the host runs in an interrupt and the cycle counter is never read for real
+extern volatile uint32_t hostCycleCount;
+#define SCB_ICSR 0
+#define ARM_DWT_CYCCNT hostCycleCount
+#define ARM_DWT_CTRL hostCycleCount
+#define ARM_DEMCR hostCycleCount
+#define ARM_DEMCR_TRCENA 1
+#define ARM_DWT_CTRL_CYCCNTENA 1
+#define F_CPU 600000000
+extern uint32_t F_CPU_ACTUAL;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+inline void yield() {}
+inline void pinMode(int, int) {}
+inline void digitalWrite(int, int) {}
+inline int digitalRead(int) { return 0; }
+inline void analogWriteResolution(int) {}
+inline void analogWriteFrequency(int, float) {}
+inline void analogWrite(int, int) {}
+inline void analogReadRes(int) {}
+inline void analogReadAveraging(int) {}
+inline int analogRead(int) { return 0; }
+inline void arm_dcache_flush(void *, uint32_t) {}
+inline void arm_dcache_flush_delete(void *, uint32_t) {}
+inline void arm_dcache_delete(void *, uint32_t) {}
+inline long map(long x, long inMin, long inMax, long outMin, long outMax)
+{
+    return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+template<class T, class U, class V> T constrain(T a, U low, V high) { return a < low ? low : (a > high ? high : a); }
+using std::min;
+using std::max;
+
+class String {
+public:
+    String(const char *s = "") : str(s ? s : "") {}
+    String(char c) : str(1, c) {}
+    String(int v, unsigned char base = 10) : str(std::to_string(v)) {}
+    String(unsigned int v, unsigned char base = 10) : str(std::to_string(v)) {}
+    String(long v, unsigned char base = 10) : str(std::to_string(v)) {}
+    String(unsigned long v, unsigned char base = 10) : str(std::to_string(v)) {}
+    String(double v, unsigned char decimals = 2) : str(std::to_string(v)) {}
+    String &operator+=(const String &s) { str += s.str; return *this; }
+    String &operator+=(const char *s) { str += s; return *this; }
+    String &operator+=(char c) { str += c; return *this; }
+    friend String operator+(const String &a, const String &b) { return String((a.str + b.str).c_str()); }
+    bool operator==(const String &s) const { return str == s.str; }
+    bool operator==(const char *s) const { return str == s; }
+    bool operator!=(const String &s) const { return str != s.str; }
+    char operator[](unsigned int i) const { return str[i]; }
+    const char *c_str() const { return str.c_str(); }
+    unsigned int length() const { return str.length(); }
+    bool concat(const char *s) { str += s; return true; }
+    bool concat(const char *s, unsigned int len) { str.append(s, len); return true; }
+    bool concat(char c) { str += c; return true; }
+    bool reserve(unsigned int size) { str.reserve(size); return true; }
+    long toInt() const { return atol(str.c_str()); }
+    float toFloat() const { return atof(str.c_str()); }
+    void toUpperCase() { for (auto &c : str) c = toupper(c); }
+    //for ArduinoJson
+    size_t write(uint8_t c) { str += (char)c; return 1; }
+private:
+    std::string str;
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+        size_t n = 0;
+        while (size-- && write(*buffer++)) n++;
+        return n;
+    }
+    size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(const char *s) { return write(s); }
+    size_t print(const String &s) { return write(s.c_str()); }
+    size_t println(const char *s = "") { return print(s) + write("\r\n"); }
+    size_t printf(const char *format, ...)
+    {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        return write(buffer);
+    }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    size_t readBytes(uint8_t *buffer, size_t length)
+    {
+        size_t n = 0;
+        while (n < length && available() > 0) buffer[n++] = read();
+        return n;
+    }
+    size_t readBytes(char *buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+    void setTimeout(unsigned long) {}
+};
+
+class usb_serial_class : public Stream {
+public:
+    void begin(long) {}
+    operator bool() { return true; }
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+    using Print::write;
+};
+extern usb_serial_class Serial;
+extern usb_serial_class SerialUSB;
+extern usb_serial_class SerialUSB1;
+
+class elapsedMillis {
+public:
+    elapsedMillis() { start = millis(); }
+    operator uint32_t() const { return millis() - start; }
+    elapsedMillis &operator=(uint32_t val) { start = millis() - val; return *this; }
+private:
+    uint32_t start;
+};
+
+class elapsedMicros {
+public:
+    elapsedMicros() { start = micros(); }
+    operator uint32_t() const { return micros() - start; }
+    elapsedMicros &operator=(uint32_t val) { start = micros() - val; return *this; }
+private:
+    uint32_t start;
+};
+
+class IntervalTimer {
+public:
+    bool begin(void (*)(), uint32_t) { return true; }
+    void end() {}
+    void priority(uint8_t) {}
+};
+
+struct crashreport_breadcrumbs_struct {
+    uint32_t bitmask;
+    uint32_t checksum;
+    uint32_t value[6];
+};
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * FastCRC.h
+ *
+ * Host stand-in for the FastCRC library. Plain bitwise CRC32 giving the same
+ * results as the hardware-assisted version on the Teensy, so journal and
+ * settings checksums written on the host match what the firmware expects.
+ */
+
+#ifndef HOST_FASTCRC_H_
+#define HOST_FASTCRC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+class FastCRC32 {
+public:
+    FastCRC32() : seed(0) {}
+    uint32_t crc32(const uint8_t *data, size_t len)
+    {
+        seed = 0;
+        return crc32_upd(data, len);
+    }
+    //carries on from where the last call left off
+    uint32_t crc32_upd(const uint8_t *data, size_t len)
+    {
+        uint32_t crc = ~seed;
+        while (len--)
+        {
+            crc ^= *data++;
+            for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        }
+        seed = ~crc;
+        return seed;
+    }
+private:
+    uint32_t seed;
+};
+
+#endif
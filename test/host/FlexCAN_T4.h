@@ -0,0 +1,68 @@
+/*
+ * FlexCAN_T4.h
+ *
+ * Host stand-in. Just the types the CAN handler's header refers to so code that
+ * includes it can build. Nothing here ever talks to a bus.
+ */
+
+#ifndef HOST_FLEXCAN_T4_H_
+#define HOST_FLEXCAN_T4_H_
+
+#include <Arduino.h>
+
+typedef struct CAN_message_t {
+    uint32_t id = 0;
+    uint16_t timestamp = 0;
+    uint8_t idhit = 0;
+    struct {
+        bool extended = 0;
+        bool remote = 0;
+        bool overrun = 0;
+        bool reserved = 0;
+    } flags;
+    uint8_t len = 8;
+    uint8_t buf[8] = { 0 };
+    int8_t mb = 0;
+    uint8_t bus = 0;
+    bool seq = 0;
+} CAN_message_t;
+
+typedef struct CANFD_message_t {
+    uint32_t id = 0;
+    uint16_t timestamp = 0;
+    uint8_t idhit = 0;
+    bool brs = 1;
+    bool esi = 0;
+    bool edl = 1;
+    struct {
+        bool extended = 0;
+        bool overrun = 0;
+        bool reserved = 0;
+    } flags;
+    uint8_t len = 8;
+    uint8_t buf[64] = { 0 };
+    int8_t mb = 0;
+    uint8_t bus = 0;
+    bool seq = 0;
+} CANFD_message_t;
+
+typedef struct CAN_error_t {
+    char state[30];
+    bool BIT1_ERR, BIT0_ERR, ACK_ERR, CRC_ERR, FRM_ERR, STF_ERR, RX_WRN, TX_WRN;
+    char FLT_CONF[14];
+    uint8_t RX_ERR_COUNTER, TX_ERR_COUNTER;
+    uint32_t ESR1;
+    uint16_t ECR;
+} CAN_error_t;
+
+enum CAN_DEV_TABLE { CAN0, CAN1, CAN2, CAN3 };
+enum FLEXCAN_RXQUEUE_TABLE { RX_SIZE_2 = 2, RX_SIZE_256 = 256 };
+enum FLEXCAN_TXQUEUE_TABLE { TX_SIZE_2 = 2, TX_SIZE_16 = 16, TX_SIZE_256 = 256 };
+
+#define ACCEPT_ALL 0
+#define REJECT_ALL 1
+
+template<CAN_DEV_TABLE bus, FLEXCAN_RXQUEUE_TABLE rx, FLEXCAN_TXQUEUE_TABLE tx> class FlexCAN_T4 {};
+template<CAN_DEV_TABLE bus, FLEXCAN_RXQUEUE_TABLE rx, FLEXCAN_TXQUEUE_TABLE tx> class FlexCAN_T4FD {};
+
+#endif
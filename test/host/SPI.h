@@ -0,0 +1,12 @@
+/*
+ * SPI.h
+ *
+ * Host stand-in so sys_io.h can be included. Nothing uses SPI off target.
+ */
+
+#ifndef HOST_SPI_H_
+#define HOST_SPI_H_
+
+#include <Arduino.h>
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * TeensyTimerTool.h
+ *
+ * Host stand-in so TickHandler.h can be included and the Supervisor builds. The
+ * host build has no timer interrupts. Continuations never fire on their own, blocking waits drive the
+ * write back engine instead.
+ */
+
+#ifndef HOST_TEENSYTIMERTOOL_H_
+#define HOST_TEENSYTIMERTOOL_H_
+
+#include <Arduino.h>
+#include <functional>
+
+namespace TeensyTimerTool {
+enum TimerGenerator { GPT1, GPT2, TMR1, TMR2, TMR3, TMR4, PIT, TCK, TCK64 };
+enum errorCode { OK };
+using callback_t = std::function<void()>;
+class PeriodicTimer {
+public:
+    PeriodicTimer(TimerGenerator g = GPT1) {}
+    errorCode begin(callback_t callback, uint32_t period, bool start = true) { return OK; }
+    void stop() {}
+};
+class OneShotTimer {
+public:
+    OneShotTimer(TimerGenerator g = GPT1) {}
+};
+}
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * Watchdog_t4.h
+ *
+ * Host stand-in for the WDT_T4 library so the real Supervisor builds. There is
+ * no watchdog to feed. A reset is only counted so a test can see whether the
+ * supervisor would have pulled the plug.
+ */
+
+#ifndef HOST_WATCHDOG_T4_H_
+#define HOST_WATCHDOG_T4_H_
+
+#include <Arduino.h>
+
+typedef enum WDT_DEV_TABLE { WDT1, WDT2, WDT3 } WDT_DEV;
+
+template<WDT_DEV_TABLE _device>
+class WDT_T4 {
+public:
+    void feed() { feeds++; }
+    void reset() { resets++; }
+
+    uint32_t feeds = 0;
+    uint32_t resets = 0;
+};
+
+#endif
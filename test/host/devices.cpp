@@ -0,0 +1,68 @@
+/*
+ * devices.cpp
+ *
+ * Just enough of the device manager and the CAN handlers for Device and the
+ * settings code to run natively. Devices register and can be found by ID or
+ * position like on the real thing. Status entries, messages and CAN traffic
+ * go nowhere.
+ */
+
+#include <Arduino.h>
+#include "DeviceManager.h"
+#include "CanHandler.h"
+
+DeviceManager::DeviceManager()
+{
+    throttle = nullptr;
+    brake = nullptr;
+    motorController = nullptr;
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++) devices[i] = nullptr;
+}
+
+void DeviceManager::addDevice(Device *device)
+{
+    if (findDevice(device) != -1) return;
+    int8_t i = findDevice(nullptr);
+    if (i != -1) devices[i] = device;
+}
+
+void DeviceManager::removeDevice(Device *device)
+{
+    int8_t i = findDevice(device);
+    if (i != -1) devices[i] = nullptr;
+}
+
+int8_t DeviceManager::findDevice(Device *device)
+{
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    {
+        if (device == devices[i]) return i;
+    }
+    return -1;
+}
+
+Device *DeviceManager::getDeviceByID(DeviceId id)
+{
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    {
+        if (devices[i] && devices[i]->getId() == id) return devices[i];
+    }
+    return nullptr;
+}
+
+Device *DeviceManager::getDeviceByIdx(int idx)
+{
+    if (idx < 0 || idx >= CFG_DEV_MGR_MAX_DEVICES) return nullptr;
+    return devices[idx];
+}
+
+void DeviceManager::handleTick() {}
+void DeviceManager::addStatusEntry(StatusEntry entry) {}
+void DeviceManager::sendMessage(DeviceType deviceType, DeviceId deviceId, uint32_t msgType, void *message) {}
+DeviceManager deviceManager;
+
+CanHandler::CanHandler(CanBusNode busNumber) {}
+void CanHandler::detachAll(CanObserver *observer) {}
+CanHandler canHandlerBus0(CanHandler::CAN_BUS_0);
+CanHandler canHandlerBus1(CanHandler::CAN_BUS_1);
+CanHandler canHandlerBus2(CanHandler::CAN_BUS_2);
@@ -0,0 +1,109 @@
+/*
+ * host.cpp
+ *
+ * Everything the storage and settings code expects from the rest of the
+ * firmware when it runs natively on a PC: the Arduino time functions, the
+ * logger, the tick handler and what the supervisor needs. Timers never fire
+ * here. Code that waits on the EEPROM drives the write back itself through
+ * sysClock.
+ */
+
+#include <Arduino.h>
+#include <chrono>
+#include <thread>
+#include "Logger.h"
+#include "TickHandler.h"
+#include "Supervisor.h"
+#include "CrashHandler.h"
+#include "Watchdog_t4.h"
+#include "MemCache.h"
+
+volatile uint32_t hostCycleCount;
+uint32_t F_CPU_ACTUAL = F_CPU;
+usb_serial_class Serial;
+usb_serial_class SerialUSB;
+usb_serial_class SerialUSB1;
+
+MemCache *memCache;
+
+static std::chrono::steady_clock::time_point hostStart = std::chrono::steady_clock::now();
+
+uint32_t millis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - hostStart).count();
+}
+
+uint32_t micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - hostStart).count();
+}
+
+void delay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+//Logger. Warnings and errors go to stdout so a failing test shows why. Tests that expect a lot of noise turn it down.
+static Logger::LogLevel hostLogLevel = Logger::Warn;
+uint32_t Logger::lastLogTime;
+ESP32Driver *Logger::esp32;
+volatile uint32_t Logger::droppedInterruptMsgs;
+
+void Logger::log(DeviceId deviceId, LogLevel level, const char *format, va_list args)
+{
+    static const char *levels[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+    if (level < hostLogLevel || level >= Off) return;
+    printf("%s: ", level >= Debug ? levels[level] : "AVALANCHE");
+    vprintf(format, args);
+    printf("\n");
+}
+
+#define HOST_LOG(level) { va_list args; va_start(args, message); log(INVALID, level, message, args); va_end(args); }
+#define HOST_LOG_ID(level) { va_list args; va_start(args, message); log(deviceId, level, message, args); va_end(args); }
+void Logger::avalanche(const char *message, ...) HOST_LOG(Avalanche)
+void Logger::avalanche(DeviceId deviceId, const char *message, ...) HOST_LOG_ID(Avalanche)
+void Logger::debug(const char *message, ...) HOST_LOG(Debug)
+void Logger::debug(DeviceId deviceId, const char *message, ...) HOST_LOG_ID(Debug)
+void Logger::info(const char *message, ...) HOST_LOG(Info)
+void Logger::info(DeviceId deviceId, const char *message, ...) HOST_LOG_ID(Info)
+void Logger::warn(const char *message, ...) HOST_LOG(Warn)
+void Logger::warn(DeviceId deviceId, const char *message, ...) HOST_LOG_ID(Warn)
+void Logger::error(const char *message, ...) HOST_LOG(Error)
+void Logger::error(DeviceId deviceId, const char *message, ...) HOST_LOG_ID(Error)
+void Logger::console(const char *message, ...) HOST_LOG(Info)
+
+void Logger::setLoglevel(LogLevel level)
+{
+    hostLogLevel = level;
+}
+
+Logger::LogLevel Logger::getLogLevel()
+{
+    return hostLogLevel;
+}
+
+boolean Logger::isDebug()
+{
+    return hostLogLevel == Debug;
+}
+
+//TickHandler. Nothing is ever scheduled on the host
+void TickObserver::handleTick() {}
+void Continuation::resume() {}
+TickHandler::TickHandler() {}
+void TickHandler::attach(TickObserver *observer, uint32_t interval) {}
+void TickHandler::detach(TickObserver *observer) {}
+bool TickHandler::resumeAfter(Continuation *cont, uint32_t delayMicros) { return true; }
+void TickHandler::cancel(Continuation *cont) {}
+TickHandler tickHandler;
+
+//What the real Supervisor needs. The watchdog only counts feeds and resets, breadcrumbs go nowhere
+WDT_T4<WDT3> wdt;
+CrashHandler::CrashHandler() {}
+void CrashHandler::addBreadcrumb(uint32_t crumb) {}
+CrashHandler crashHandler;
@@ -0,0 +1,121 @@
+/*
+ * Benchmark for the boot prefetch of device settings. Simulated time spent reading EEPROM at start up
+ * with and without PrefHandler::prefetchDevices for ten enabled devices plus the ones that are always on.
+ * Without it every page of the device table and of each settings block is faulted in on its own at the
+ * normal bus speed the first time a device reads a setting from it. The emulator charges each read the
+ * time clocking it over I2C takes so the simulated clock measures what the bus would.
+ * Run with: pio test -e native -f native/bench_boot_prefetch
+ */
+
+#include <unity.h>
+#include <new>
+#include "EEPROMStorage.h"
+#include "MemCache.h"
+#include "PrefHandler.h"
+#include "WearLevel.h"
+#include "ChangeLog.h"
+#include "SysClock.h"
+
+#define IMAGE_FILE      "bench_boot_prefetch.bin"
+#define BENCH_DEVICES   10
+#define BENCH_SETTINGS  40
+#define NORMAL_CLOCK    100000 //what Wire runs at unless told otherwise
+
+static SimulatedClock simClock;
+static FileEEPROM *eeprom;
+static MemCache cacheStore;
+
+static void powerCycle()
+{
+    delete eeprom;
+    eeprom = new FileEEPROM(IMAGE_FILE);
+    TEST_ASSERT_TRUE(eeprom->begin());
+    setEEPROMStorage(eeprom);
+    memCache = new (&cacheStore) MemCache();
+    memCache->setup();
+    wearLevel.setup();
+    changeLog.setup();
+}
+
+//Every enabled device looks itself up in the table then reads its settings block as it loads its config.
+//The devices that are always on (system, heartbeat...) are in the table too
+static int loadAllDevices()
+{
+    uint8_t block[EE_DEVICE_SIZE];
+    uint16_t id;
+    int loaded = 0;
+    for (int x = 1; x < CFG_DEV_MGR_MAX_DEVICES; x++)
+    {
+        TEST_ASSERT_TRUE(memCache->Read(EE_DEVICE_TABLE + (2 * x), &id));
+        if (!(id & 0x8000)) continue;
+        TEST_ASSERT_TRUE(memCache->Read(EE_DEVICES_BASE + EE_DEVICE_SIZE * x, block, EE_DEVICE_SIZE));
+        loaded++;
+    }
+    return loaded;
+}
+
+void setUp()
+{
+    char key[16];
+
+    remove(IMAGE_FILE);
+    setSysClock(&simClock);
+    simClock.reset();
+    eeprom = nullptr;
+    powerCycle();
+    for (int i = 0; i < BENCH_DEVICES; i++)
+    {
+        PrefHandler prefs((DeviceId)(0x1100 + i));
+        PrefHandler::setDeviceStatus(0x1100 + i, true);
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            snprintf(key, sizeof(key), "Setting%i", s);
+            TEST_ASSERT_TRUE(prefs.write(key, (uint32_t)(i * 1000 + s)));
+        }
+        prefs.saveChecksum();
+    }
+    memCache->FlushAllPages();
+    eeprom->setBusClock(NORMAL_CLOCK);
+}
+
+void tearDown()
+{
+    delete eeprom;
+    eeprom = nullptr;
+    setEEPROMStorage(nullptr);
+    remove(IMAGE_FILE);
+}
+
+void bench_boot_reads()
+{
+    char msg[128];
+
+    powerCycle();
+    eeprom->setBusClock(NORMAL_CLOCK);
+    uint32_t startTime = simClock.micros();
+    int devices = loadAllDevices();
+    uint32_t faultMicros = simClock.micros() - startTime;
+
+    powerCycle();
+    eeprom->setBusClock(NORMAL_CLOCK);
+    startTime = simClock.micros();
+    PrefHandler::prefetchDevices();
+    uint32_t prefetchMicros = simClock.micros() - startTime;
+    TEST_ASSERT_EQUAL_INT(devices, loadAllDevices()); //everything it needs is cached now
+    uint32_t totalMicros = simClock.micros() - startTime;
+
+    snprintf(msg, sizeof(msg), "%i enabled devices. Page faults at %ikHz: %uus of EEPROM reads", devices, NORMAL_CLOCK / 1000, faultMicros);
+    TEST_MESSAGE(msg);
+    snprintf(msg, sizeof(msg), "bulk prefetch at %ikHz: %uus (%uus in the prefetch) %.1fx faster", EEPROM_BULK_CLOCK / 1000,
+             totalMicros, prefetchMicros, (double)faultMicros / totalMicros);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_EQUAL_UINT32(prefetchMicros, totalMicros); //nothing left to fault in after the prefetch
+    TEST_ASSERT_LESS_THAN_UINT32(faultMicros / 5, totalMicros);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(bench_boot_reads);
+    return UNITY_END();
+}
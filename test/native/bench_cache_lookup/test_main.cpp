@@ -0,0 +1,146 @@
+/*
+ * Benchmark for the MemCache page index. Reads of cached pages through MemCache as it is now against the
+ * way they used to be found: a scan of all NUM_CACHED_PAGES entries for every byte read. The old lookup is
+ * reproduced below as it was in MemCache before the page index replaced it.
+ * Run with: pio test -e native -f native/bench_cache_lookup
+ */
+
+#include <unity.h>
+#include <new>
+#include "EEPROMStorage.h"
+#include "MemCache.h"
+#include "SysClock.h"
+
+#define IMAGE_FILE      "bench_cache_lookup.bin"
+#define BENCH_READS     2000000
+
+static SimulatedClock simClock;
+static FileEEPROM *eeprom;
+static MemCache cacheStore;
+static MemCache *cache = &cacheStore;
+
+//What a cache page used to be and how Read found one
+typedef struct
+{
+    uint8_t data[256];
+    uint32_t address;
+    uint8_t age;
+    boolean dirty;
+} OldPageCache;
+
+static OldPageCache oldPages[NUM_CACHED_PAGES];
+
+static uint8_t oldCacheHit(uint32_t address)
+{
+    uint8_t c;
+    for (c = 0; c < NUM_CACHED_PAGES; c++) {
+        if (oldPages[c].address == address) {
+            return c;
+        }
+    }
+    return 0xFF;
+}
+
+static boolean oldRead(uint32_t address, void *data, uint16_t len)
+{
+    uint32_t addr;
+    uint8_t c = 0xFF;
+    uint16_t count;
+
+    for (count = 0; count < len; count++) {
+        addr = (address + count) >> 8;
+        c = oldCacheHit(addr);
+        if (c != 0xFF) {
+            *(uint8_t *)( ((uint8_t *)data) + count) = oldPages[c].data[(uint16_t)((address + count) & 0x00FF)];
+            if (!oldPages[c].dirty) oldPages[c].age = 0;
+        }
+        else break;
+    }
+    return (c != 0xFF);
+}
+
+//4 byte aligned spots spread over the cached pages in no particular order
+static uint32_t nextAddress(uint32_t *seed)
+{
+    *seed = *seed * 1664525ul + 1013904223ul;
+    return ((*seed >> 8) % (NUM_CACHED_PAGES * 256)) & ~3ul;
+}
+
+void setUp()
+{
+    uint8_t page[256];
+
+    remove(IMAGE_FILE);
+    setSysClock(&simClock);
+    simClock.reset();
+    eeprom = new FileEEPROM(IMAGE_FILE);
+    TEST_ASSERT_TRUE(eeprom->begin());
+    setEEPROMStorage(eeprom);
+    new (cache) MemCache();
+    cache->setup();
+
+    //same contents in both and every page cached
+    for (uint32_t p = 0; p < NUM_CACHED_PAGES; p++)
+    {
+        for (int i = 0; i < 256; i++) page[i] = (uint8_t)(p * 7 + i);
+        TEST_ASSERT_TRUE(cache->Write(p * 256, page, 256));
+        memcpy(oldPages[p].data, page, 256);
+        oldPages[p].address = p;
+        oldPages[p].age = 0;
+        oldPages[p].dirty = false;
+    }
+    cache->FlushAllPages();
+}
+
+void tearDown()
+{
+    delete eeprom;
+    eeprom = nullptr;
+    setEEPROMStorage(nullptr);
+    remove(IMAGE_FILE);
+}
+
+void bench_cached_reads()
+{
+    uint32_t seed;
+    uint32_t value;
+    uint32_t oldSum = 0;
+    uint32_t newSum = 0;
+    uint32_t startTime;
+    char msg[128];
+
+    seed = 1;
+    startTime = micros();
+    for (uint32_t i = 0; i < BENCH_READS; i++)
+    {
+        oldRead(nextAddress(&seed), &value, 4);
+        oldSum += value;
+    }
+    uint32_t oldMicros = micros() - startTime;
+
+    seed = 1;
+    startTime = micros();
+    for (uint32_t i = 0; i < BENCH_READS; i++)
+    {
+        cache->Read(nextAddress(&seed), &value);
+        newSum += value;
+    }
+    uint32_t newMicros = micros() - startTime;
+
+    TEST_ASSERT_EQUAL_UINT32(oldSum, newSum); //both read the same bytes
+
+    double oldRate = BENCH_READS / (oldMicros / 1000000.0);
+    double newRate = BENCH_READS / (newMicros / 1000000.0);
+    snprintf(msg, sizeof(msg), "linear scan: %.2f million 32 bit reads/s (%uus)", oldRate / 1e6, oldMicros);
+    TEST_MESSAGE(msg);
+    snprintf(msg, sizeof(msg), "page index:  %.2f million 32 bit reads/s (%uus) %.1fx", newRate / 1e6, newMicros, newRate / oldRate);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_THAN_UINT32(oldMicros / 2, newMicros); //at least twice as fast
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(bench_cached_reads);
+    return UNITY_END();
+}
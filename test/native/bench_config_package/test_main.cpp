@@ -0,0 +1,416 @@
+/*
+ * Benchmark for moving a configuration off one unit and onto another. The configuration package against
+ * the two other ways there are to do it: the binary dump of the whole 256k EEPROM in 128 byte chunks
+ * (DUMP / RESTORE) and the JSON document of every config entry of every enabled device (JSONDUMP /
+ * JSONREAD). Both are reproduced below as SerialConsole and DeviceManager do them. Transfer time is the
+ * EEPROM time at the normal bus speed plus the bytes over a 1MB/s link (USB or the sdcard), which is
+ * about what either manages. The imports go onto a unit that has different settings stored and every
+ * one of them has to end up with the exported values.
+ * Run with: pio test -e native -f native/bench_config_package
+ */
+
+#include <unity.h>
+#include <new>
+#include <vector>
+#include <ArduinoJson.h>
+#include "EEPROMStorage.h"
+#include "MemCache.h"
+#include "PrefHandler.h"
+#include "WearLevel.h"
+#include "ChangeLog.h"
+#include "ConfigPackage.h"
+#include "DeviceManager.h"
+#include "SysClock.h"
+
+#define IMAGE_FILE      "bench_config_package.bin"
+#define BENCH_DEVICES   8
+#define BENCH_SETTINGS  12
+#define NORMAL_CLOCK    100000 //what Wire runs at unless told otherwise
+#define LINK_RATE       1000000 //bytes a second over USB or to the sdcard
+//what JSONDUMP and JSONREAD allocate. Every slot in the document has pointers in it so a 64 bit host needs
+//proportionally more to hold what fits in 20000 bytes on the Teensy
+#define JSON_DOC_SIZE   (20000 * sizeof(void *) / 4)
+
+typedef union
+{
+    uint32_t u32;
+    uint16_t u16;
+    float f;
+} BenchValue;
+
+//A device with a handful of settings of the usual types, all of them changed from their defaults
+class BenchDevice : public Device {
+public:
+    BenchDevice(int num)
+    {
+        commonName = "Benchmark device";
+        snprintf(name, sizeof(name), "BENCH%i", num);
+        shortName = name;
+        deviceId = (DeviceId)(0x1100 + num);
+        deviceType = DEVICE_MISC;
+
+        cfgEntries.reserve(BENCH_SETTINGS);
+        ConfigEntry entry;
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            snprintf(keys[s], sizeof(keys[s]), "SETTING%02i", s);
+            switch (s % 3)
+            {
+            case 0:
+                entry = {keys[s], "Some count the device needs to know about", &values[s].u32, CFG_ENTRY_VAR_TYPE::UINT32, 0, 100000, 0, nullptr, nullptr};
+                break;
+            case 1:
+                entry = {keys[s], "A limit in tenths of a unit", &values[s].u16, CFG_ENTRY_VAR_TYPE::UINT16, 0, 10000, -10, nullptr, nullptr};
+                break;
+            case 2:
+                entry = {keys[s], "Gain used by the control loop", &values[s].f, CFG_ENTRY_VAR_TYPE::FLOAT, {.floating = 0.0}, {.floating = 100.0}, 3, nullptr, nullptr};
+                break;
+            }
+            cfgEntries.push_back(entry);
+        }
+    }
+
+    //a fresh PrefHandler and a load of the settings, the way the device comes up at boot
+    void restart()
+    {
+        delete prefsHandler;
+        prefsHandler = nullptr;
+        earlyInit();
+        loadConfiguration();
+    }
+
+    void loadConfiguration()
+    {
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            switch (s % 3)
+            {
+            case 0: prefsHandler->read(keys[s], &values[s].u32, 0); break;
+            case 1: prefsHandler->read(keys[s], &values[s].u16, 0); break;
+            case 2: prefsHandler->read(keys[s], &values[s].f, 0.0f); break;
+            }
+        }
+    }
+
+    void saveConfiguration()
+    {
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            switch (s % 3)
+            {
+            case 0: prefsHandler->write(keys[s], values[s].u32); break;
+            case 1: prefsHandler->write(keys[s], values[s].u16); break;
+            case 2: prefsHandler->write(keys[s], values[s].f); break;
+            }
+        }
+    }
+
+    //what this unit's settings are. Each of them is different for a different version
+    void setValues(int version)
+    {
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            values[s].u32 = 0;
+            switch (s % 3)
+            {
+            case 0: values[s].u32 = 1000 * version + deviceId + s; break;
+            case 1: values[s].u16 = (uint16_t)(100 * version + s + 1); break;
+            case 2: values[s].f = version + s * 0.25f; break;
+            }
+        }
+    }
+
+    bool hasValues(int version)
+    {
+        BenchValue saved[BENCH_SETTINGS];
+        memcpy(saved, values, sizeof(values));
+        setValues(version);
+        bool same = !memcmp(saved, values, sizeof(values));
+        memcpy(values, saved, sizeof(values));
+        return same;
+    }
+
+private:
+    char name[16];
+    char keys[BENCH_SETTINGS][16];
+    BenchValue values[BENCH_SETTINGS];
+};
+
+//Everything written goes into the buffer and reads come back out of it. Stands in for the USB port or a
+//file on the sdcard
+class BufferStream : public Stream {
+public:
+    std::vector<uint8_t> data;
+    size_t pos = 0;
+    size_t write(uint8_t c) { data.push_back(c); return 1; }
+    size_t write(const uint8_t *buffer, size_t size) { data.insert(data.end(), buffer, buffer + size); return size; }
+    int available() { return data.size() - pos; }
+    int read() { return pos < data.size() ? data[pos++] : -1; }
+    int peek() { return pos < data.size() ? data[pos] : -1; }
+};
+
+static SimulatedClock simClock;
+static FileEEPROM *eeprom;
+static MemCache cacheStore;
+static BenchDevice *devices[BENCH_DEVICES];
+
+static void powerCycle()
+{
+    delete eeprom;
+    eeprom = new FileEEPROM(IMAGE_FILE);
+    TEST_ASSERT_TRUE(eeprom->begin());
+    setEEPROMStorage(eeprom);
+    memCache = new (&cacheStore) MemCache();
+    memCache->setup();
+    wearLevel.setup();
+    changeLog.setup();
+}
+
+//Boot like the real thing: prefetch then every device loads its settings
+static void boot()
+{
+    powerCycle();
+    PrefHandler::prefetchDevices();
+    for (int i = 0; i < BENCH_DEVICES; i++) devices[i]->restart();
+    eeprom->setBusClock(NORMAL_CLOCK);
+}
+
+//A unit that has settings version stored for every device
+static void makeUnit(int version)
+{
+    remove(IMAGE_FILE);
+    powerCycle();
+    for (int i = 0; i < BENCH_DEVICES; i++)
+    {
+        devices[i]->restart(); //puts it in the device table
+        PrefHandler::setDeviceStatus(0x1100 + i, true);
+        devices[i]->restart();
+        devices[i]->setValues(version);
+        devices[i]->saveConfiguration();
+    }
+    memCache->FlushAllPages();
+    boot();
+}
+
+static void checkUnit(int version)
+{
+    memCache->FlushAllPages();
+    eeprom->setBusClock(0);
+    boot();
+    for (int i = 0; i < BENCH_DEVICES; i++) TEST_ASSERT_TRUE(devices[i]->hasValues(version));
+}
+
+static uint32_t transferMicros(uint32_t busMicros, uint32_t bytes)
+{
+    return busMicros + (uint32_t)((uint64_t)bytes * 1000000ull / LINK_RATE);
+}
+
+static void report(const char *path, uint32_t bytes, uint32_t busMicros, uint32_t cpuMicros)
+{
+    char msg[160];
+    snprintf(msg, sizeof(msg), "%-8s %7u bytes, %8uus of EEPROM, %7uus on the link, %6uus CPU: %.1fms", path, bytes, busMicros,
+             transferMicros(0, bytes), cpuMicros, transferMicros(busMicros, bytes) / 1000.0);
+    TEST_MESSAGE(msg);
+}
+
+//DeviceManager::createJsonConfigDoc and __populateJsonEntry as JSONDUMP uses them
+static void jsonConfigDoc(DynamicJsonDocument &doc)
+{
+    for (int j = 0; j < CFG_DEV_MGR_MAX_DEVICES; j++)
+    {
+        Device *dev = deviceManager.getDeviceByIdx(j);
+        if (!dev || !dev->isEnabled()) continue;
+        JsonObject devArr = doc.createNestedObject(dev->getShortName());
+        devArr["DevID"] = dev->getId();
+        for (const ConfigEntry &ent : *dev->getConfigEntries())
+        {
+            JsonObject devEntry = devArr.createNestedObject(ent.cfgName.c_str());
+            devEntry["HelpTxt"] = ent.helpText.c_str();
+            devEntry["Precision"] = ent.precision;
+            switch (ent.varType)
+            {
+            case CFG_ENTRY_VAR_TYPE::UINT16:
+                devEntry["Valu"] =  *((uint16_t *)(ent.varPtr));
+                devEntry["ValType"] = "UINT16";
+                devEntry["MinValue"] = ent.minValue.u_int;
+                devEntry["MaxValue"] = ent.maxValue.u_int;
+                break;
+            case CFG_ENTRY_VAR_TYPE::UINT32:
+                devEntry["Valu"] =  *((uint32_t *)(ent.varPtr));
+                devEntry["ValType"] = "UINT32";
+                devEntry["MinValue"] = ent.minValue.u_int;
+                devEntry["MaxValue"] = ent.maxValue.u_int;
+                break;
+            case CFG_ENTRY_VAR_TYPE::FLOAT:
+                devEntry["Valu"] =  *((float *)(ent.varPtr));
+                devEntry["ValType"] = "FLOAT";
+                devEntry["MinValue"] = ent.minValue.floating;
+                devEntry["MaxValue"] = ent.maxValue.floating;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+//SerialConsole::loadEEPROMJSON. That only sets the values in RAM. Every device saving its configuration
+//afterward is what it takes for them to stick so that's timed too
+static void jsonApply(DynamicJsonDocument &doc)
+{
+    JsonObject docObjs = doc.as<JsonObject>();
+    for (auto obj: docObjs)
+    {
+        JsonObject devObjs = obj.value().as<JsonObject>();
+        uint16_t id = devObjs["DevID"];
+        Device *dev = deviceManager.getDeviceByID((DeviceId)id);
+        if (!dev) continue;
+        for (auto devObj: devObjs)
+        {
+            const ConfigEntry *cfgEntry = dev->findConfigEntry(devObj.key().c_str());
+            if (!cfgEntry) continue;
+            switch (cfgEntry->varType)
+            {
+            case CFG_ENTRY_VAR_TYPE::UINT16:
+                *(uint16_t *)cfgEntry->varPtr = devObj.value()["Valu"].as<uint16_t>();
+                break;
+            case CFG_ENTRY_VAR_TYPE::UINT32:
+                *(uint32_t *)cfgEntry->varPtr = devObj.value()["Valu"].as<uint32_t>();
+                break;
+            case CFG_ENTRY_VAR_TYPE::FLOAT:
+                *(float *)cfgEntry->varPtr = devObj.value()["Valu"].as<float>();
+                break;
+            default:
+                break;
+            }
+        }
+        dev->saveConfiguration();
+    }
+    memCache->FlushAllPages();
+}
+
+void setUp()
+{
+    setSysClock(&simClock);
+    simClock.reset();
+    eeprom = nullptr;
+    makeUnit(1);
+}
+
+void tearDown()
+{
+    delete eeprom;
+    eeprom = nullptr;
+    setEEPROMStorage(nullptr);
+    remove(IMAGE_FILE);
+}
+
+void bench_transfer()
+{
+    BufferStream package;
+    std::vector<uint8_t> dump(1024 * 256);
+    std::string json;
+    uint8_t buffer[130];
+    uint32_t bytes;
+    uint32_t startTime;
+    uint32_t startCpu;
+
+    //out of the first unit
+    startCpu = micros();
+    startTime = simClock.micros();
+    TEST_ASSERT_TRUE(configPackage.exportTo(&package, &bytes));
+    uint32_t pkgOutBus = simClock.micros() - startTime;
+    uint32_t pkgOutCpu = micros() - startCpu;
+    TEST_ASSERT_EQUAL_UINT32(package.data.size(), bytes);
+
+    startCpu = micros();
+    startTime = simClock.micros();
+    for (int i = 0; i < (1024 * 256); i = i + 128)
+    {
+        TEST_ASSERT_TRUE(memCache->Read(i, buffer, 128));
+        memcpy(&dump[i], buffer, 128);
+    }
+    uint32_t binOutBus = simClock.micros() - startTime;
+    uint32_t binOutCpu = micros() - startCpu;
+
+    startCpu = micros();
+    startTime = simClock.micros();
+    {
+        DynamicJsonDocument doc(JSON_DOC_SIZE);
+        jsonConfigDoc(doc);
+        TEST_ASSERT_FALSE(doc.overflowed());
+        serializeJsonPretty(doc, json);
+        json += "\r\n";
+    }
+    uint32_t jsonOutBus = simClock.micros() - startTime;
+    uint32_t jsonOutCpu = micros() - startCpu;
+
+    TEST_MESSAGE("Export:");
+    report("package", package.data.size(), pkgOutBus, pkgOutCpu);
+    report("binary", dump.size(), binOutBus, binOutCpu);
+    report("JSON", json.size(), jsonOutBus, jsonOutCpu);
+
+    //and onto one with different settings. The package is staged in EEPROM first so a power cut can't leave
+    //half of it. JSONREAD just writes the values so its EEPROM time is about the least writing those
+    //settings can take
+    makeUnit(2);
+    startCpu = micros();
+    startTime = simClock.micros();
+    TEST_ASSERT_TRUE(configPackage.importFrom(&package, &bytes));
+    uint32_t pkgInBus = simClock.micros() - startTime;
+    uint32_t pkgInCpu = micros() - startCpu;
+    checkUnit(1);
+
+    makeUnit(2);
+    startCpu = micros();
+    startTime = simClock.micros();
+    for (int i = 0; i < (1024 * 256); i = i + 128)
+    {
+        memcpy(buffer, &dump[i], 128);
+        TEST_ASSERT_TRUE(memCache->Write(i, buffer, 128));
+    }
+    memCache->InvalidateAll();
+    uint32_t binInBus = simClock.micros() - startTime;
+    uint32_t binInCpu = micros() - startCpu;
+    checkUnit(1);
+
+    makeUnit(2);
+    startCpu = micros();
+    startTime = simClock.micros();
+    {
+        DynamicJsonDocument doc(JSON_DOC_SIZE);
+        TEST_ASSERT_TRUE(deserializeJson(doc, json) == DeserializationError::Ok);
+        TEST_ASSERT_FALSE(doc.overflowed());
+        jsonApply(doc);
+    }
+    uint32_t jsonInBus = simClock.micros() - startTime;
+    uint32_t jsonInCpu = micros() - startCpu;
+    checkUnit(1);
+
+    TEST_MESSAGE("Import:");
+    report("package", package.data.size(), pkgInBus, pkgInCpu);
+    report("binary", dump.size(), binInBus, binInCpu);
+    report("JSON", json.size(), jsonInBus, jsonInCpu);
+
+    uint32_t pkgTotal = transferMicros(pkgOutBus + pkgInBus, package.data.size() * 2);
+    uint32_t binTotal = transferMicros(binOutBus + binInBus, dump.size() * 2);
+    uint32_t jsonTotal = transferMicros(jsonOutBus + jsonInBus, json.size() * 2);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Round trip: package %.1fms, binary %.1fms (%.0fx), JSON %.1fms (%.1fx)", pkgTotal / 1000.0,
+             binTotal / 1000.0, (double)binTotal / pkgTotal, jsonTotal / 1000.0, (double)jsonTotal / pkgTotal);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_THAN_UINT32(dump.size() / 20, package.data.size());
+    TEST_ASSERT_LESS_THAN_UINT32(transferMicros(jsonOutBus, json.size()) / 4, transferMicros(pkgOutBus, package.data.size()));
+    TEST_ASSERT_LESS_THAN_UINT32(json.size() / 4, package.data.size());
+    TEST_ASSERT_LESS_THAN_UINT32(binTotal / 10, pkgTotal);
+    TEST_ASSERT_LESS_THAN_UINT32(transferMicros(jsonInBus, json.size()), transferMicros(pkgInBus, package.data.size()));
+    TEST_ASSERT_LESS_THAN_UINT32(jsonTotal, pkgTotal);
+}
+
+int main()
+{
+    for (int i = 0; i < BENCH_DEVICES; i++) devices[i] = new BenchDevice(i);
+    UNITY_BEGIN();
+    RUN_TEST(bench_transfer);
+    return UNITY_END();
+}
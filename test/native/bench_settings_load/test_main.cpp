@@ -0,0 +1,277 @@
+/*
+ * Benchmark for loading a device's settings at start up. A device with 40 stored settings reads all of
+ * them the way its loadConfiguration would, through PrefHandler as it is now and the way it used to be
+ * done: walk the [hash][length][value] chain through MemCache reads for every single key. The old look
+ * up is reproduced below as it was in PrefHandler before the key index. A second benchmark compares
+ * loading the whole block in one read against building the index (and reading every value) through
+ * MemCache one setting at a time, the way the first version of the index did, by how many cache
+ * lookups a device load takes. The cache is warm like it is after the boot prefetch so this is CPU
+ * time only.
+ * Run with: pio test -e native -f native/bench_settings_load
+ */
+
+#include <unity.h>
+#include <new>
+#include "EEPROMStorage.h"
+#include "MemCache.h"
+#include "PrefHandler.h"
+#include "WearLevel.h"
+#include "ChangeLog.h"
+#include "SysClock.h"
+
+#define IMAGE_FILE      "bench_settings_load.bin"
+#define BENCH_DEVICE    0x1100
+#define BENCH_SETTINGS  40
+#define BENCH_LOADS     2000
+#define BENCH_ROUNDS    5
+
+static SimulatedClock simClock;
+static FileEEPROM *eeprom;
+static MemCache cacheStore;
+static char keys[BENCH_SETTINGS][16];
+static uint32_t blockBase; //EEPROM address of the device's settings block
+
+static void powerCycle()
+{
+    delete eeprom;
+    eeprom = new FileEEPROM(IMAGE_FILE);
+    TEST_ASSERT_TRUE(eeprom->begin());
+    setEEPROMStorage(eeprom);
+    memCache = new (&cacheStore) MemCache();
+    memCache->setup();
+    wearLevel.setup();
+    changeLog.setup();
+}
+
+//How PrefHandler found a setting before it had an index
+static uint32_t oldFindSettingLocation(uint32_t hash)
+{
+    uint32_t readHash;
+    uint8_t readLength;
+    for (uint32_t idx = SETTINGS_START; idx < EE_DEVICE_SIZE;)
+    {
+        memCache->Read((uint32_t)idx + blockBase, &readHash);
+        if (readHash == hash) return (idx + 5);
+        idx += 4;
+        memCache->Read((uint32_t)idx + blockBase, &readLength);
+        idx += 1 + readLength;
+    }
+    return 0xFFFFFFFFul;
+}
+
+static bool oldRead(const char *key, uint32_t *val, uint32_t defval)
+{
+    uint32_t address = oldFindSettingLocation(StatusEntry::fnvHash(key));
+    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + blockBase, val);
+    *val = defval;
+    return true;
+}
+
+//How the first version of the index was built: two cache reads per setting to walk the chain. Values were
+//read through the cache afterward too. Sized for the benchmark's 40 settings instead of growing
+#define ENTRY_INDEX_SIZE    64
+
+static PrefIndexEntry entryIndex[ENTRY_INDEX_SIZE];
+
+static PrefIndexEntry *entryFind(uint32_t hash)
+{
+    for (uint16_t slot = hash & (ENTRY_INDEX_SIZE - 1); entryIndex[slot].hash != 0; slot = (slot + 1) & (ENTRY_INDEX_SIZE - 1))
+    {
+        if (entryIndex[slot].hash == hash) return &entryIndex[slot];
+    }
+    return nullptr;
+}
+
+static void entryBuildIndex()
+{
+    uint32_t readHash;
+    uint8_t readLength;
+    uint32_t idx;
+
+    memset(entryIndex, 0, sizeof(entryIndex));
+    for (idx = SETTINGS_START; idx < EE_DEVICE_SIZE;)
+    {
+        memCache->Read((uint32_t)idx + blockBase, &readHash);
+        if (readHash == 0xFFFFFFFFul) break;
+        memCache->Read((uint32_t)idx + 4 + blockBase, &readLength);
+        if (readHash != 0 && !entryFind(readHash))
+        {
+            uint16_t slot = readHash & (ENTRY_INDEX_SIZE - 1);
+            while (entryIndex[slot].hash != 0) slot = (slot + 1) & (ENTRY_INDEX_SIZE - 1);
+            entryIndex[slot].hash = readHash;
+            entryIndex[slot].offset = idx + 5;
+            entryIndex[slot].length = readLength;
+        }
+        idx += 5 + readLength;
+    }
+}
+
+static bool entryRead(const char *key, uint32_t *val, uint32_t defval)
+{
+    PrefIndexEntry *entry = entryFind(StatusEntry::fnvHash(key));
+    if (entry) return memCache->Read((uint32_t)entry->offset + blockBase, val);
+    *val = defval;
+    return true;
+}
+
+void setUp()
+{
+    remove(IMAGE_FILE);
+    setSysClock(&simClock);
+    simClock.reset();
+    eeprom = nullptr;
+    powerCycle();
+
+    PrefHandler prefs((DeviceId)BENCH_DEVICE);
+    PrefHandler::setDeviceStatus(BENCH_DEVICE, true);
+    for (int s = 0; s < BENCH_SETTINGS; s++)
+    {
+        snprintf(keys[s], sizeof(keys[s]), "Setting%i", s);
+        TEST_ASSERT_TRUE(prefs.write(keys[s], (uint32_t)(1000 + s)));
+    }
+    prefs.saveChecksum();
+    memCache->FlushAllPages();
+
+    powerCycle();
+    PrefHandler::prefetchDevices();
+    blockBase = EE_DEVICES_BASE + EE_DEVICE_SIZE * PrefHandler::findPosition(BENCH_DEVICE);
+}
+
+void tearDown()
+{
+    delete eeprom;
+    eeprom = nullptr;
+    setEEPROMStorage(nullptr);
+    remove(IMAGE_FILE);
+}
+
+//Every load is a fresh PrefHandler the way a device gets one at boot, index and all
+void bench_load_configuration()
+{
+    uint32_t value;
+    uint32_t oldSum = 0;
+    uint32_t newSum = 0;
+    uint32_t startTime;
+    char msg[128];
+
+    startTime = micros();
+    for (int i = 0; i < BENCH_LOADS; i++)
+    {
+        PrefHandler prefs((DeviceId)BENCH_DEVICE);
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            oldRead(keys[s], &value, 0);
+            oldSum += value;
+        }
+    }
+    uint32_t oldMicros = micros() - startTime;
+
+    startTime = micros();
+    for (int i = 0; i < BENCH_LOADS; i++)
+    {
+        PrefHandler prefs((DeviceId)BENCH_DEVICE);
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            prefs.read(keys[s], &value, 0);
+            newSum += value;
+        }
+    }
+    uint32_t newMicros = micros() - startTime;
+
+    TEST_ASSERT_EQUAL_UINT32(BENCH_LOADS * (BENCH_SETTINGS * 1000 + BENCH_SETTINGS * (BENCH_SETTINGS - 1) / 2), oldSum);
+    TEST_ASSERT_EQUAL_UINT32(oldSum, newSum);
+
+    snprintf(msg, sizeof(msg), "chain walk: %.2fus to load %i settings", (double)oldMicros / BENCH_LOADS, BENCH_SETTINGS);
+    TEST_MESSAGE(msg);
+    snprintf(msg, sizeof(msg), "key index:  %.2fus to load %i settings %.1fx faster", (double)newMicros / BENCH_LOADS,
+             BENCH_SETTINGS, (double)oldMicros / newMicros);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_THAN_UINT32(oldMicros, newMicros);
+}
+
+//Boot time per device: one read of the whole block and decoding it in RAM against a cache read for every
+//step of the chain and every value. On the Teensy each of those reads runs out of flash so the number of
+//them is what counts. On the host with a warm cache the two come out even in CPU time so only the
+//lookups are asserted
+static uint32_t cacheLookups()
+{
+    const MemCacheStats *stats = memCache->getStats();
+    return stats->hits + stats->misses;
+}
+
+//The host gets interrupted now and then, so both paths run a few rounds in turn and the fastest round counts
+static uint32_t entryRound(uint32_t *sum)
+{
+    uint32_t value;
+    uint32_t startTime = micros();
+    for (int i = 0; i < BENCH_LOADS; i++)
+    {
+        PrefHandler prefs((DeviceId)BENCH_DEVICE);
+        entryBuildIndex();
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            entryRead(keys[s], &value, 0);
+            *sum += value;
+        }
+    }
+    return micros() - startTime;
+}
+
+static uint32_t blockRound(uint32_t *sum)
+{
+    uint32_t value;
+    uint32_t startTime = micros();
+    for (int i = 0; i < BENCH_LOADS; i++)
+    {
+        PrefHandler prefs((DeviceId)BENCH_DEVICE);
+        for (int s = 0; s < BENCH_SETTINGS; s++)
+        {
+            prefs.read(keys[s], &value, 0);
+            *sum += value;
+        }
+    }
+    return micros() - startTime;
+}
+
+void bench_block_load()
+{
+    uint32_t entrySum = 0;
+    uint32_t blockSum = 0;
+    uint32_t entryMicros = 0xFFFFFFFFul;
+    uint32_t blockMicros = 0xFFFFFFFFul;
+    uint32_t startLookups;
+    uint32_t took;
+    char msg[128];
+
+    startLookups = cacheLookups();
+    entryRound(&entrySum);
+    uint32_t entryLookups = (cacheLookups() - startLookups) / BENCH_LOADS;
+    startLookups = cacheLookups();
+    blockRound(&blockSum);
+    uint32_t blockLookups = (cacheLookups() - startLookups) / BENCH_LOADS;
+    TEST_ASSERT_EQUAL_UINT32(entrySum, blockSum);
+
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        took = entryRound(&entrySum);
+        if (took < entryMicros) entryMicros = took;
+        took = blockRound(&blockSum);
+        if (took < blockMicros) blockMicros = took;
+    }
+
+    snprintf(msg, sizeof(msg), "setting by setting: %u cache lookups, %.2fus per device", entryLookups,
+             (double)entryMicros / BENCH_LOADS);
+    TEST_MESSAGE(msg);
+    snprintf(msg, sizeof(msg), "whole block:        %u cache lookups, %.2fus per device", blockLookups,
+             (double)blockMicros / BENCH_LOADS);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_THAN_UINT32(entryLookups / 10, blockLookups);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(bench_load_configuration);
+    RUN_TEST(bench_block_load);
+    return UNITY_END();
+}
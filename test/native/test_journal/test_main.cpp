@@ -0,0 +1,222 @@
+/*
+ * Fault injection for the MemCache journal. A transaction that changes three pages is committed over and over,
+ * each time with the power cut after one more byte has reached the EEPROM. After every cut the next start up has
+ * to come back with either all of the old pages or all of the new ones, never a mix and never a torn page.
+ * Run with: pio test -e native -f native/test_journal
+ */
+
+#include <unity.h>
+#include <new>
+#include "EEPROMStorage.h"
+#include "MemCache.h"
+#include "SysClock.h"
+#include "Logger.h"
+
+#define IMAGE_FILE "test_journal.bin"
+
+//three pages in the device area, each changed over a different span so partial page writes get cut too
+static const uint32_t txnPages[3] = { 0x1000, 0x1100, 0x5000 };
+static const uint8_t spanLow[3] = { 0, 10, 200 };
+static const uint8_t spanHigh[3] = { 255, 60, 255 };
+
+static SimulatedClock simClock;
+static FileEEPROM *eeprom;
+static MemCache cacheStore;
+static MemCache *cache = &cacheStore;
+static uint8_t startImage[EEPROM_SIZE];
+
+static uint8_t oldByte(int page, int offset)
+{
+    return (uint8_t)(page * 37 + offset);
+}
+
+static uint8_t newByte(int page, int offset)
+{
+    if (offset < spanLow[page] || offset > spanHigh[page]) return oldByte(page, offset);
+    return (uint8_t)~(page * 37 + offset);
+}
+
+static void powerUp()
+{
+    delete eeprom;
+    eeprom = new FileEEPROM(IMAGE_FILE);
+    TEST_ASSERT_TRUE(eeprom->begin());
+    setEEPROMStorage(eeprom);
+    new (cache) MemCache();
+    cache->setup();
+}
+
+static void saveImage()
+{
+    FILE *f = fopen(IMAGE_FILE, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(EEPROM_SIZE, fread(startImage, 1, EEPROM_SIZE, f));
+    fclose(f);
+}
+
+static void restoreImage()
+{
+    delete eeprom;
+    eeprom = nullptr;
+    FILE *f = fopen(IMAGE_FILE, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    fwrite(startImage, 1, EEPROM_SIZE, f);
+    fclose(f);
+}
+
+static void commitNewPages()
+{
+    uint8_t data[256];
+
+    cache->beginTransaction();
+    for (int p = 0; p < 3; p++)
+    {
+        for (int i = spanLow[p]; i <= spanHigh[p]; i++) data[i] = newByte(p, i);
+        cache->Write(txnPages[p] + spanLow[p], &data[spanLow[p]], spanHigh[p] - spanLow[p] + 1);
+    }
+    cache->commitTransaction();
+    cache->waitForWrite();
+}
+
+//0 if every page is still old, 1 if every page is new, -1 for anything else
+static int pageState()
+{
+    uint8_t data[256];
+    int state = -1;
+
+    for (int p = 0; p < 3; p++)
+    {
+        TEST_ASSERT_TRUE(cache->Read(txnPages[p], data, 256));
+        bool isOld = true, isNew = true;
+        for (int i = 0; i < 256; i++)
+        {
+            if (data[i] != oldByte(p, i)) isOld = false;
+            if (data[i] != newByte(p, i)) isNew = false;
+        }
+        int pageIs = isOld ? 0 : (isNew ? 1 : -1);
+        if (pageIs == -1 || (state != -1 && pageIs != state)) return -1;
+        state = pageIs;
+    }
+    return state;
+}
+
+static bool journalOpen()
+{
+    uint32_t magic;
+    cache->ReadDirect(EE_JOURNAL, &magic, sizeof(magic));
+    return magic == JOURNAL_MAGIC;
+}
+
+void setUp()
+{
+    uint8_t data[256];
+
+    remove(IMAGE_FILE);
+    setSysClock(&simClock);
+    simClock.reset();
+    Logger::setLoglevel(Logger::Error); //every replay logs a warning
+    eeprom = nullptr;
+    powerUp();
+    for (int p = 0; p < 3; p++)
+    {
+        for (int i = 0; i < 256; i++) data[i] = oldByte(p, i);
+        cache->Write(txnPages[p], data, 256);
+    }
+    cache->FlushAllPages();
+    saveImage();
+}
+
+void tearDown()
+{
+    delete eeprom;
+    eeprom = nullptr;
+    setEEPROMStorage(nullptr);
+    Logger::setLoglevel(Logger::Warn);
+    remove(IMAGE_FILE);
+}
+
+//bytes the whole commit puts on the chip when nothing goes wrong
+static uint32_t commitBytes()
+{
+    restoreImage();
+    powerUp();
+    uint32_t start = eeprom->getBytesWritten();
+    commitNewPages();
+    return eeprom->getBytesWritten() - start;
+}
+
+void test_cut_at_every_byte_of_a_commit()
+{
+    uint32_t total = commitBytes();
+    uint32_t sawOld = 0, sawNew = 0;
+    char msg[64];
+
+    TEST_ASSERT_GREATER_THAN(3 * 256, total);
+    for (uint32_t cut = 0; cut <= total; cut++)
+    {
+        restoreImage();
+        powerUp();
+        eeprom->cutPowerAfter(cut);
+        commitNewPages();
+        TEST_ASSERT_EQUAL(cut < total, eeprom->powerLost());
+
+        powerUp(); //journalRecover runs here
+        snprintf(msg, sizeof(msg), "power cut after %u of %u bytes", cut, total);
+        int state = pageState();
+        TEST_ASSERT_TRUE_MESSAGE(state != -1, msg);
+        TEST_ASSERT_FALSE_MESSAGE(journalOpen(), msg);
+        if (state == 0) sawOld++;
+        else sawNew++;
+    }
+    //early cuts have to roll back and late ones forward or the test didn't prove much
+    TEST_ASSERT_GREATER_THAN(0, sawOld);
+    TEST_ASSERT_GREATER_THAN(0, sawNew);
+}
+
+//the replay at start up can lose power too. It has to be safe to run again from the top
+void test_cut_at_every_byte_of_a_replay()
+{
+    uint32_t total = commitBytes();
+    uint32_t replayBytes = 0;
+    uint32_t journalBytes = total - (256 + (60 - 10 + 1) + (255 - 200 + 1)) - sizeof(uint32_t); //journal and header only
+    char msg[64];
+
+    //leave a complete journal with none of the home pages written then save that as the starting point
+    restoreImage();
+    powerUp();
+    eeprom->cutPowerAfter(journalBytes);
+    commitNewPages();
+    TEST_ASSERT_TRUE(eeprom->powerLost());
+    delete eeprom;
+    eeprom = nullptr;
+    saveImage();
+
+    powerUp();
+    replayBytes = eeprom->getBytesWritten();
+    TEST_ASSERT_EQUAL(1, pageState());
+    TEST_ASSERT_GREATER_THAN(3 * 256, replayBytes);
+
+    for (uint32_t cut = 0; cut <= replayBytes; cut++)
+    {
+        restoreImage();
+        eeprom = new FileEEPROM(IMAGE_FILE);
+        TEST_ASSERT_TRUE(eeprom->begin());
+        setEEPROMStorage(eeprom);
+        eeprom->cutPowerAfter(cut);
+        new (cache) MemCache();
+        cache->setup();
+
+        powerUp();
+        snprintf(msg, sizeof(msg), "power cut after %u of %u replay bytes", cut, replayBytes);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(1, pageState(), msg);
+        TEST_ASSERT_FALSE_MESSAGE(journalOpen(), msg);
+    }
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_cut_at_every_byte_of_a_commit);
+    RUN_TEST(test_cut_at_every_byte_of_a_replay);
+    return UNITY_END();
+}
@@ -0,0 +1,169 @@
+/*
+ * Host tests for the file backed EEPROM emulator and for MemCache running on top of it.
+ * Run with: pio test -e native -f native/test_storage
+ */
+
+#include <unity.h>
+#include <new>
+#include "EEPROMStorage.h"
+#include "MemCache.h"
+#include "SysClock.h"
+
+#define IMAGE_FILE "test_storage.bin"
+
+static SimulatedClock simClock;
+static FileEEPROM *eeprom;
+static MemCache cacheStore;
+static MemCache *cache = &cacheStore;
+
+//a fresh MemCache on the same file is what the next power up would see
+static void powerCycle()
+{
+    delete eeprom;
+    eeprom = new FileEEPROM(IMAGE_FILE);
+    TEST_ASSERT_TRUE(eeprom->begin());
+    setEEPROMStorage(eeprom);
+    new (cache) MemCache();
+    cache->setup();
+}
+
+void setUp()
+{
+    remove(IMAGE_FILE);
+    setSysClock(&simClock);
+    simClock.reset();
+    eeprom = nullptr;
+    powerCycle();
+}
+
+void tearDown()
+{
+    delete eeprom;
+    eeprom = nullptr;
+    setEEPROMStorage(nullptr);
+    remove(IMAGE_FILE);
+}
+
+void test_blank_chip_reads_ff()
+{
+    uint8_t buffer[16];
+    TEST_ASSERT_TRUE(eeprom->read(1000, buffer, sizeof(buffer)));
+    for (int i = 0; i < 16; i++) TEST_ASSERT_EQUAL_HEX8(0xFF, buffer[i]);
+}
+
+void test_write_wraps_within_page()
+{
+    uint8_t data[4] = { 1, 2, 3, 4 };
+    uint8_t buffer[4];
+
+    TEST_ASSERT_TRUE(eeprom->startWrite(0x1FE, data, 4)); //last two bytes of page 1 then wraps
+    simClock.advance(10000);
+    TEST_ASSERT_TRUE(eeprom->serviceWrite() == StorageWrite::DONE);
+    TEST_ASSERT_TRUE(eeprom->read(0x1FE, buffer, 2));
+    TEST_ASSERT_EQUAL_HEX8(1, buffer[0]);
+    TEST_ASSERT_EQUAL_HEX8(2, buffer[1]);
+    TEST_ASSERT_TRUE(eeprom->read(0x100, buffer, 2));
+    TEST_ASSERT_EQUAL_HEX8(3, buffer[0]);
+    TEST_ASSERT_EQUAL_HEX8(4, buffer[1]);
+    TEST_ASSERT_TRUE(eeprom->read(0x200, buffer, 1));
+    TEST_ASSERT_EQUAL_HEX8(0xFF, buffer[0]);
+}
+
+void test_chip_is_busy_for_write_time()
+{
+    uint8_t data = 0x55;
+    uint8_t buffer;
+
+    eeprom->setWriteTime(3000);
+    TEST_ASSERT_TRUE(eeprom->startWrite(0, &data, 1));
+    TEST_ASSERT_FALSE(eeprom->startWrite(1, &data, 1)); //one write at a time
+    simClock.advance(2999);
+    TEST_ASSERT_TRUE(eeprom->serviceWrite() == StorageWrite::BUSY);
+    TEST_ASSERT_FALSE(eeprom->read(0, &buffer, 1)); //doesn't answer while writing
+    simClock.advance(1);
+    TEST_ASSERT_TRUE(eeprom->serviceWrite() == StorageWrite::DONE);
+    TEST_ASSERT_TRUE(eeprom->read(0, &buffer, 1));
+    TEST_ASSERT_EQUAL_HEX8(0x55, buffer);
+}
+
+void test_worn_bytes_stop_changing()
+{
+    uint8_t buffer;
+
+    eeprom->setEndurance(2);
+    for (uint8_t val = 1; val <= 3; val++)
+    {
+        TEST_ASSERT_TRUE(eeprom->startWrite(10, &val, 1));
+        simClock.advance(10000);
+        eeprom->serviceWrite();
+    }
+    TEST_ASSERT_TRUE(eeprom->read(10, &buffer, 1));
+    TEST_ASSERT_EQUAL_HEX8(2, buffer);
+    TEST_ASSERT_EQUAL_UINT32(2, eeprom->getWrites(10));
+    TEST_ASSERT_EQUAL_UINT32(1, eeprom->getWornBytes());
+}
+
+void test_cache_flush_reaches_file()
+{
+    uint32_t value = 0;
+
+    TEST_ASSERT_TRUE(cache->Write(5000, (uint32_t)0xDEADBEEF));
+    cache->FlushAllPages(); //waits on the simulated clock
+    TEST_ASSERT_GREATER_OR_EQUAL(5000, simClock.getTime());
+    powerCycle();
+    TEST_ASSERT_TRUE(cache->Read(5000, &value));
+    TEST_ASSERT_EQUAL_HEX32(0xDEADBEEF, value);
+}
+
+void test_transaction_lands_together()
+{
+    uint8_t a = 0, b = 0;
+
+    cache->beginTransaction();
+    cache->Write(0x2000, (uint8_t)11);
+    cache->Write(0x3000, (uint8_t)22);
+    cache->commitTransaction();
+    cache->waitForWrite();
+    powerCycle();
+    cache->Read(0x2000, &a);
+    cache->Read(0x3000, &b);
+    TEST_ASSERT_EQUAL_UINT8(11, a);
+    TEST_ASSERT_EQUAL_UINT8(22, b);
+    uint32_t magic;
+    TEST_ASSERT_TRUE(eeprom->read(EE_JOURNAL, (uint8_t *)&magic, sizeof(magic)));
+    TEST_ASSERT_EQUAL_HEX32(0, magic); //journal was written then cleared once both pages were home
+}
+
+void test_abort_keeps_earlier_changes()
+{
+    uint8_t a = 0, b = 0;
+
+    cache->Write(0x2000, (uint8_t)1); //dirty but not written yet when the transaction starts
+    cache->beginTransaction();
+    cache->Write(0x2001, (uint8_t)2);
+    cache->Write(0x3000, (uint8_t)3);
+    cache->abortTransaction();
+    cache->Read(0x2000, &a);
+    cache->Read(0x2001, &b);
+    TEST_ASSERT_EQUAL_UINT8(1, a);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, b);
+    cache->FlushAllPages();
+    powerCycle();
+    cache->Read(0x2000, &a);
+    cache->Read(0x3000, &b);
+    TEST_ASSERT_EQUAL_UINT8(1, a);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, b);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_blank_chip_reads_ff);
+    RUN_TEST(test_write_wraps_within_page);
+    RUN_TEST(test_chip_is_busy_for_write_time);
+    RUN_TEST(test_worn_bytes_stop_changing);
+    RUN_TEST(test_cache_flush_reaches_file);
+    RUN_TEST(test_transaction_lands_together);
+    RUN_TEST(test_abort_keeps_earlier_changes);
+    return UNITY_END();
+}
@@ -0,0 +1,204 @@
+/*
+ * The loop stall monitor against the settings operations that block the loop for a long time: compaction,
+ * import and schema migration, each on a full settings block with the EEPROM at the normal bus speed. Time
+ * only moves when the EEPROM emulator charges for the bus and the chip's writes. The clock below runs the
+ * stall monitor every CFG_SUPERVISOR_STALL_CHECK of that time, like its timer interrupt would.
+ * Run with: pio test -e native -f native/test_supervisor
+ */
+
+#include <unity.h>
+#include <new>
+#include "EEPROMStorage.h"
+#include "MemCache.h"
+#include "PrefHandler.h"
+#include "WearLevel.h"
+#include "ChangeLog.h"
+#include "Supervisor.h"
+#include "SysClock.h"
+#include "Watchdog_t4.h"
+
+#define IMAGE_FILE      "test_supervisor.bin"
+#define TEST_DEVICE     0x1100
+#define OTHER_DEVICE    0x1101
+#define TEST_SETTINGS   40
+#define NORMAL_CLOCK    100000 //what Wire runs at unless told otherwise
+
+extern WDT_T4<WDT3> wdt;
+
+//Simulated time that the stall monitor keeps an eye on. Time here only passes because the code under test
+//is busy so it doesn't count as simulated to the supervisor
+class MonitoredClock : public SimulatedClock {
+public:
+    void delay(uint32_t ms)
+    {
+        delayMicroseconds(ms * 1000ul);
+    }
+
+    void delayMicroseconds(uint32_t us)
+    {
+        while (us > 0)
+        {
+            uint64_t toCheck = nextCheck - getTime();
+            uint32_t step = (us < toCheck) ? us : (uint32_t)toCheck;
+            advance(step);
+            us -= step;
+            if (getTime() >= nextCheck)
+            {
+                nextCheck += CFG_SUPERVISOR_STALL_CHECK;
+                supervisor.handleInterrupt();
+            }
+        }
+    }
+
+    bool isSimulated()
+    {
+        return false;
+    }
+
+    void start()
+    {
+        reset();
+        nextCheck = CFG_SUPERVISOR_STALL_CHECK;
+    }
+
+private:
+    uint64_t nextCheck;
+};
+
+static MonitoredClock monClock;
+static FileEEPROM *eeprom;
+static MemCache cacheStore;
+static char keys[TEST_SETTINGS][16];
+
+static void powerCycle()
+{
+    delete eeprom;
+    eeprom = new FileEEPROM(IMAGE_FILE);
+    TEST_ASSERT_TRUE(eeprom->begin());
+    setEEPROMStorage(eeprom);
+    memCache = new (&cacheStore) MemCache();
+    memCache->setup();
+    wearLevel.setup();
+    changeLog.setup();
+}
+
+//Every other setting is erased again so the block has plenty for compaction to get back
+static void fillDevice(DeviceId id)
+{
+    PrefHandler prefs(id);
+    for (int s = 0; s < TEST_SETTINGS; s++) TEST_ASSERT_TRUE(prefs.write(keys[s], (uint32_t)(1000 + s)));
+    for (int s = 1; s < TEST_SETTINGS; s += 2) TEST_ASSERT_TRUE(prefs.eraseByKey(keys[s]));
+    prefs.saveChecksum();
+    memCache->FlushAllPages();
+}
+
+//Fresh from a power up like at boot, where migrations and staged imports run, with nothing cached and the
+//EEPROM at the normal bus speed. From here on the stall monitor is running
+static uint32_t startMonitor()
+{
+    powerCycle();
+    eeprom->setBusClock(NORMAL_CLOCK);
+    supervisor.setup();
+    wdt.resets = 0;
+    return monClock.millis();
+}
+
+static bool renameAll(PrefHandler *prefs)
+{
+    char newKey[16];
+    //the odd ones were erased
+    for (int s = 0; s < TEST_SETTINGS; s += 2)
+    {
+        snprintf(newKey, sizeof(newKey), "Renamed%i", s);
+        if (!prefs->renameKey(keys[s], newKey)) return false;
+    }
+    return true;
+}
+
+void setUp()
+{
+    remove(IMAGE_FILE);
+    setSysClock(&monClock);
+    monClock.start();
+    eeprom = nullptr;
+    powerCycle();
+    for (int s = 0; s < TEST_SETTINGS; s++) snprintf(keys[s], sizeof(keys[s]), "Setting%i", s);
+    PrefHandler::setDeviceStatus(TEST_DEVICE, true);
+    PrefHandler::setDeviceStatus(OTHER_DEVICE, true);
+}
+
+void tearDown()
+{
+    supervisor.endLongOperation(); //in case a test failed inside one
+    delete eeprom;
+    eeprom = nullptr;
+    setEEPROMStorage(nullptr);
+    remove(IMAGE_FILE);
+}
+
+//the clock above really does trip the monitor when the loop doesn't get back in time
+void test_stall_is_caught()
+{
+    startMonitor();
+    monClock.delay(CFG_LOOP_STALL_TIMEOUT / 2);
+    supervisor.pet();
+    monClock.delay(CFG_LOOP_STALL_TIMEOUT / 2);
+    TEST_ASSERT_EQUAL_UINT32(0, wdt.resets);
+    monClock.delay(CFG_LOOP_STALL_TIMEOUT);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, wdt.resets);
+}
+
+void test_compaction_is_a_long_operation()
+{
+    fillDevice((DeviceId)TEST_DEVICE);
+
+    uint32_t start = startMonitor();
+    PrefHandler prefs((DeviceId)TEST_DEVICE);
+    TEST_ASSERT_TRUE(prefs.compact());
+    TEST_ASSERT_GREATER_THAN_UINT32(CFG_LOOP_STALL_TIMEOUT, monClock.millis() - start);
+    TEST_ASSERT_EQUAL_UINT32(0, wdt.resets);
+}
+
+void test_import_is_a_long_operation()
+{
+    uint8_t image[EE_DEVICE_SIZE - SETTINGS_START];
+    uint16_t version;
+    int len;
+    fillDevice((DeviceId)TEST_DEVICE);
+    {
+        PrefHandler prefs((DeviceId)TEST_DEVICE);
+        len = prefs.exportSettings(image, &version);
+    }
+    TEST_ASSERT_GREATER_THAN(0, len);
+
+    uint32_t start = startMonitor();
+    PrefHandler other((DeviceId)OTHER_DEVICE);
+    TEST_ASSERT_TRUE(other.importSettings(image, len, version));
+    TEST_ASSERT_GREATER_THAN_UINT32(CFG_LOOP_STALL_TIMEOUT, monClock.millis() - start);
+    TEST_ASSERT_EQUAL_UINT32(0, wdt.resets);
+}
+
+void test_migration_is_a_long_operation()
+{
+    uint32_t value;
+    fillDevice((DeviceId)TEST_DEVICE);
+    TEST_ASSERT_TRUE(PrefHandler::registerMigration((DeviceId)TEST_DEVICE, 0, renameAll));
+
+    uint32_t start = startMonitor();
+    PrefHandler prefs((DeviceId)TEST_DEVICE);
+    TEST_ASSERT_TRUE(prefs.migrateSchema(1));
+    TEST_ASSERT_GREATER_THAN_UINT32(CFG_LOOP_STALL_TIMEOUT, monClock.millis() - start);
+    TEST_ASSERT_EQUAL_UINT32(0, wdt.resets);
+    TEST_ASSERT_TRUE(prefs.read("Renamed6", &value, 0));
+    TEST_ASSERT_EQUAL_UINT32(1006, value);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_stall_is_caught);
+    RUN_TEST(test_compaction_is_a_long_operation);
+    RUN_TEST(test_import_is_a_long_operation);
+    RUN_TEST(test_migration_is_a_long_operation);
+    return UNITY_END();
+}